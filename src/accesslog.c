@@ -0,0 +1,253 @@
+/**
+ * @file accesslog.c
+ *
+ * Implementacao do access log binario.
+ *
+ * O segmento e criado ja com todos os blocos reservados no disco
+ * (posix_fallocate()) e mapeado inteiro - um arquivo esparso daria
+ * SIGBUS no primeiro registro que nao coubesse num disco cheio. Cada
+ * registro e so uma copia para a memoria e um store em
+ * #accesslog_header.count. Quem escreve no disco e o kernel, quando
+ * quiser - e, como o mapeamento e MAP_SHARED, os registros sobrevivem
+ * ate a uma queda do servidor. So a troca de segmento (uma a cada
+ * meio milhao de requests, no tamanho padrao) faz chamadas ao sistema.
+ */
+
+#include <stdio.h>      /* snprintf()                                */
+#include <string.h>     /* memcpy() memset()                         */
+#include <errno.h>      /* errno EEXIST ENOENT EINVAL                */
+#include <fcntl.h>      /* open() posix_fallocate() O_CREAT O_EXCL   */
+#include <unistd.h>     /* ftruncate() close() unlink()              */
+#include <time.h>       /* clock_gettime()                           */
+#include <sys/mman.h>   /* mmap() munmap()                           */
+
+#include "accesslog.h"
+#include "client.h"
+#include "timer.h"
+#include "macros.h"
+
+
+__thread struct access_log* accesslog_local = NULL;
+
+
+/** Escreve em 'buf' o nome do segmento 'sequence' de 'a'. */
+static void accesslog_segment_name(struct access_log* a, uint32_t sequence, char* buf, size_t size)
+{
+  snprintf(buf, size, "%s.%d.%06u", a->prefix, a->worker, sequence);
+}
+
+
+/** Cria e mapeia um segmento novo - o primeiro numero livre a partir de
+ *  #a->sequence - e apaga o que ficou mais de #a->keep segmentos atras.
+ *
+ *  @return 0 em sucesso, -1 em erro (errno e setado).
+ */
+static int accesslog_segment_open(struct access_log* a)
+{
+  struct timespec ts;
+  char name[BUFFER_SIZE];
+  void* map;
+  int error;
+
+  while (1)
+  {
+    accesslog_segment_name(a, a->sequence, name, sizeof(name));
+    a->fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (a->fd != -1)
+      break;
+
+    // Sobrou de uma execucao anterior - nao vamos sobrescrever
+    if (errno != EEXIST)
+      return -1;
+    a->sequence++;
+  }
+
+  // Sem espaco no disco, melhor nao ter o segmento do que um SIGBUS depois
+  error = posix_fallocate(a->fd, 0, a->segment_size);
+  if (error != 0)
+  {
+    errno = error;
+    goto error;
+  }
+
+  map = mmap(NULL, a->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+  if (map == MAP_FAILED)
+    goto error;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  a->header = map;
+  memcpy(a->header->magic, ACCESSLOG_MAGIC, sizeof(a->header->magic));
+  a->header->version     = ACCESSLOG_VERSION;
+  a->header->record_size = ACCESSLOG_RECORD_SIZE;
+  a->header->worker      = a->worker;
+  a->header->sequence    = a->sequence;
+  a->header->created     = ((uint64_t)ts.tv_sec * TIMER_NS_PER_SEC) + ts.tv_nsec;
+  a->header->count       = 0;
+
+  if ((a->keep > 0) && (a->sequence >= (uint32_t)a->keep))
+  {
+    accesslog_segment_name(a, a->sequence - a->keep, name, sizeof(name));
+    if ((unlink(name) == -1) && (errno != ENOENT))
+      LOG_PERROR("Erro em accesslog_segment_open() - unlink()");
+  }
+  return 0;
+
+error:
+  error = errno;
+  accesslog_segment_name(a, a->sequence, name, sizeof(name));
+  unlink(name);
+  close(a->fd);
+  a->fd = -1;
+  errno = error;
+  return -1;
+}
+
+
+/** Fecha o segmento atual de 'a', cortando o arquivo no ultimo registro. */
+static void accesslog_segment_close(struct access_log* a)
+{
+  off_t used;
+
+  if (a->header == NULL)
+    return;
+
+  used = (off_t)(a->header->count + 1) * ACCESSLOG_RECORD_SIZE;
+  munmap(a->header, a->segment_size);
+  a->header = NULL;
+
+  if (ftruncate(a->fd, used) == -1)
+    LOG_PERROR("Erro em accesslog_segment_close() - ftruncate()");
+  close(a->fd);
+  a->fd = -1;
+}
+
+
+/** Prepara 'a' para guardar as requests do worker 'worker' em segmentos
+ *  de 'segment_size' bytes chamados 'prefix'.WORKER.SEQUENCIA, guardando
+ *  os 'keep' mais novos (0 guarda todos), e ja cria o primeiro.
+ *
+ *  @return 0 em sucesso, -1 em erro (errno e setado).
+ */
+int accesslog_open(struct access_log* a, const char* prefix, int worker, size_t segment_size, int keep)
+{
+  struct timespec ts;
+
+  // Um numero inteiro de registros, e pelo menos um alem do header
+  segment_size -= segment_size % ACCESSLOG_RECORD_SIZE;
+  if (segment_size < (2 * ACCESSLOG_RECORD_SIZE))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  a->prefix       = prefix;
+  a->worker       = worker;
+  a->segment_size = segment_size;
+  a->keep         = keep;
+  a->fd           = -1;
+  a->sequence     = 0;
+  a->header       = NULL;
+  a->capacity     = (segment_size / ACCESSLOG_RECORD_SIZE) - 1;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  a->realtime = ((int64_t)ts.tv_sec * TIMER_NS_PER_SEC) + ts.tv_nsec - timer_monotonic_ns();
+
+  return accesslog_segment_open(a);
+}
+
+
+/** Fecha o segmento atual de 'a'. */
+void accesslog_close(struct access_log* a)
+{
+  accesslog_segment_close(a);
+}
+
+
+/** Faz as requests da thread atual irem para 'a' (ou para lugar
+ *  nenhum, com NULL).
+ */
+void accesslog_attach(struct access_log* a)
+{
+  accesslog_local = a;
+}
+
+
+/** 'ns' em ms, parando em UINT32_MAX - um download lento passa facil
+ *  dos 71 minutos que caberiam em us.
+ */
+static uint32_t accesslog_ms(int64_t ns)
+{
+  int64_t ms = ns / TIMER_NS_PER_MS;
+
+  if (ms < 0)
+    return 0;
+  return (ms > UINT32_MAX) ? UINT32_MAX : (uint32_t)ms;
+}
+
+
+/** Grava a resposta atual de 'h' no access log da thread. */
+static void accesslog_request(struct c_handler* h, int flags)
+{
+  struct access_log* a = accesslog_local;
+  struct accesslog_record* r;
+  struct http_parser* parser;
+  int64_t now;
+  int size;
+
+  if (h->buf == NULL)
+    return;
+
+  if (a->header->count == a->capacity)
+  {
+    accesslog_segment_close(a);
+    a->sequence++;
+    if (accesslog_segment_open(a) == -1)
+    {
+      LOG_PERROR("Erro em accesslog_request() - access log desligado");
+      accesslog_local = NULL;
+      return;
+    }
+  }
+
+  now    = timer_now();
+  parser = &(h->buf->parser);
+  size   = parser->target.size;
+  if (size > ACCESSLOG_PATH_SIZE)
+  {
+    size = ACCESSLOG_PATH_SIZE;
+    flags |= ACCESSLOG_PATH_CUT;
+  }
+
+  r = (struct accesslog_record*)(a->header + 1) + a->header->count;
+  r->time      = now + a->realtime;
+  r->bytes     = h->cold->output_sizesent;
+  r->duration  = (h->cold->t_request != 0) ? accesslog_ms(now - h->cold->t_request) : 0;
+  r->throttled = accesslog_ms(h->cold->throttled_ns);
+  r->addr      = h->cold->peer_addr;
+  r->port      = h->cold->peer_port;
+  r->status    = (h->cold->filestatus > 0) ? h->cold->filestatus : 0;
+  r->method    = parser->method;
+  r->flags     = flags;
+  r->path_size = size;
+  r->reserved  = 0;
+  memcpy(r->path, h->buf->request + parser->target.begin, size);
+
+  // So depois do registro inteiro: quem le o segmento confia em 'count'
+  __atomic_store_n(&(a->header->count), a->header->count + 1, __ATOMIC_RELEASE);
+}
+
+
+/** 'h' sai de FILE_SENDING, indo para 'state'. Ao terminar (FILE_SENT)
+ *  ou desistir (FINISHED), grava a resposta.
+ *
+ *  @note Chamada por c_handler_set_state(), so com um access log
+ *        ligado e antes de #h->state mudar.
+ */
+void accesslog_state(struct c_handler* h, int state)
+{
+  if (state == FILE_SENT)
+    accesslog_request(h, 0);
+  else if (state == FINISHED)
+    accesslog_request(h, ACCESSLOG_ABORTED);
+}
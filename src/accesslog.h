@@ -0,0 +1,111 @@
+/**
+ * @file accesslog.h
+ *
+ * Definicao do access log binario.
+ *
+ * Cada resposta vira um registro de tamanho fixo (#accesslog_record),
+ * copiado direto para um arquivo mapeado com mmap() - nada de
+ * snprintf() nem de write() por request. Cada worker tem os seus
+ * arquivos (um escritor so, sem lock); quando um enche, o worker passa
+ * para o proximo ('segmentos') e apaga os mais antigos alem de
+ * #access_log.keep.
+ *
+ * Os segmentos se chamam PREFIXO.WORKER.SEQUENCIA e comecam com um
+ * #accesslog_header. O decodificador (src/tools/decode.c, 'make decoder')
+ * transforma segmentos em texto ou CSV.
+ */
+
+#ifndef ACCESSLOG_H_DEFINED
+#define ACCESSLOG_H_DEFINED
+
+#include <stdint.h>
+#include <stddef.h>     /* size_t                                    */
+
+
+/** Identifica um segmento (sem o '\0') */
+#define ACCESSLOG_MAGIC        "SERVWLOG"
+#define ACCESSLOG_VERSION      2
+
+/** Tamanho do header e de cada registro */
+#define ACCESSLOG_RECORD_SIZE  128
+
+/** Quanto do alvo da request cabe num registro */
+#define ACCESSLOG_PATH_SIZE    92
+
+/** Tamanho padrao de cada segmento (--access-log-size) */
+#define ACCESSLOG_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/** Segmentos guardados por worker (--access-log-keep) */
+#define ACCESSLOG_KEEP         16
+
+
+/** Valores de #accesslog_record.flags. Possuem prefixo 'ACCESSLOG_'. */
+enum accesslog_flags
+{
+  ACCESSLOG_ABORTED  = 1,  /**< A conexao acabou antes da resposta inteira sair */
+  ACCESSLOG_PATH_CUT = 2   /**< O alvo nao coube em #accesslog_record.path */
+};
+
+
+/** O comeco de cada segmento. */
+struct accesslog_header
+{
+  char     magic[8];       /**< #ACCESSLOG_MAGIC */
+  uint32_t version;        /**< #ACCESSLOG_VERSION */
+  uint32_t record_size;    /**< #ACCESSLOG_RECORD_SIZE */
+  uint32_t worker;         /**< Quem escreveu */
+  uint32_t sequence;       /**< Numero do segmento desse worker */
+  uint64_t created;        /**< Quando foi criado, em ns desde 1970 */
+  uint64_t count;          /**< Registros escritos - atualizado depois de cada um */
+  char     reserved[ACCESSLOG_RECORD_SIZE - 40];
+};
+
+/** Uma resposta. Os numeros ficam na ordem de bytes da maquina. */
+struct accesslog_record
+{
+  uint64_t time;           /**< Fim da resposta, em ns desde 1970 */
+  uint64_t bytes;          /**< Bytes enviados (header e corpo) */
+  uint32_t duration;       /**< Do comeco da request ao fim da resposta, em ms - para em
+                             *  UINT32_MAX (49 dias), nunca da a volta */
+  uint32_t throttled;      /**< A parte de #duration parada pelo controle de banda, em ms -
+                             *  tambem para em UINT32_MAX */
+  uint32_t addr;           /**< IPv4 do cliente, na ordem da rede - 0 se desconhecido */
+  uint16_t port;           /**< Porta do cliente */
+  uint16_t status;         /**< Status code */
+  int8_t   method;         /**< Um dos #http_methods */
+  uint8_t  flags;          /**< #accesslog_flags */
+  uint8_t  path_size;      /**< Bytes usados em #path */
+  uint8_t  reserved;
+  char     path[ACCESSLOG_PATH_SIZE]; /**< Alvo da request, sem '\0' */
+};
+
+_Static_assert(sizeof(struct accesslog_header) == ACCESSLOG_RECORD_SIZE, "accesslog_header mudou de tamanho");
+_Static_assert(sizeof(struct accesslog_record) == ACCESSLOG_RECORD_SIZE, "accesslog_record mudou de tamanho");
+
+
+/** Os segmentos de um worker. */
+struct access_log
+{
+  const char* prefix;      /**< Caminho dos segmentos, sem '.WORKER.SEQUENCIA' */
+  int      worker;
+  size_t   segment_size;   /**< Bytes de cada segmento, header incluso */
+  int      keep;           /**< Segmentos guardados - 0 guarda todos */
+
+  int      fd;             /**< Segmento atual - -1 se nenhum */
+  uint32_t sequence;
+  struct accesslog_header* header; /**< O segmento atual inteiro, mapeado */
+  uint64_t capacity;       /**< Registros que cabem nele */
+  int64_t  realtime;       /**< Somado a timer_now() da o relogio de parede */
+};
+
+struct c_handler;
+
+extern __thread struct access_log* accesslog_local;
+
+int  accesslog_open(struct access_log* a, const char* prefix, int worker, size_t segment_size, int keep);
+void accesslog_close(struct access_log* a);
+void accesslog_attach(struct access_log* a);
+void accesslog_state(struct c_handler* h, int state);
+
+
+#endif /* ACCESSLOG_H_DEFINED */
@@ -0,0 +1,188 @@
+/**
+ * @file handlers.c
+ *
+ * Benchmark: quanto custa, por evento, o despacho do loop - e se ele
+ * depende de quantas conexoes ociosas o worker tem.
+ *
+ * Cria N handlers sem socket de verdade (os 'fds' sao so numeros), todos
+ * parados em HEADER_RECEIVING como uma conexao persistente esperando a
+ * proxima request, e registra cada um com c_handler_add() em ordem
+ * aleatoria - como a tabela fica depois de muitos clientes conectando e
+ * desconectando. Entao, a cada volta, BENCH_EVENTS desses fds recebem
+ * um 'evento' e passam pelo mesmo caminho do loop de verdade: o handler
+ * sai da tabela por fd (c_handler_find()), entra na fila de prontos
+ * (c_handler_set_ready()) e a fila e percorrida (c_handler_take_ready()
+ * e c_handler_is_ready()). As conexoes ociosas nunca sao visitadas, entao
+ * o custo por evento deve ser o mesmo com 1000 ou com 100000 delas - e
+ * o despacho so toca o #c_handler, nunca a sua parte fria.
+ *
+ * Uso: make bench && ./bin/bench [N...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>     /* atoi() rand() malloc()                    */
+#include <time.h>       /* clock_gettime()                           */
+
+#include "../client.h"
+
+
+/** Quantas voltas do loop para cada N */
+#define BENCH_PASSES  2000
+
+/** Quantos handlers ficam prontos em cada volta */
+#define BENCH_EVENTS  64
+
+/** O primeiro 'fd' dos handlers - depois de stdin, stdout e stderr */
+#define BENCH_FIRST_FD  3
+
+
+/** Agora, em ns. */
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+/** Roda BENCH_PASSES voltas do despacho de 'l', cada uma com os
+ *  BENCH_EVENTS fds seguintes de 'fds' (que da a volta em 'nfds').
+ *
+ *  @return Quantos ns cada evento custou, em media.
+ */
+static double bench_dispatch(struct c_handler_list* l, const int* fds, int nfds)
+{
+  volatile int ready = 0;
+  uint64_t start;
+  int next = 0;
+  int pass;
+  int i;
+
+  start = bench_now_ns();
+  for (pass = 0; pass < BENCH_PASSES; pass++)
+  {
+    struct c_handler* h;
+
+    // Os eventos da volta: cada fd vira o seu handler e entra na fila
+    for (i = 0; i < BENCH_EVENTS; i++)
+    {
+      h = c_handler_find(l, fds[next]);
+      next = (next + 1 < nfds) ? (next + 1) : 0;
+
+      h->can_read = 1;
+      c_handler_set_ready(h, l);
+    }
+
+    // So quem esta na fila e visitado
+    h = c_handler_take_ready(l);
+    while (h != NULL)
+    {
+      struct c_handler* next_ready = h->next_ready;
+
+      h->next_ready = NULL;
+      h->in_ready   = 0;
+      if (c_handler_is_ready(h))
+        ready++;
+
+      h->can_read = 0;
+      h = next_ready;
+    }
+  }
+  return (double)(bench_now_ns() - start) / ((double)BENCH_PASSES * BENCH_EVENTS);
+}
+
+
+/** Mede o despacho com 'n' conexoes ociosas. */
+static int bench_run(int n)
+{
+  struct c_handler_list l;
+  struct c_handler* h;
+  int* fds;
+  int i;
+
+  fds = malloc(n * sizeof(int));
+  if ((fds == NULL) || (c_handler_list_init(&l, n) == -1))
+  {
+    perror("Erro em bench_run()");
+    return -1;
+  }
+
+  // Embaralha - depois de muito accept()/close() os fds nao seguem a memoria
+  for (i = 0; i < n; i++)
+    fds[i] = BENCH_FIRST_FD + i;
+
+  for (i = n - 1; i > 0; i--)
+  {
+    int j = rand() % (i + 1);
+    int tmp = fds[i];
+
+    fds[i] = fds[j];
+    fds[j] = tmp;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    h = NULL;
+    if ((c_handler_init(&h, &l, fds[i], NULL, 1000, 0, 0) == -1) ||
+        (c_handler_add(h, &l) == -1))
+    {
+      perror("Erro em c_handler_init()");
+      return -1;
+    }
+  }
+
+  // Os eventos chegam em outra ordem aleatoria
+  for (i = n - 1; i > 0; i--)
+  {
+    int j = rand() % (i + 1);
+    int tmp = fds[i];
+
+    fds[i] = fds[j];
+    fds[j] = tmp;
+  }
+
+  bench_dispatch(&l, fds, n);
+  printf("%8d %14zu %12.2f\n", n, l.pool.size + l.colds.size, bench_dispatch(&l, fds, n));
+
+  while ((h = l.begin) != NULL)
+  {
+    c_handler_remove(h, &l);
+    c_handler_exit(h, &l);
+  }
+
+  free(fds);
+  pool_exit(&(l.pool));
+  pool_exit(&(l.colds));
+  pool_exit(&(l.buffers));
+  free(l.byfd);
+  return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+  static const int sizes[] = { 1000, 10000, 100000 };
+  int i;
+
+  srand(1);
+  printf("sizeof(struct c_handler) = %zu, sizeof(struct c_handler_cold) = %zu, "
+         "sizeof(struct c_handler_buffers) = %zu\n",
+         sizeof(struct c_handler), sizeof(struct c_handler_cold), sizeof(struct c_handler_buffers));
+  printf("%d eventos por volta\n", BENCH_EVENTS);
+  printf("%8s %14s %12s\n", "conexoes", "bytes/ociosa", "ns/evento");
+
+  if (argc > 1)
+  {
+    for (i = 1; i < argc; i++)
+      if (bench_run(atoi(argv[i])) == -1)
+        return EXIT_FAILURE;
+  }
+  else
+  {
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+      if (bench_run(sizes[i]) == -1)
+        return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
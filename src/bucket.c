@@ -0,0 +1,128 @@
+/**
+ * @file bucket.c
+ *
+ * Implementacao do controle de banda por 'balde de fichas'.
+ *
+ * As fichas sao guardadas em milesimos de byte: 'rate' bytes/s vezes
+ * 'ms' milissegundos da exatamente isso, entao encher o balde e so uma
+ * multiplicacao, sem arredondamentos acumulando.
+ */
+
+#include "bucket.h"
+
+
+/** Inicializa o balde 'b', cheio, enchendo a 'rate' bytes/s ate
+ *  'burst' bytes. Com 'burst' 0 o balde guarda BUCKET_DEFAULT_BURST_MS
+ *  de 'rate' (nunca menos que uma fatia).
+ */
+void bucket_init(struct token_bucket* b, uint64_t rate, uint64_t burst, uint64_t now)
+{
+  b->rate = rate;
+
+  if (burst == 0)
+    burst = (rate * BUCKET_DEFAULT_BURST_MS) / 1000;
+
+  b->burst = burst;
+  if (b->burst < bucket_slice(b))
+    b->burst = bucket_slice(b);
+
+  b->tokens = (int64_t)(b->burst * 1000);
+  b->last   = now;
+}
+
+
+/** Coloca no balde as fichas que entraram desde a ultima vez. */
+void bucket_refill(struct token_bucket* b, uint64_t now)
+{
+  int64_t max = (int64_t)(b->burst * 1000);
+
+  if (now <= b->last)
+    return;
+
+  b->tokens += (int64_t)(b->rate * (now - b->last));
+  if (b->tokens > max)
+    b->tokens = max;
+
+  b->last = now;
+}
+
+
+/** Muda a velocidade de 'b' para 'rate' bytes/s a partir de 'now'.
+ *
+ *  O que entrou ate 'now' conta com a velocidade antiga. A capacidade
+ *  volta a ser a automatica (BUCKET_DEFAULT_BURST_MS da nova 'rate').
+ */
+void bucket_set_rate(struct token_bucket* b, uint64_t rate, uint64_t now)
+{
+  int64_t max;
+
+  bucket_refill(b, now);
+
+  b->rate  = rate;
+  b->burst = (rate * BUCKET_DEFAULT_BURST_MS) / 1000;
+  if (b->burst < bucket_slice(b))
+    b->burst = bucket_slice(b);
+
+  max = (int64_t)(b->burst * 1000);
+  if (b->tokens > max)
+    b->tokens = max;
+}
+
+
+/** @return Quantos bytes podem ser enviados agora. */
+uint64_t bucket_available(struct token_bucket* b)
+{
+  if (b->tokens <= 0)
+    return 0;
+
+  return b->tokens / 1000;
+}
+
+
+/** Gasta 'bytes' fichas. O balde pode ficar negativo - a divida e paga
+ *  esperando mais antes do proximo envio.
+ */
+void bucket_consume(struct token_bucket* b, uint64_t bytes)
+{
+  b->tokens -= (int64_t)(bytes * 1000);
+}
+
+
+/** Devolve 'bytes' fichas gastas que acabaram nao sendo usadas - sem
+ *  passar da capacidade do balde.
+ */
+void bucket_refund(struct token_bucket* b, uint64_t bytes)
+{
+  int64_t max = (int64_t)(b->burst * 1000);
+
+  b->tokens += (int64_t)(bytes * 1000);
+  if (b->tokens > max)
+    b->tokens = max;
+}
+
+
+/** @return O tamanho de uma fatia: o que entra no balde em 1/BUCKET_HZ
+ *          de segundo (pelo menos 1 byte, no maximo o balde inteiro).
+ */
+uint64_t bucket_slice(struct token_bucket* b)
+{
+  uint64_t slice = b->rate / BUCKET_HZ;
+
+  if ((b->burst != 0) && (slice > b->burst))
+    slice = b->burst;
+
+  return (slice > 0) ? slice : 1;
+}
+
+
+/** @return Quantos ms faltam para o balde ter 'bytes' fichas. */
+uint64_t bucket_wait_ms(struct token_bucket* b, uint64_t bytes)
+{
+  int64_t missing = (int64_t)(bytes * 1000) - b->tokens;
+
+  if ((missing <= 0) || (b->rate == 0))
+    return 0;
+
+  // arredondar para cima - acordar cedo demais so gasta uma volta
+  return ((uint64_t)missing + b->rate - 1) / b->rate;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file bucket.h
+ *
+ * Definicao do controle de banda por 'balde de fichas' (token bucket).
+ *
+ * O balde enche continuamente a #rate bytes por segundo, ate no maximo
+ * #burst bytes. Cada byte enviado gasta uma ficha. Em vez de mandar o
+ * limite de um segundo inteiro de uma vez e ficar quieto ate o proximo
+ * segundo, o cliente manda fatias pequenas (1/BUCKET_HZ de segundo)
+ * espalhadas por todo o tempo.
+ */
+
+#ifndef BUCKET_H_DEFINED
+#define BUCKET_H_DEFINED
+
+#include <stdint.h>
+
+
+/** Quantas fatias por segundo - uma a cada 10ms */
+#define BUCKET_HZ  100
+
+/** Tamanho padrao do balde, em ms de #token_bucket.rate */
+#define BUCKET_DEFAULT_BURST_MS  100
+
+
+struct token_bucket
+{
+  int64_t  tokens;  /**< Fichas no balde, em milesimos de byte (para nao perder fracoes) */
+  uint64_t rate;    /**< Quantos bytes por segundo entram no balde */
+  uint64_t burst;   /**< Capacidade do balde, em bytes */
+  uint64_t last;    /**< Ultima vez (em ms) que o balde foi enchido */
+};
+
+
+void     bucket_init(struct token_bucket* b, uint64_t rate, uint64_t burst, uint64_t now);
+void     bucket_refill(struct token_bucket* b, uint64_t now);
+void     bucket_set_rate(struct token_bucket* b, uint64_t rate, uint64_t now);
+uint64_t bucket_available(struct token_bucket* b);
+void     bucket_consume(struct token_bucket* b, uint64_t bytes);
+void     bucket_refund(struct token_bucket* b, uint64_t bytes);
+uint64_t bucket_slice(struct token_bucket* b);
+uint64_t bucket_wait_ms(struct token_bucket* b, uint64_t bytes);
+
+
+#endif /* BUCKET_H_DEFINED */
@@ -5,7 +5,7 @@
  */
 
 #include <stdio.h>
-#include <stdlib.h>     /* atoi() realpath()                         */
+#include <stdlib.h>     /* atoi() realpath() realloc()               */
 #include <string.h>     /* memset()                                  */
 #include <errno.h>      /* errno                                     */
 #include <unistd.h>     /* fcntl()                                   */
@@ -14,16 +14,33 @@
 #include <sys/stat.h>   /* stat() S_ISDIR()                          */
 #include <limits.h>     /* realpath()                                */
 #include <time.h>       /* clock_gettime()                           */
+#include <sys/sendfile.h> /* sendfile()                              */
+#include <sys/socket.h> /* setsockopt() SO_MAX_PACING_RATE           */
+#include <sys/uio.h>    /* struct iovec                              */
+#include <sys/mman.h>   /* madvise()                                 */
 
 #include "client.h"
 #include "http.h"
 #include "macros.h"
 
 
+/** Quanto de #c_handler_cold.output_map pedimos ao kernel para ler antes
+ *  de chegar la (MADV_WILLNEED) - multiplo do tamanho da pagina */
+#define MAP_PREFETCH  (256 * 1024)
+
+
+/** Quantos fds a mais #c_handler_list.byfd ganha de cada vez */
+#define C_HANDLER_BYFD_GROW  64
+
+
 /** Inicializa as variaveis internas de 'l', como o numero maximo
  *  de clientes suportados simultaneamente, 'max_clients'.
  *
- *  @return 0 em sucesso, -1 caso 'l' seja NULL.
+ *  Ja deixa alocados (e tocados) 'max_clients' handlers no #l->pool, e
+ *  outras tantas partes frias em #l->colds e buffers em #l->buffers. #l->byfd comeca com espaco
+ *  para os fds que o processo costuma ter - cresce se precisar.
+ *
+ *  @return 0 em sucesso, -1 caso 'l' seja NULL ou falte memoria.
  */
 int c_handler_list_init(struct c_handler_list* l, int max_clients)
 {
@@ -35,302 +52,531 @@ int c_handler_list_init(struct c_handler_list* l, int max_clients)
     l->begin   = NULL;
     l->end     = NULL;
 
-    l->smaller_timeout = NULL;
-    l->onesec_timeout.tv_sec  = 1;
-    l->onesec_timeout.tv_usec = 0;
+    l->byfd_size = (max_clients * 2) + C_HANDLER_BYFD_GROW;
+    l->byfd      = calloc(l->byfd_size, sizeof(struct c_handler*));
+    if (l->byfd == NULL)
+      return -1;
+
+    l->ready_begin = NULL;
+    l->ready_end   = NULL;
 
-    return 0;
+    wheel_init(&(l->wheel), timer_monotonic_ms());
+
+    if (pool_init(&(l->pool), sizeof(struct c_handler), max_clients) == -1)
+      return -1;
+
+    if (pool_init(&(l->colds), sizeof(struct c_handler_cold), max_clients) == -1)
+      return -1;
+
+    return pool_init(&(l->buffers), sizeof(struct c_handler_buffers), max_clients);
 }
 
 
-/** Inicializa as variaveis internas de 'h', como o cliente 'sck' e o
- *  diretorio root 'rootdir'.
+/** Inicializa as variaveis internas de 'h', como o cliente 'sck', que
+ *  veio do endereco 'peer' (o que o accept() devolveu - ou NULL).
  *
- *  Nessa funcao utiliza-se alocacao dinamica de memoria para criar um
- *  novo c_handler.
+ *  O novo c_handler e a sua parte fria (#c_handler.cold) vem dos pools
+ *  de 'l' (pool.h): sem malloc() e sem page faults no caminho do
+ *  accept(). Ele ainda nao tem buffers - veja c_handler_get_buffers().
  *
  *  @bug  Essa funcao nao necessariamente seta 'errno'. Chamar perror()
  *        logo apos ela pode gerar mensagens de erros indefinidas.
  *  @note Essa funcao supoe que o socket 'clientsckt' esta devidamente
  *        conectado ao cliente.
  *
- *  @todo Colocar o malloc() na main e deixar essa funcao mais simples.
- *
- *  @return 0 em sucesso, -1 caso 'h' seja NULL ou malloc() falhe.
+ *  @return 0 em sucesso, -1 caso 'h' seja NULL ou falte memoria.
  */
-int c_handler_init(struct c_handler** h, int sck, char* rootdir, size_t rootdirsize, int bandwidth)
+int c_handler_init(struct c_handler** h, struct c_handler_list* l, int sck, const struct sockaddr_in* peer,
+                   int bandwidth, int burst, int pacing)
 {
   if ((h == NULL) || (*h != NULL))
     return -1;
 
-  *h = malloc(sizeof(struct c_handler));
+  *h = pool_get(&(l->pool));
   if (*h == NULL)
     return -1;
 
+  (*h)->cold = pool_get(&(l->colds));
+  if ((*h)->cold == NULL)
+  {
+    pool_put(&(l->pool), *h);
+    *h = NULL;
+    return -1;
+  }
+
   (*h)->next = NULL;
+  (*h)->prev = NULL;
+  (*h)->next_ready = NULL;
+  (*h)->in_ready   = 0;
   (*h)->client = sck;
-  (*h)->state = HEADER_RECEIVING;
+  (*h)->can_read  = 0;
+  (*h)->can_write = 0;
+  (*h)->cold->requests  = 0;
+  (*h)->cold->request_size = 0;
+  (*h)->buf = NULL;
+  (*h)->cold->generated = NULL;
+  (*h)->cold->peer_addr = 0;
+  (*h)->cold->peer_port = 0;
+  if ((peer != NULL) && (peer->sin_family == AF_INET))
+  {
+    (*h)->cold->peer_addr = peer->sin_addr.s_addr;
+    (*h)->cold->peer_port = ntohs(peer->sin_port);
+  }
 
-  memset(&((*h)->request),       '\0', BUFFER_SIZE * 3);
-  memset(&((*h)->outputbuff),    '\0', BUFFER_SIZE);
-  memset(&((*h)->answer_header), '\0', BUFFER_SIZE);
-  memset(&((*h)->filepath),      '\0', BUFFER_SIZE);
-  memset(&((*h)->filestatusmsg), '\0', BUFFER_SIZE);
-  memset(&((*h)->filetype),      '\0', BUFFER_SIZE);
+  // Comeca contado como FINISHED - c_handler_reset() o move para HEADER_RECEIVING
+  (*h)->state = FINISHED;
+  METRICS_ADD(states[FINISHED + 1], 1);
 
-  (*h)->outputbuff_size      = 0;
-  (*h)->outputbuff_sizeleft = 0;
-  (*h)->outputbuff_sizesent = 0;
+  c_handler_reset(*h);
+  (*h)->cold->t_request = timer_now();
 
-  (*h)->request_size = 0;
-  (*h)->output = NULL;
-  (*h)->filep  = NULL;
+  (*h)->bandwidth  = bandwidth;
+  bucket_init(&((*h)->bucket), bandwidth, burst, timer_now_ms());
 
-  (*h)->answer_header_size = BUFFER_SIZE;
+  // Se o kernel aceitar, ele mesmo espalha os envios (qdisc fq ou o
+  // pacing interno do TCP) e o loop nao precisa acordar por causa disso
+  (*h)->paced = 0;
+  if (pacing)
+  {
+    unsigned int rate = bandwidth;
 
-  strncpy((*h)->filepath, rootdir, BUFFER_SIZE);
-  (*h)->filepathsize = rootdirsize;
-  (*h)->filestatus = -1;
-  (*h)->filesize   = -1;
-  (*h)->bandwidth  = bandwidth;
+    if (setsockopt(sck, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0)
+      (*h)->paced = 1;
+    else
+      LOG_PERROR("SO_MAX_PACING_RATE recusado - controle de banda fica no servidor");
+  }
+  (*h)->tclass = NULL;
 
   (*h)->waiting = 0;
+  wheel_timer_init(&((*h)->wake),     *h);
+  wheel_timer_init(&((*h)->deadline), *h);
+  (*h)->last_active = 0;
+  (*h)->engine = NULL;
 
   return 0;
 }
 
 
-/** Adiciona 'h' a lista 'l'.
+/** Prepara 'h' para receber uma nova request, esquecendo tudo o que
+ *  era da anterior. O socket, o controle de banda e os timers continuam.
  *
- *  @return 0 em sucesso, -1 em caso de erro - varios casos inclusos.
+ *  E assim que uma conexao persistente (keep-alive) volta para
+ *  HEADER_RECEIVING depois de enviar a resposta. Os bytes que chegaram
+ *  depois do fim da request anterior (#buf->parser.end) sao o comeco da
+ *  proxima e vao para o inicio de #buf->request.
+ *
+ *  @note O arquivo da request anterior ja deve ter sido fechado com
+ *        close_file().
  */
-int c_handler_add(struct c_handler* h, struct c_handler_list* l)
+void c_handler_reset(struct c_handler* h)
 {
-  if ((h == NULL) || (l == NULL))
-    return -1;
+  int leftover = 0;
 
-  if (l->current == l->max)
-    return -1;
+  c_handler_set_state(h, HEADER_RECEIVING);
+  h->cold->next_state = FINISHED;
+  h->cold->keep_alive = 0;
 
-  if (l->begin == NULL)
+  if (h->buf != NULL)
   {
-    l->begin = h;
-    l->end   = h;
+    struct http_parser* parser = &(h->buf->parser);
+
+    if ((parser->end > 0) && (parser->end < h->cold->request_size))
+    {
+      leftover = h->cold->request_size - parser->end;
+      memmove(h->buf->request, h->buf->request + parser->end, leftover);
+    }
+    // Os buffers nao sao zerados: todos sao preenchidos antes de serem
+    // lidos, e sempre terminados em '\0'
+    h->buf->request[leftover] = '\0';
+    http_parser_init(parser, (BUFFER_SIZE * 3) - 1);
   }
-  else
-  {
-    struct c_handler* tmp = l->begin;
+  h->cold->request_size = leftover;
 
-    while (tmp->next != NULL)
-      tmp = tmp->next;
+  h->cold->outputbuff_size     = 0;
+  h->cold->outputbuff_sizeleft = 0;
+  h->cold->outputbuff_sizesent = 0;
 
-    tmp->next = h;
-    l->end    = h;
-  }
+  h->cold->output = NULL;
+  h->cold->output_fd = -1;
+  h->cold->output_pread = 0;
+  h->cold->output_map = NULL;
+  h->cold->filep  = NULL;
 
-  l->current++;
+  h->cold->answer_header_size = BUFFER_SIZE;
+
+  h->cold->filepathsize = 0;
+  h->cold->filestatus = -1;
+  h->cold->filesize   = -1;
+
+  h->cold->need_file_chunk = 1;
+  h->cold->fentry   = NULL;
+  h->cold->nparts   = 0;
+  h->cold->parts_size = 0;
+}
+
+
+/** Garante que 'h' tenha buffers para receber e responder uma request,
+ *  pegando-os do pool de 'l' caso esteja sem (veja c_handler_put_buffers()).
+ *
+ *  @return 0 em sucesso, -1 se faltar memoria.
+ */
+int c_handler_get_buffers(struct c_handler* h, struct c_handler_list* l)
+{
+  if (h->buf != NULL)
+    return 0;
+
+  h->buf = pool_get(&(l->buffers));
+  if (h->buf == NULL)
+    return -1;
+
+  h->buf->request[0] = '\0';
+  http_parser_init(&(h->buf->parser), (BUFFER_SIZE * 3) - 1);
   return 0;
 }
 
 
-/** Remove 'h' de 'l'.
+/** Devolve os buffers de 'h' ao pool de 'l', caso ele esteja ocioso:
+ *  esperando uma request da qual nenhum byte chegou ainda.
  *
- *  @note Nao desaloca a memoria. Para isso, veja @see c_handler_exit()
+ *  Assim uma conexao persistente parada entre requests ocupa so o
+ *  #c_handler, e nao os ~2KB de buffers.
+ */
+void c_handler_put_buffers(struct c_handler* h, struct c_handler_list* l)
+{
+  if ((h->buf == NULL) || (h->state != HEADER_RECEIVING) || (h->cold->request_size > 0))
+    return;
+
+  pool_put(&(l->buffers), h->buf);
+  h->buf = NULL;
+}
+
+
+/** Garante que #l->byfd tem lugar para o fd 'sck'.
  *
- *  @warning
- *  Caso l->begin seja NULL ou l->end seja NULL ou l->current seja 0,
- *  essa funcao nao continua. Entao, se algum desses for verdade mas
- *  os outros nao sejam, nunca poderemos remover - isso e um sinal para
- *  bug.
- *  tl;dr Se a lista estiver corrompida, essa funcao nao funciona.
+ *  So cresce quando o processo passa a usar fds mais altos que todos os
+ *  anteriores - entao acontece poucas vezes, e nunca no caminho normal.
  *
- *  @return 0 em sucesso, -1 em caso de erro - varios casos inclusos.
+ *  @return 0 em sucesso, -1 se falta memoria.
  */
-int c_handler_remove(struct c_handler* h, struct c_handler_list* l)
+static int c_handler_byfd_fit(struct c_handler_list* l, int sck)
 {
-  struct c_handler* tmp = NULL;
-  int exists = 0;
+  struct c_handler** byfd;
+  int size;
 
-  if ((h == NULL) || (l == NULL))
-    return -1;
+  if (sck < l->byfd_size)
+    return 0;
 
-  if ((l->begin == NULL) || (l->end == NULL) || (l->current == 0))
+  size = sck + C_HANDLER_BYFD_GROW;
+  byfd = realloc(l->byfd, size * sizeof(struct c_handler*));
+  if (byfd == NULL)
     return -1;
 
-  //checar se h esta realmente em l
-  tmp = l->begin;
-  do {
-    if (tmp == h)
-      exists = 1;
+  memset(byfd + l->byfd_size, 0, (size - l->byfd_size) * sizeof(struct c_handler*));
+  l->byfd      = byfd;
+  l->byfd_size = size;
+  return 0;
+}
 
-    tmp = tmp->next;
-  } while ((exists == 0) && (tmp != NULL));
 
-  if (exists == 0)
-    return -1;
+/** Marca o tempo das fases da request (metrics.h) quando 'h' sai de
+ *  HEADER_RECEIVING ou entra em FILE_SENDING ou FILE_SENT.
+ *
+ *  Todas as marcas (#c_handler_cold.t_request ate #c_handler_cold.t_wait) usam o
+ *  mesmo timer_now() da volta do loop, entao as fases sempre se somam
+ *  direito. A resolucao e a de uma volta - o que acontece dentro de uma
+ *  volta so conta como 0.
+ *
+ *  @note Chamada por c_handler_set_state() - antes de #h->state mudar.
+ */
+void c_handler_timing(struct c_handler* h, int state)
+{
+  int64_t now = timer_now();
+  int64_t total;
 
-  tmp = l->begin;
-  //efetivamente remover
-  if (l->begin == h)
+  if (h->state == HEADER_RECEIVING)
   {
-    if (h->next == NULL)
-      l->end = NULL;
-
-    l->begin = h->next;
-    h->next = NULL;
+    // Desistencia nao e fim do header
+    if (state == FINISHED)
+      return;
+
+    if (h->cold->t_request != 0)
+      metrics_phase(PHASE_HEADER, now - h->cold->t_request);
+    h->cold->t_headers = now;
+    return;
   }
-  else if (l->end == h)
+
+  if (state == FILE_SENDING)
   {
-    tmp = l->begin;
+    metrics_phase(PHASE_PREPARE, now - h->cold->t_headers);
+    h->cold->t_sending = now;
+    h->cold->t_first   = 0;
+    h->cold->throttled_ns = 0;
+    return;
+  }
+
+  total = now - h->cold->t_sending;
+  metrics_phase(PHASE_TRANSFER, total);
+  metrics_phase(PHASE_THROTTLED, h->cold->throttled_ns);
+  metrics_phase(PHASE_UNTHROTTLED, total - h->cold->throttled_ns);
+}
 
-    while (tmp->next != h)
-      tmp = tmp->next;
 
-    l->end = tmp;
-    tmp->next = NULL;
-  }
+/** Adiciona 'h' ao fim da lista 'l'. O(1).
+ *
+ *  @return 0 em sucesso, -1 em caso de erro - lista cheia, socket
+ *          invalido ou ja usado por outro handler.
+ */
+int c_handler_add(struct c_handler* h, struct c_handler_list* l)
+{
+  if ((h == NULL) || (l == NULL) || (h->client < 0))
+    return -1;
+
+  if (l->current == l->max)
+    return -1;
+
+  if (c_handler_byfd_fit(l, h->client) == -1)
+    return -1;
+
+  if (l->byfd[h->client] != NULL)
+    return -1;
+
+  h->next = NULL;
+  h->prev = l->end;
+  if (l->end == NULL)
+    l->begin = h;
   else
-  {
-    while (tmp->next != h)
-      tmp = tmp->next;
+    l->end->next = h;
+  l->end = h;
 
-    tmp->next = h->next;
-    h->next = NULL;
-  }
+  l->byfd[h->client] = h;
+  l->current++;
+  return 0;
+}
+
+
+/** Remove 'h' de 'l'. O(1) - quem diz se 'h' esta em 'l' e #l->byfd.
+ *
+ *  @note Nao desaloca a memoria. Para isso, veja @see c_handler_exit()
+ *
+ *  @return 0 em sucesso, -1 se 'h' nao esta em 'l'.
+ */
+int c_handler_remove(struct c_handler* h, struct c_handler_list* l)
+{
+  if ((h == NULL) || (l == NULL))
+    return -1;
+
+  if (c_handler_find(l, h->client) != h)
+    return -1;
+
+  if (h->prev == NULL)
+    l->begin = h->next;
+  else
+    h->prev->next = h->next;
+
+  if (h->next == NULL)
+    l->end = h->prev;
+  else
+    h->next->prev = h->prev;
 
+  h->next = NULL;
+  h->prev = NULL;
+  l->byfd[h->client] = NULL;
   l->current--;
   return 0;
 }
 
 
-/** Libera a memoria alocada para 'h'.
+/** O handler do socket 'sck' em 'l'. O(1).
  *
- *  @note O valor de 'h' se torna NULL.
+ *  @return O handler, ou NULL se 'sck' nao e de nenhum cliente de 'l'.
  */
-void c_handler_exit(struct c_handler* h)
+struct c_handler* c_handler_find(struct c_handler_list* l, int sck)
 {
-  free(h);
-  h = NULL;
+  if ((sck < 0) || (sck >= l->byfd_size))
+    return NULL;
+
+  return l->byfd[sck];
+}
+
+
+/** Devolve 'h' (e os seus buffers) ao pool de 'l', de onde ele veio.
+ *
+ *  @note 'h' nao pode mais ser usado depois disso.
+ */
+void c_handler_exit(struct c_handler* h, struct c_handler_list* l)
+{
+  METRICS_ADD(states[h->state + 1], -1);
+  if (h->waiting)
+    METRICS_ADD(waiting, -1);
+
+  if (h->buf != NULL)
+    pool_put(&(l->buffers), h->buf);
+
+  pool_put(&(l->colds), h->cold);
+  pool_put(&(l->pool), h);
 }
 
 
 /** Recebe a mensagem atraves de recv() de uma maneira nao-bloqueante
  *
- *  Pega um pedaco e ja anexa ao #request
+ *  Le direto para o fim de #request. Pode vir mais de uma request de
+ *  uma vez (pipelining) - o que passar da primeira fica guardado ate
+ *  ela ser respondida, veja c_handler_reset().
  *
  *  @return 0 caso a mensagem esteja sendo recebida, -1 em caso de erro
- *          e 1 se a mensagem terminou de ser recebida.
+ *          (ou se nao cabe mais nada em #request) e 1 se o cliente
+ *          desconectou.
  */
 int receive_request(struct c_handler* h)
 {
-  char buffer[BUFFER_SIZE];
-  int  buffer_size = BUFFER_SIZE;
-  int  retval;
+  int buffer_size = (BUFFER_SIZE * 3) - 1 - h->cold->request_size;
+  int retval;
+
+  if (buffer_size <= 0)
+    return -1;
 
   // Para simular leitura lenta
   //~ usleep(200000);
-  retval = recv(h->client, buffer, buffer_size, 0);
+  retval = recv(h->client, h->buf->request + h->cold->request_size, buffer_size, 0);
   if (retval == -1)
+  {
     if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
       return -1;
 
+    // nada mais para ler - esperar o proximo aviso do epoll
+    h->can_read = 0;
+    return 0;
+  }
+
   if (retval == 0)
     return 1;
 
-  buffer[retval] = '\0';
-
-  if ((h->request_size + retval) > BUFFER_SIZE * 3)
-    return -1;
-
-  strncat(h->request, buffer, retval);
-
-  h->request_size += retval;
+  h->cold->request_size += retval;
+  h->buf->request[h->cold->request_size] = '\0';
 
   return 0;
 }
 
-/** Separa as partes uteis da request HTTP enviada pelo usuario.
+/** Enquanto envia a resposta, descobre se o cliente desconectou - sem
+ *  ler nada, ja que o que chegar pode ser a proxima request.
  *
- *  @todo Por enquanto so mexemos com filename. Implementar metodo e versao
- *  @return 0 se tudo der certo, -1 caso a request contenha algum metodo
- *          nao-implementado.
+ *  @return 0 se o cliente continua la, 1 se desconectou e -1 em caso
+ *          de erro.
  */
-int parse_request(struct c_handler* h)
+int peek_disconnect(struct c_handler* h)
 {
-  char buff[BUFFER_SIZE];
-  char *method;
-  char *filename;
-  char *version;
-
-  strncpy(buff, h->request, BUFFER_SIZE);
-
-  method = strtok(buff, " ");
-  filename = strtok(NULL, " ");
-  version = strtok(NULL, "\r\n");
+  char c;
+  int  retval;
 
-  switch(http_what_method(method, strlen(method)))
+  retval = recv(h->client, &c, 1, MSG_PEEK);
+  if (retval == -1)
   {
-  case GET_M:
-    // pode continuar
-    break;
-  default:
-    return -1;
-    break;
-  }
+    if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
+      return -1;
 
-  switch(http_what_version(version, strlen(version)))
-  {
-  case HTTP_1_0:
-  case HTTP_1_1:
-    // pode continuar
-    break;
-  default:
-    return -1;
-    break;
+    h->can_read = 0;
+    return 0;
   }
 
-  strncat(h->filepath, filename, BUFFER_SIZE - h->filepathsize);
-  h->filepathsize += strlen(filename);
+  if (retval == 0)
+    return 1;
 
+  // Chegou a proxima request: fica no socket ate HEADER_RECEIVING
+  h->can_read = 0;
   return 0;
 }
 
+/** Monta #buf->filepath: o diretorio 'rootdir' seguido do alvo da
+ *  request (ja analisado por #buf->parser).
+ *
+ *  @return 0 se tudo der certo, -1 caso o caminho nao caiba em
+ *          #buf->filepath.
+ */
+int parse_request(struct c_handler* h, char* rootdir, size_t rootdirsize)
+{
+  struct http_span* target = &(h->buf->parser.target);
+
+  if ((rootdirsize + target->size) >= BUFFER_SIZE)
+    return -1;
 
+  memcpy(h->buf->filepath, rootdir, rootdirsize);
+  memcpy(h->buf->filepath + rootdirsize, h->buf->request + target->begin, target->size);
+  h->cold->filepathsize = rootdirsize + target->size;
+  h->buf->filepath[h->cold->filepathsize] = '\0';
 
+  return 0;
+}
 
 
-/* Pegar um novo smaller_timeout*/
-void get_new_smaller_timeout (struct c_handler_list* l, struct c_handler *h)
+/** Diz se 'h' tem algo a fazer agora, sem precisar esperar o kernel.
+ *
+ *  Os estados de 'processamento' (analisar pedido, preparar header...)
+ *  sempre podem continuar. Os de I/O dependem do que o epoll ja avisou:
+ *  como usamos edge-triggered, #can_read e #can_write so sao zerados
+ *  quando recv()/send() retornam EAGAIN.
+ *
+ *  @return 1 se 'h' deve continuar na lista de prontos, 0 caso contrario.
+ */
+int c_handler_is_ready(struct c_handler* h)
 {
-  struct c_handler* tmp = l->begin;
+  if (h->waiting == 1)
+    return 0;
 
-  l->smaller_timeout = &(l->onesec_timeout);
-  while (tmp != NULL)
+  switch (h->state)
   {
-    if ((tmp->timer.delta.tv_sec > 0) &&
-        (timercmp(&(tmp->timer.delta), l->smaller_timeout, <)) &&
-        (tmp != h))
-      l->smaller_timeout = &(tmp->timer.delta);
+  case HEADER_RECEIVING:
+    return h->can_read;
+
+  case FILE_SENDING:
+    return (h->can_read || h->can_write);
+
+  case BODY_RECEIVING:
+  case PUT_CHECK_FILE:
+    // ainda nao implementados - so voltam com um novo evento
+    return 0;
 
-    tmp = tmp->next;
+  default:
+    return 1;
   }
-  if (l->smaller_timeout == &(l->onesec_timeout))
-    l->smaller_timeout = NULL;
 }
 
-void get_new_maxfds(int* maxfds, struct c_handler_list* l, struct c_handler* h)
+
+/** Coloca 'h' no fim da lista de prontos de 'l', caso ainda nao esteja.
+ *
+ *  Apenas os handlers dessa lista sao visitados pelo loop principal.
+ */
+void c_handler_set_ready(struct c_handler* h, struct c_handler_list* l)
 {
-  struct c_handler* tmp = l->begin;
+  if (h->in_ready == 1)
+    return;
 
-  while (tmp != NULL)
-  {
-    if (tmp != h)
-    {
-      if (tmp->client > *maxfds)
-        *maxfds = tmp->client;
-    }
-    tmp = tmp->next;
-  }
+  h->in_ready   = 1;
+  h->next_ready = NULL;
+
+  if (l->ready_end == NULL)
+    l->ready_begin = h;
+  else
+    l->ready_end->next_ready = h;
+
+  l->ready_end = h;
+}
+
+
+/** Retira toda a lista de prontos de 'l' de uma vez.
+ *
+ *  Quem chamar deve percorrer a lista por #next_ready, zerar #in_ready
+ *  de cada um e devolver com c_handler_set_ready() quem continuar pronto.
+ *
+ *  @return O primeiro handler da lista (ou NULL se estiver vazia).
+ */
+struct c_handler* c_handler_take_ready(struct c_handler_list* l)
+{
+  struct c_handler* h = l->ready_begin;
+
+  l->ready_begin = NULL;
+  l->ready_end   = NULL;
+
+  return h;
 }
 
 
@@ -340,9 +586,9 @@ void get_new_maxfds(int* maxfds, struct c_handler_list* l, struct c_handler* h)
  * close_file
  *
  *
- * h->output
- * h->output_sizeleft
- * h->output_sizesent
+ * h->cold->output
+ * h->cold->output_sizeleft
+ * h->cold->output_sizesent
  *
  *
  *
@@ -350,16 +596,28 @@ void get_new_maxfds(int* maxfds, struct c_handler_list* l, struct c_handler* h)
  * prepare chunk
  * send chunk
  *
- * h->outputbuff
- * h->outputbuff_sizeleft
- * h->outputbuff_sizesent
+ * h->buf->outputbuff
+ * h->cold->outputbuff_sizeleft
+ * h->cold->outputbuff_sizesent
  *
  *
  */
 
+/** Comeca uma nova resposta de 'size' bytes de corpo, ainda sem
+ *  nenhum pedaco em memoria na frente (veja add_part()).
+ */
+static void open_body(struct c_handler *h, size_t size)
+{
+  h->cold->nparts = 0;
+  h->cold->parts_size = 0;
+  h->cold->output_size = size;
+  h->cold->output_sizeleft = size;
+  h->cold->output_sizesent = 0;
+}
+
 /** Prepara o c_handler para enviar o arquivo #file.
  *
- *  Associa o #h->output para a stream #file.
+ *  Associa o #h->cold->output para a stream #file.
  *  @return Retorna 0 em sucesso, -1 caso algum argumento seja NULL.
  */
 int open_file(struct c_handler *h, FILE *file, size_t size)
@@ -367,10 +625,137 @@ int open_file(struct c_handler *h, FILE *file, size_t size)
   if ((h == NULL) || (file == NULL))
     return -1;
 
-  h->output = file;
-  h->output_size = size;
-  h->output_sizeleft = size;
-  h->output_sizesent = 0;
+  h->cold->output = file;
+  h->cold->output_fd = -1;
+  h->cold->output_pread = 0;
+  h->cold->output_map = NULL;
+  open_body(h, size);
+  h->cold->need_file_chunk = 1;
+  return 0;
+}
+
+/** Prepara o c_handler para enviar o arquivo #fd com sendfile().
+ *
+ *  Assim o arquivo vai direto do page cache para o socket, sem passar
+ *  por #h->buf->outputbuff.
+ *  @return Retorna 0 em sucesso, -1 caso #fd seja invalido.
+ */
+int open_file_fd(struct c_handler *h, int fd, size_t size)
+{
+  if ((h == NULL) || (fd < 0))
+    return -1;
+
+  h->cold->output = NULL;
+  h->cold->output_fd = fd;
+  h->cold->output_pread = 0;
+  h->cold->output_map = NULL;
+  open_body(h, size);
+  h->cold->need_file_chunk = 0;
+  return 0;
+}
+
+/** Prepara o c_handler para enviar o arquivo #fd lendo pedacos com
+ *  pread() para #h->buf->outputbuff, como open_file() faz com fread().
+ *
+ *  O offset e do proprio cliente (#h->cold->output_readpos), entao o fd pode ser
+ *  o do cache de arquivos, dividido com todos - sem um fopen() por
+ *  request.
+ *  @return Retorna 0 em sucesso, -1 caso #fd seja invalido.
+ */
+int open_file_pread(struct c_handler *h, int fd, size_t size)
+{
+  if ((h == NULL) || (fd < 0))
+    return -1;
+
+  h->cold->output = NULL;
+  h->cold->output_fd = fd;
+  h->cold->output_pread = 1;
+  h->cold->output_readpos = 0;
+  h->cold->output_map = NULL;
+  open_body(h, size);
+  h->cold->need_file_chunk = 1;
+  return 0;
+}
+
+/** Prepara o c_handler para enviar o arquivo mapeado em #map (veja
+ *  filecache_map()). Os envios saem direto do mapeamento, que e o mesmo
+ *  para todos os clientes do arquivo.
+ *  @return Retorna 0 em sucesso, -1 caso #map seja NULL.
+ */
+int open_file_map(struct c_handler *h, const char* map, size_t size)
+{
+  if ((h == NULL) || (map == NULL))
+    return -1;
+
+  h->cold->output = NULL;
+  h->cold->output_fd = -1;
+  h->cold->output_pread = 0;
+  h->cold->output_map = map;
+  h->cold->output_prefetched = 0;
+  open_body(h, size);
+  h->cold->need_file_chunk = 0;
+  return 0;
+}
+
+/** Prepara o c_handler para uma resposta que so tem os pedacos em
+ *  memoria de add_part() - uma pagina de erro, por exemplo.
+ *  @return Retorna 0 em sucesso, -1 caso #h seja NULL.
+ */
+int open_memory(struct c_handler *h)
+{
+  if (h == NULL)
+    return -1;
+
+  h->cold->output = NULL;
+  h->cold->output_fd = -1;
+  h->cold->output_pread = 0;
+  h->cold->output_map = NULL;
+  open_body(h, 0);
+  h->cold->need_file_chunk = 0;
+  return 0;
+}
+
+/** Coloca 'buf' na fila de pedacos em memoria que vao antes do corpo.
+ *  Chamar depois de open_file(), open_file_fd(), open_file_map() ou
+ *  open_memory(), na ordem em que devem ser enviados.
+ *
+ *  Os pedacos e o comeco do corpo saem na mesma chamada ao sistema -
+ *  o header nao vira um segmento TCP sozinho.
+ *
+ *  @note 'buf' nao e copiado: tem que continuar valendo ate close_file().
+ *  @return Retorna 0 em sucesso, -1 caso ja existam #C_HANDLER_PARTS
+ *          pedacos.
+ */
+int add_part(struct c_handler *h, const char* buf, int size)
+{
+  if ((h == NULL) || (buf == NULL) || (h->cold->nparts == C_HANDLER_PARTS))
+    return -1;
+
+  h->cold->part[h->cold->nparts]      = buf;
+  h->cold->part_size[h->cold->nparts] = size;
+  h->cold->nparts++;
+
+  h->cold->parts_size      += size;
+  h->cold->output_size     += size;
+  h->cold->output_sizeleft += size;
+  return 0;
+}
+
+/** Prepara o c_handler para enviar uma resposta ja pronta em memoria
+ *  (veja filecache.h): os 'head' primeiros bytes de 'response', depois
+ *  a linha 'connection' e depois o resto de 'response'.
+ *
+ *  @return Retorna 0 em sucesso, -1 caso #response seja NULL.
+ */
+int open_response(struct c_handler *h, const char* response, int head, int size, const char* connection)
+{
+  if ((h == NULL) || (response == NULL))
+    return -1;
+
+  open_memory(h);
+  add_part(h, response, head);
+  add_part(h, connection, strlen(connection));
+  add_part(h, response + head, size - head);
   return 0;
 }
 
@@ -379,21 +764,83 @@ int open_file(struct c_handler *h, FILE *file, size_t size)
  */
 int close_file(struct c_handler* h)
 {
-  if ((h->output == NULL) || (h == NULL))
+  int retval;
+
+  if (h == NULL)
     return -1;
 
-  int retval = fclose(h->output);
+  // Os pedacos em memoria sao de 'h' ou do cache de arquivos
+  h->cold->nparts = 0;
+  h->cold->parts_size = 0;
+
+  free(h->cold->generated);
+  h->cold->generated = NULL;
+
+  // O mapeamento tambem pertence ao cache
+  if (h->cold->output_map != NULL)
+  {
+    h->cold->output_map = NULL;
+    return 0;
+  }
+
+  if (h->cold->output_fd != -1)
+  {
+    // O fd do cache de arquivos e dividido - quem fecha e o cache
+    retval = (h->cold->fentry == NULL) ? close(h->cold->output_fd) : 0;
+    h->cold->output_fd = -1;
+    h->cold->output_pread = 0;
+    if (retval == -1)
+    {
+      LOG_PERROR("Erro em close_file() - close()");
+      return -1;
+    }
+    return 0;
+  }
+
+  // Resposta so com pedacos em memoria
+  if (h->cold->output == NULL)
+    return 0;
+
+  retval = fclose(h->cold->output);
   if (retval == EOF)
   {
     LOG_PERROR("Erro em close_file() - fclose()");
     return -1;
   }
-  h->output = NULL;
+  h->cold->output = NULL;
   return 0;
 }
 
-/** Le um pedaco do arquivo apontado por #h->output e armazena em
- *  #h->outputbuff. O tamanho do buffer e #h->outputbuff_size.
+/** Le o proximo pedaco de #h->cold->output_fd (veja open_file_pread()) para
+ *  #h->buf->outputbuff.
+ *
+ *  @return 1 se o arquivo acabou, 0 se ainda ha mais e -1 em erro.
+ */
+static int get_chunk_pread(struct c_handler* h)
+{
+  ssize_t retval;
+
+  do
+    retval = pread(h->cold->output_fd, h->buf->outputbuff, BUFFER_SIZE - 1, h->cold->output_readpos);
+  while ((retval == -1) && (errno == EINTR));
+
+  if (retval == -1)
+  {
+    LOG_PERROR("Erro em pread()");
+    return -1;
+  }
+
+  h->cold->output_readpos += retval;
+  h->cold->outputbuff_size     = retval;
+  h->cold->outputbuff_sizeleft = retval;
+  h->cold->outputbuff_sizesent = 0;
+
+  return (retval < (BUFFER_SIZE - 1)) ? 1 : 0;
+}
+
+/** Le um pedaco do arquivo apontado por #h->cold->output (ou por #h->cold->output_fd,
+ *  com #h->cold->output_pread) e armazena em #h->buf->outputbuff. O tamanho do
+ *  buffer e #h->cold->outputbuff_size.
  *
  *  @note Le o pedaco caractere por caractere (sizeof(char) x 1).
  */
@@ -401,24 +848,30 @@ int get_chunk(struct c_handler* h)
 {
   int retval;
 
-  if ((h->output == NULL) || (h->outputbuff == NULL))
+  if (h->buf == NULL)
+    return -1;
+
+  if (h->cold->output_pread)
+    return get_chunk_pread(h);
+
+  if (h->cold->output == NULL)
     return -1;
 
-  memset(&(h->outputbuff), '\0', BUFFER_SIZE);
-  retval = fread(h->outputbuff, sizeof(char), BUFFER_SIZE - 1, h->output);
+  memset(h->buf->outputbuff, '\0', BUFFER_SIZE);
+  retval = fread(h->buf->outputbuff, sizeof(char), BUFFER_SIZE - 1, h->cold->output);
 
-  h->outputbuff_size     = retval;
-  h->outputbuff_sizeleft = retval;
-  h->outputbuff_sizesent = 0;
+  h->cold->outputbuff_size     = retval;
+  h->cold->outputbuff_sizeleft = retval;
+  h->cold->outputbuff_sizesent = 0;
 
   if (retval < (BUFFER_SIZE - 1))
   {
     // Acabou o arquivo!
-    if (feof(h->output))
+    if (feof(h->cold->output))
       return 1;
 
     // Aghw
-    if (ferror(h->output))
+    if (ferror(h->cold->output))
     {
       LOG_PERROR("Erro em fread()");
       return -1;
@@ -427,52 +880,303 @@ int get_chunk(struct c_handler* h)
   return 0;
 }
 
-/** Envia o pedaco de arquivo apontado por #h->outputbuff para o cliente
- *  em #h->client.
+/** Quanto do corpo de 'h' (o que vem depois dos pedacos em memoria)
+ *  ja foi enviado.
+ */
+static int body_sent(struct c_handler* h)
+{
+  return (h->cold->output_sizesent > h->cold->parts_size) ? (h->cold->output_sizesent - h->cold->parts_size) : 0;
+}
+
+/** Monta em 'iov' o que falta enviar dos pedacos em memoria de 'h' (veja
+ *  add_part()), pulando o que ja foi (#h->cold->output_sizesent) - no maximo
+ *  '*limit' bytes, que sao descontados de '*limit'.
+ *
+ *  @return Quantas posicoes de 'iov' (no maximo #C_HANDLER_PARTS) foram
+ *          usadas.
+ */
+static int parts_iov(struct c_handler* h, struct iovec* iov, int* limit)
+{
+  int skip = h->cold->output_sizesent;
+  int n = 0;
+  int i;
+
+  for (i = 0; (i < h->cold->nparts) && (*limit > 0); i++)
+  {
+    int len;
+
+    if (skip >= h->cold->part_size[i])
+    {
+      skip -= h->cold->part_size[i];
+      continue;
+    }
+
+    len = h->cold->part_size[i] - skip;
+    if (len > *limit)
+      len = *limit;
+
+    iov[n].iov_base = (void*)(h->cold->part[i] + skip);
+    iov[n].iov_len  = len;
+    n++;
+
+    *limit -= len;
+    skip = 0;
+  }
+  return n;
+}
+
+/** Envia os 'n' pedacos de 'iov' para o cliente num sendmsg() so.
+ *
+ *  @return O numero de bytes enviados, -1 em caso de erro e -2 caso o
+ *          socket esteja cheio.
+ */
+static int send_iov(struct c_handler* h, struct iovec* iov, int n, int flags)
+{
+  struct msghdr msg;
+  ssize_t retval;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov    = iov;
+  msg.msg_iovlen = n;
+
+  retval = sendmsg(h->client, &msg, flags);
+  if (retval == -1)
+  {
+    if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
+    {
+      LOG_PERROR("Error at sendmsg()");
+      return -1;
+    }
+    // bloqueou - esperar o proximo aviso do epoll
+    h->can_write = 0;
+    return -2;
+  }
+  return retval;
+}
+
+/** Envia o pedaco de arquivo apontado por #h->buf->outputbuff para o cliente
+ *  em #h->client - no maximo 'limit' bytes (o que o controle de banda
+ *  permite agora, veja state_send_budget()). O que faltar do header vai
+ *  na frente, no mesmo sendmsg().
  *
  *  @return O numero de caracteres enviados, -1 em caso de erro e 0 caso
- *          ja tenha enviado tudo.
+ *          ja tenha enviado tudo (ou o buffer tenha esvaziado).
  */
-int send_chunk(struct c_handler* h)
+int send_chunk(struct c_handler* h, int limit)
 {
+  struct iovec iov[C_HANDLER_PARTS + 1];
+  int head = limit;
   int size;
   int retval;
+  int n;
 
+  if ((h->cold->output == NULL) && (!h->cold->output_pread))
+    return -1;
+
+  if (h->cold->output_sizeleft == 0)
+    return 0;
 
-  if ((h->output == NULL) || (h->outputbuff == NULL))
+  n = parts_iov(h, iov, &limit);
+  head -= limit;
+
+  // limitar baseado no tamanho restante do buffer e no controle de banda
+  size = h->cold->outputbuff_sizeleft;
+  if (size > limit)
+    size = limit;
+
+  if (size > 0)
+  {
+    iov[n].iov_base = h->buf->outputbuff + h->cold->outputbuff_sizesent;
+    iov[n].iov_len  = size;
+    n++;
+  }
+
+  // Buffer vazio - hora de pegar o proximo pedaco do arquivo
+  if (n == 0)
+    return 0;
+
+  retval = send_iov(h, iov, n, 0);
+  if ((retval > 0) && (retval > head))
+  {
+    h->cold->outputbuff_sizesent += retval - head;
+    h->cold->outputbuff_sizeleft -= retval - head;
+  }
+  return retval;
+}
+
+/** Envia o proximo pedaco de #h->cold->output_fd direto para o cliente com
+ *  sendfile(), sem copiar nada para o espaco de usuario.
+ *
+ *  Se o header ainda nao foi, ele sai antes com MSG_MORE: o kernel o
+ *  segura e o junta ao comeco do arquivo no mesmo segmento TCP.
+ *
+ *  O pedaco e limitado a 'limit' bytes (veja state_send_budget()).
+ *
+ *  @return O numero de bytes enviados, -1 em caso de erro, -2 caso o
+ *          socket esteja cheio e 0 caso ja tenha enviado tudo.
+ */
+int send_file_chunk(struct c_handler* h, int limit)
+{
+  struct iovec iov[C_HANDLER_PARTS];
+  off_t   offset;
+  size_t  size;
+  ssize_t retval;
+  int head = limit;
+  int sent = 0;
+  int n;
+
+  if (h->cold->output_fd == -1)
     return -1;
 
-  if (h->output_sizeleft == 0)
+  if (h->cold->output_sizeleft == 0)
     return 0;
 
-  // limitar baseado no tamanho restante do buffer
-  if ((h->outputbuff_sizeleft) > (h->bandwidth))
-    size = h->outputbuff_sizeleft - (h->outputbuff_sizeleft - h->bandwidth);
-  else
-    size = h->bandwidth - (h->bandwidth - h->outputbuff_sizeleft);
+  n = parts_iov(h, iov, &limit);
+  head -= limit;
+  if (n > 0)
+  {
+    int more = ((limit > 0) && (h->cold->output_size > h->cold->parts_size)) ? MSG_MORE : 0;
+
+    sent = send_iov(h, iov, n, more);
+    if ((sent < head) || (limit == 0))
+      return sent;
+  }
 
-  // limitar baseado no tamanho ja enviado ate agora
-  if ((h->timer_sizesent + size) > h->bandwidth)
-    size = (h->bandwidth - h->timer_sizesent);
+  // Se chegamos aqui, os pedacos ja foram todos
+  offset = body_sent(h);
+  size   = h->cold->output_size - h->cold->parts_size - offset;
+  if (size > (size_t)limit)
+    size = limit;
 
-  retval = send(h->client, h->outputbuff + h->outputbuff_sizesent, size, 0);
+  if (size == 0)
+    return sent;
+
+  retval = sendfile(h->client, h->cold->output_fd, &offset, size);
 
   if (retval == -1)
   {
     if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
     {
-      perror("Error at send()");
+      LOG_PERROR("Error at sendfile()");
       return -1;
     }
-    // bloqueou
-    return -2;
+    // bloqueou - esperar o proximo aviso do epoll
+    h->can_write = 0;
+    return (sent > 0) ? sent : -2;
   }
 
+  // O arquivo diminuiu enquanto enviavamos
+  if (retval == 0)
+    return -1;
+
+  return sent + retval;
+}
 
-  h->outputbuff_sizesent += retval;
-  h->outputbuff_sizeleft -= retval;
 
-  return retval;
+/** Devolve onde, em #h->cold->output_map, estao os proximos 'size' bytes do
+ *  corpo a enviar.
+ *
+ *  Um cliente lento pode levar minutos para chegar ao fim do arquivo, e
+ *  ate la o kernel ja jogou fora a leitura antecipada do MADV_SEQUENTIAL.
+ *  Entao, sempre que o envio se aproxima do fim do que ja foi pedido,
+ *  pedimos mais #MAP_PREFETCH bytes a frente com MADV_WILLNEED - assim o
+ *  send() quase nunca espera o disco.
+ */
+const char* map_chunk(struct c_handler* h, int size)
+{
+  int body = h->cold->output_size - h->cold->parts_size;
+  int sent = body_sent(h);
+
+  while ((sent + size + MAP_PREFETCH > h->cold->output_prefetched) &&
+         (h->cold->output_prefetched < body))
+  {
+    int len = body - h->cold->output_prefetched;
+
+    if (len > MAP_PREFETCH)
+      len = MAP_PREFETCH;
+
+    madvise((void*)(h->cold->output_map + h->cold->output_prefetched), len, MADV_WILLNEED);
+    h->cold->output_prefetched += MAP_PREFETCH;
+  }
+  return h->cold->output_map + sent;
+}
+
+/** Envia o proximo pedaco de #h->cold->output_map direto do mapeamento, sem
+ *  copiar nada para um buffer do cliente. O que faltar do header vai
+ *  na frente, no mesmo sendmsg().
+ *
+ *  O pedaco e limitado a 'limit' bytes (veja state_send_budget()). Se o
+ *  arquivo encolheu depois de mapeado, o envio da EFAULT e o cliente e
+ *  desconectado.
+ *
+ *  @return O numero de bytes enviados, -1 em caso de erro, -2 caso o
+ *          socket esteja cheio e 0 caso ja tenha enviado tudo.
+ */
+int send_map_chunk(struct c_handler* h, int limit)
+{
+  struct iovec iov[C_HANDLER_PARTS + 1];
+  int size;
+  int n;
+
+  if (h->cold->output_map == NULL)
+    return -1;
+
+  if (h->cold->output_sizeleft == 0)
+    return 0;
+
+  n = parts_iov(h, iov, &limit);
+
+  size = h->cold->output_size - h->cold->parts_size - body_sent(h);
+  if (size > limit)
+    size = limit;
+
+  if (size > 0)
+  {
+    iov[n].iov_base = (void*)map_chunk(h, size);
+    iov[n].iov_len  = size;
+    n++;
+  }
+  return send_iov(h, iov, n, 0);
+}
+
+
+/** Envia o proximo pedaco de uma resposta que so tem pedacos em memoria
+ *  (veja open_memory()) com um sendmsg() so - no maximo 'limit' bytes.
+ *
+ *  @return O numero de bytes enviados, -1 em caso de erro, -2 caso o
+ *          socket esteja cheio e 0 caso ja tenha enviado tudo.
+ */
+int send_parts_chunk(struct c_handler* h, int limit)
+{
+  struct iovec iov[C_HANDLER_PARTS];
+  int n;
+
+  if (h->cold->output_sizeleft == 0)
+    return 0;
+
+  n = parts_iov(h, iov, &limit);
+  return send_iov(h, iov, n, 0);
+}
+
+/** Copia para 'buf' o que falta dos pedacos em memoria de 'h', no
+ *  maximo 'size' bytes, para quem precisa deles num buffer so.
+ *
+ *  @return Quantos bytes foram copiados - 0 se os pedacos ja foram todos.
+ */
+int copy_parts_chunk(struct c_handler* h, char* buf, int size)
+{
+  struct iovec iov[C_HANDLER_PARTS];
+  int copied = 0;
+  int n;
+  int i;
+
+  n = parts_iov(h, iov, &size);
+  for (i = 0; i < n; i++)
+  {
+    memcpy(buf + copied, iov[i].iov_base, iov[i].iov_len);
+    copied += iov[i].iov_len;
+  }
+  return copied;
 }
 
 /** Modifica #path para uma string com o caminho absoluto e canonico.
@@ -580,7 +1284,7 @@ int get_file_size(char *path)
 }
 
 
-/** Anexa a string "index.html" ao #h->filepath.
+/** Anexa a string "index.html" ao #h->buf->filepath.
  *
  *  @return 0 em sucesso, -1 caso nao caiba.
  */
@@ -590,18 +1294,23 @@ int append_index_html(char *path, size_t pathsize)
 
   size_t indexsize = strlen(index_html);
 
-  if (path[pathsize] != '/')
+  // resolve_symlinks() pode ter mudado o tamanho de 'path'
+  pathsize = strlen(path);
+
+  if ((pathsize == 0) || (path[pathsize - 1] != '/'))
   {
     if ((pathsize + 1) >= BUFFER_SIZE)
       return -1;
 
-    path[pathsize + 1] = '/';
+    path[pathsize] = '/';
+    pathsize++;
+    path[pathsize] = '\0';
   }
 
   if ((pathsize + indexsize) >= BUFFER_SIZE)
     return -1;
 
-  strncat(path, index_html, pathsize);
+  strncat(path, index_html, BUFFER_SIZE - pathsize - 1);
   return 0;
 }
 
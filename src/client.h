@@ -6,7 +6,14 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <netinet/in.h> /* struct sockaddr_in                        */
 #include "timer.h"
+#include "wheel.h"
+#include "bucket.h"
+#include "parser.h"
+#include "pool.h"
+#include "metrics.h"
+#include "accesslog.h"
 
 #ifndef CLIENT_H_DEFINED
 #define CLIENT_H_DEFINED
@@ -16,64 +23,142 @@
   #define BUFFER_SIZE  256
 #endif
 
+/** Maximo de pedacos em memoria antes do corpo: header, linha
+ *  Connection e pagina de erro ou arquivo do cache */
+#define C_HANDLER_PARTS  3
+
+struct traffic_class;
+struct file_entry;
+
 struct c_handler_list
 {
   int current;  /**< Quantos handlers estao servindo clientes agora */
   int max;      /**< Maximo de handlers possiveis ao mesmo tempo */
-  struct timeval *smaller_timeout; /**< Menor timeout para sair do select() */
-  struct timeval onesec_timeout;  /**< Guarda 'um segundo' para comparacao */
   struct c_handler *begin;  /**< Primeiro handler na lista */
   struct c_handler *end;    /**< Ultimo handler na lista */
-};
 
-struct c_handler
-{
-  struct c_handler *next; /**< Proximo handler na lista */
+  struct c_handler **byfd;  /**< O handler de cada socket - NULL se o fd nao e de um cliente */
+  int byfd_size;            /**< Quantos fds cabem em #byfd */
 
-  int  client;                   /**< Socket do cliente servido. */
-  int  state;                    /**< Estado em que se encontra o handler */
-  int  bandwidth;                /**< Limite de banda - quantos bytes/segundo posso mandar por usuario */
+  struct c_handler *ready_begin; /**< Primeiro handler pronto para ser servido */
+  struct c_handler *ready_end;   /**< Ultimo handler pronto para ser servido */
+
+  struct timer_wheel wheel;  /**< Todos os timers dos handlers dessa lista */
+  struct pool pool;          /**< De onde vem a memoria dos handlers dessa lista */
+  struct pool colds;         /**< A do resto deles (c_handler_cold) */
+  struct pool buffers;       /**< E a dos seus buffers (c_handler_buffers) */
+};
 
+/** Os buffers de um c_handler - so sao usados enquanto uma request e
+ *  recebida e respondida.
+ *
+ *  Ficam fora de #c_handler (veja c_handler_get_buffers()) e sao
+ *  devolvidos quando a conexao fica ociosa.
+ */
+struct c_handler_buffers
+{
   char request[BUFFER_SIZE * 3]; /**< Toda a request HTTP solicitada pelo cliente. */
-  int  request_size;             /**< Tamanho de caracteres que 'request' suporta. */
+  struct http_parser parser;     /**< Onde esta a analise de 'request' - e o que ja achou.
+                                   *  O que vem depois de #parser.end ja e a proxima (pipelining). */
 
   char filepath[BUFFER_SIZE];    /**< Localizacao do arquivo que o cliente solicitou. */
-  int  filepathsize;
+  char filestatusmsg[BUFFER_SIZE]; /**< Mensagem equivalente ao status do arquivo. */
+  char filetype[BUFFER_SIZE];    /**< O MIME-type do arquivo */
+  char answer_header[BUFFER_SIZE]; /**< Header a ser enviado como resposta ao cliente, antes do arquivo */
+  char outputbuff[BUFFER_SIZE];
+  char error_html[BUFFER_SIZE];
+};
 
+/** O resto de um c_handler: a request e a resposta atuais, o arquivo,
+ *  os tempos e quem e o cliente. So e lido quando o handler e servido,
+ *  nunca no despacho do loop.
+ *
+ *  Vem de um pool proprio junto com o handler (c_handler_init()) e vive
+ *  enquanto a conexao viver.
+ */
+struct c_handler_cold
+{
+  int request_size;              /**< Quantos bytes ja chegaram em #c_handler_buffers.request */
+  int next_state; /**< Guarda o estado que tem que ir apos enviar o arquivo */
+  int keep_alive; /**< A conexao continua aberta depois dessa resposta */
+  int requests;   /**< Quantas requests ja foram respondidas nessa conexao */
+
+  int  filepathsize;
   int  filestatus;               /**< Indica se o arquivo existe ou qual erro esta associado a ele.
                                    *  Seus valores sao os mesmos da especificacao HTTP (status codes). */
-  char filestatusmsg[BUFFER_SIZE]; /**< Mensagem equivalente ao status do arquivo. */
-  int  filestatusmsg_size;         /**< O tamanho da mensagem de status do arquivo. */
-
+  int  filestatusmsg_size;       /**< O tamanho da mensagem de status do arquivo. */
+  int  filesize;                 /**< Tamanho do arquivo solicitado*/
+  int  filetype_size;            /**< Tamanho do MIME-type do arquivo */
+  int  answer_header_size;       /**< O tamanho total do header */
+  int  error_html_size;
   FILE*  filep;                  /**< Arquivo que o cliente pede */
-  int    filesize;               /**< Tamanho do arquivo solicitado*/
-  char   filetype[BUFFER_SIZE];  /**< O MIME-type do arquivo */
-  int    filetype_size;          /**< Tamanho do MIME-type do arquivo */
   time_t filelastm;              /**< Data de ultima modificacao do arquivo */
 
-  char answer_header[BUFFER_SIZE];     /**< Header a ser enviado como resposta ao cliente, antes do arquivo */
-  int  answer_header_size;             /**< O tamanho total do header */
+  /* Quando cada fase da request atual comecou (timer_now(), em ns) -
+   * veja c_handler_timing() */
+  int64_t t_request;             /**< accept() ou primeiro byte da request - 0 se nada chegou */
+  int64_t t_headers;             /**< Header inteiro */
+  int64_t t_sending;             /**< Entrou em FILE_SENDING */
+  int64_t t_first;               /**< Primeiro byte enviado - 0 se ainda nao */
+  int64_t t_wait;                /**< Parou pelo controle de banda */
+  int64_t throttled_ns;          /**< Tempo parado pelo controle de banda nessa resposta */
 
   FILE* output;
+  int   output_fd;           /**< Arquivo aberto para sendfile() - -1 quando usamos #output */
+  int   output_pread;        /**< #output_fd e lido com pread() para #c_handler_buffers.outputbuff, em vez de sendfile() */
+  off_t output_readpos;      /**< Com #output_pread: quanto do arquivo ja foi lido */
+  const char* output_map;    /**< Arquivo mapeado do cache (filecache_map()) - ou NULL */
+  int   output_prefetched;   /**< Ate onde de #output_map ja pedimos MADV_WILLNEED */
   int   output_size;
   int   output_sizeleft;
   int   output_sizesent;
-  char  outputbuff[BUFFER_SIZE];
   int   outputbuff_size;
   int   outputbuff_sizeleft;
   int   outputbuff_sizesent;
 
-  char error_html[BUFFER_SIZE];
-  int  error_html_size;
-
   int need_file_chunk;           /**< Flag que indica se precisa pegar um pedaco do arquivo. */
+  struct file_entry* fentry;     /**< Arquivo pego do cache (filecache.h) - #output_fd e dele. Ou NULL */
 
-  int timer_sizesent;        /**< Indica quanto foi mandado dentro de um intervalo */
-  struct timert timer;       /**< */
-  struct timert cronometro; /**< Vai subtrair o #timer a cada rodada do loop principal */
-  int waiting;         /**< Indica se o cliente esta 'esperando' para receber dados entre segundos */
+  const char* part[C_HANDLER_PARTS]; /**< Pedacos em memoria enviados antes do corpo (veja add_part()) */
+  int   part_size[C_HANDLER_PARTS];
+  int   nparts;
+  int   parts_size;              /**< Soma de #part_size - o corpo comeca ai em #output_sizesent */
+  char* generated;               /**< Corpo gerado na hora (/server-status) - liberado em close_file() */
 
-  int next_state; /**< Guarda o estado que tem que ir apos enviar o arquivo */
+  uint32_t peer_addr;            /**< IPv4 do cliente, na ordem da rede, como veio do accept() - 0 se desconhecido */
+  uint16_t peer_port;            /**< Porta do cliente */
+};
+
+/** Um cliente - so o que o loop principal olha a cada volta: socket,
+ *  estado, ligacoes nas listas e na roda, prazos e controle de banda.
+ *  Todo o resto fica em #cold e os buffers em #buf, entao os handlers
+ *  ficam juntos na memoria e o despacho toca poucas linhas de cache.
+ */
+struct c_handler
+{
+  struct c_handler *next; /**< Proximo handler na lista */
+  struct c_handler *prev; /**< Anterior na lista */
+  struct c_handler *next_ready; /**< Proximo handler na lista de prontos */
+  int in_ready;                 /**< Indica se o handler esta na lista de prontos */
+
+  int  client;                   /**< Socket do cliente servido. */
+  int  state;                    /**< Estado em que se encontra o handler */
+  int  can_read;                 /**< epoll avisou que ha dados para ler - vale ate recv() dar EAGAIN */
+  int  can_write;                /**< epoll avisou que da pra escrever - vale ate send() dar EAGAIN */
+  int  waiting;                  /**< Indica se o cliente esta 'esperando' para receber dados entre segundos */
+
+  struct c_handler_cold* cold;   /**< Todo o resto do handler */
+  struct c_handler_buffers* buf; /**< Buffers da request atual - NULL se a conexao esta ociosa */
+  void* engine;                  /**< Dados que so o motor de I/O usa (veja uring.c) */
+
+  struct wheel_timer wake;     /**< Acorda o cliente quando o controle de banda liberar */
+  struct wheel_timer deadline; /**< Prazo para a request chegar ou para o cliente dar sinal de vida */
+  uint64_t last_active;        /**< Quando (em ms da roda) houve progresso pela ultima vez */
+
+  struct token_bucket bucket;  /**< Controle de banda - quanto ainda posso mandar agora */
+  int  bandwidth;              /**< Limite de banda - quantos bytes/segundo posso mandar por usuario */
+  int  paced;                  /**< O kernel limita o socket (SO_MAX_PACING_RATE) e #bucket nao e usado */
+  struct traffic_class* tclass; /**< Classe de trafego (limiter.h) enquanto envia - ou NULL */
 };
 
 
@@ -121,21 +206,60 @@ enum states
 
 
 int  c_handler_list_init(struct c_handler_list* l, int max_clients);
-int  c_handler_init(struct c_handler** h, int sck, char* rootdir, size_t rootdirsize, int bandwidth);
+int  c_handler_init(struct c_handler** h, struct c_handler_list* l, int sck, const struct sockaddr_in* peer,
+                    int bandwidth, int burst, int pacing);
+void c_handler_reset(struct c_handler* h);
+int  c_handler_get_buffers(struct c_handler* h, struct c_handler_list* l);
+void c_handler_put_buffers(struct c_handler* h, struct c_handler_list* l);
 int  c_handler_add(struct c_handler* h, struct c_handler_list* l);
 int  c_handler_remove(struct c_handler* h, struct c_handler_list* l);
-void c_handler_exit(struct c_handler* h);
+struct c_handler* c_handler_find(struct c_handler_list* l, int sck);
+void c_handler_exit(struct c_handler* h, struct c_handler_list* l);
 
 int receive_request(struct c_handler* h);
-int parse_request(struct c_handler* h);
+int peek_disconnect(struct c_handler* h);
+int parse_request(struct c_handler* h, char* rootdir, size_t rootdirsize);
+
+void c_handler_timing(struct c_handler* h, int state);
+
+/** Muda o estado de 'h' para 'state', mantendo em dia os medidores
+ *  por estado de metrics.h. Toda troca de #c_handler.state passa aqui.
+ *
+ *  As trocas que fecham uma fase da request ainda marcam o tempo dela
+ *  (c_handler_timing()), e as que encerram a resposta - inteira ou
+ *  no meio - vao para o access log, se houver um.
+ */
+static inline void c_handler_set_state(struct c_handler* h, int state)
+{
+  metrics_state(h->state, state);
+  if ((h->state == HEADER_RECEIVING) || (state == FILE_SENDING) || (state == FILE_SENT))
+    c_handler_timing(h, state);
+
+  if ((accesslog_local != NULL) && (h->state == FILE_SENDING))
+    accesslog_state(h, state);
+
+  h->state = state;
+}
 
-void get_new_smaller_timeout (struct c_handler_list* l, struct c_handler *h);
-void get_new_maxfds(int* maxfds, struct c_handler_list* l, struct c_handler* h);
+int  c_handler_is_ready(struct c_handler* h);
+void c_handler_set_ready(struct c_handler* h, struct c_handler_list* l);
+struct c_handler* c_handler_take_ready(struct c_handler_list* l);
 
 int open_file(struct c_handler *h, FILE *file, size_t size);
+int open_file_fd(struct c_handler *h, int fd, size_t size);
+int open_file_map(struct c_handler *h, const char* map, size_t size);
+int open_file_pread(struct c_handler *h, int fd, size_t size);
+int open_memory(struct c_handler *h);
+int add_part(struct c_handler *h, const char* buf, int size);
+int open_response(struct c_handler *h, const char* response, int head, int size, const char* connection);
 int close_file(struct c_handler* h);
 int get_chunk(struct c_handler* h);
-int send_chunk(struct c_handler* h);
+int send_chunk(struct c_handler* h, int limit);
+int send_file_chunk(struct c_handler* h, int limit);
+int send_map_chunk(struct c_handler* h, int limit);
+const char* map_chunk(struct c_handler* h, int size);
+int send_parts_chunk(struct c_handler* h, int limit);
+int copy_parts_chunk(struct c_handler* h, char* buf, int size);
 int resolve_symlinks(char *path, size_t size);
 int check_path(char *path, char *rootdir, size_t rootdirsize);
 int check_file(char *path);
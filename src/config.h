@@ -0,0 +1,63 @@
+/**
+ * @file config.h
+ *
+ * Configuracao do servidor, montada a partir da linha de comando.
+ *
+ * Tudo o que o loop principal precisa saber sobre como servir os
+ * clientes fica aqui, para nao depender de argv.
+ */
+
+#ifndef CONFIG_H_DEFINED
+#define CONFIG_H_DEFINED
+
+#include "client.h"
+#include "limiter.h"
+#include "filecache.h"
+#include "metrics.h"
+
+
+/** Motores de I/O que o loop principal pode usar. Possuem prefixo 'ENGINE_'.
+ */
+enum engines
+{
+  ENGINE_EPOLL,  /**< Prontidao via epoll(), recv()/send() nao-bloqueantes */
+  ENGINE_URING   /**< Submissoes em lote e completions via io_uring */
+};
+
+struct server_config
+{
+  int  port;                  /**< Porta em que o servidor aceita conexoes */
+  char rootdir[BUFFER_SIZE];  /**< Diretorio raiz, ja com os symlinks expandidos */
+  int  rootdirsize;           /**< Tamanho da string #rootdir */
+  int  bandwidth;             /**< Limite de banda por cliente, em Bytes/s */
+  int  burst;                 /**< Quantos bytes um cliente pode mandar de uma vez - 0 e automatico */
+  int  kernel_pacing;         /**< Deixar o kernel limitar cada cliente (SO_MAX_PACING_RATE) */
+  int  total_bandwidth;       /**< Limite de banda do servidor inteiro, em Bytes/s - 0 desliga */
+  char* classes[LIMITER_MAX_CLASSES]; /**< Classes de trafego, como vieram da linha de comando */
+  int  nclasses;
+  struct limiter* limiter;    /**< Limite agregado, dividido por todos os workers - ou NULL */
+  int  max_clients;           /**< Maximo de clientes servidos ao mesmo tempo, por worker */
+  int  backlog;               /**< Conexoes esperando accept() na fila do kernel, por listener */
+  int  engine;                /**< Motor de I/O escolhido - veja #engines */
+  int  sendfile;              /**< Enviar arquivos regulares com sendfile() (zero-copy) */
+  int  mmap;                  /**< Enviar arquivos do cache direto de um mmap() dividido por todos */
+  int  workers;               /**< Quantos loops principais (threads) rodar */
+  int  pin_cpus;              /**< Prender cada worker numa CPU */
+  int  request_timeout;       /**< Segundos para a request chegar inteira - 0 desliga */
+  int  idle_timeout;          /**< Segundos sem progresso ate fechar o cliente - 0 desliga */
+  int  keepalive_timeout;     /**< Segundos esperando a proxima request numa conexao persistente - 0 desliga keep-alive */
+  int  max_requests;          /**< Maximo de requests por conexao - 0 e ilimitado */
+  int  file_cache;            /**< Maximo de arquivos no cache - 0 desliga */
+  struct file_cache* filecache; /**< Cache de arquivos abertos - ou NULL */
+  int  response_cache;        /**< Arquivos de ate tantos bytes ficam no cache com a resposta pronta - 0 desliga */
+  struct metrics* metrics;    /**< As metricas de cada worker (#workers delas) */
+  const char* status_path;    /**< Alvo reservado para as metricas (--status) - ou NULL */
+  int  status_path_size;
+  int  latency_dump;          /**< Mostrar as latencias de cada fase a cada tantos segundos - 0 desliga */
+  const char* access_log;     /**< Prefixo dos segmentos do access log (--access-log) - ou NULL */
+  long access_log_size;       /**< Bytes de cada segmento */
+  int  access_log_keep;       /**< Segmentos guardados por worker - 0 guarda todos */
+};
+
+
+#endif /* CONFIG_H_DEFINED */
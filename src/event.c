@@ -0,0 +1,488 @@
+/**
+ * @file event.c
+ *
+ * Implementacao do loop de eventos baseado em epoll().
+ */
+
+#define _GNU_SOURCE     /* accept4()                                 */
+
+#include <stdio.h>      /* perror()                                  */
+#include <string.h>     /* memset()                                  */
+#include <errno.h>      /* errno                                     */
+#include <unistd.h>     /* close()                                   */
+#include <sys/socket.h> /* accept4() SOCK_NONBLOCK                   */
+#include <sys/epoll.h>  /* epoll_create1() epoll_ctl() epoll_wait()  */
+
+#include "event.h"
+#include "client.h"
+#include "server.h"
+#include "states.h"
+#include "macros.h"
+#include "timer.h"
+#include "metrics.h"
+
+
+/** Cria a instancia epoll de 'e'.
+ *
+ *  @return 0 em sucesso, -1 em caso de erro (errno e setado).
+ */
+int event_loop_init(struct event_loop* e)
+{
+  if (e == NULL)
+    return -1;
+
+  memset(e, 0, sizeof(struct event_loop));
+
+  e->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (e->epfd == -1)
+    return -1;
+
+  return 0;
+}
+
+
+/** Passa a observar o socket 'fd', associando 'data' a ele.
+ *
+ *  'data' e devolvido em events[i].data.ptr sempre que 'fd' ficar pronto.
+ *  Usamos NULL para o listener e o proprio c_handler para os clientes.
+ *
+ *  @return O mesmo que epoll_ctl() - 0 em sucesso, -1 em erro.
+ */
+int event_watch(struct event_loop* e, int fd, void* data, unsigned int flags)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = flags;
+  ev.data.ptr = data;
+
+  return epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/** Para de observar o socket 'fd'.
+ *
+ *  @note close() ja remove 'fd' da instancia epoll automaticamente.
+ *  @return O mesmo que epoll_ctl().
+ */
+int event_unwatch(struct event_loop* e, int fd)
+{
+  return epoll_ctl(e->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+
+/** Espera ate 'timeout_ms' milissegundos por eventos (-1 espera para
+ *  sempre, 0 retorna imediatamente).
+ *
+ *  Os eventos ficam em e->events[0 .. e->nevents - 1].
+ *
+ *  @return O numero de eventos prontos, -1 em caso de erro.
+ *          Ser interrompido por um sinal nao e erro - retorna 0.
+ */
+int event_wait(struct event_loop* e, int timeout_ms)
+{
+  e->nevents = epoll_wait(e->epfd, e->events, EVENT_MAX_EVENTS, timeout_ms);
+  if (e->nevents == -1)
+  {
+    e->nevents = 0;
+    if (errno == EINTR)
+      return 0;
+
+    perror("Error at epoll_wait()");
+    return -1;
+  }
+  return e->nevents;
+}
+
+
+/** Fecha a instancia epoll de 'e'.
+ */
+void event_loop_exit(struct event_loop* e)
+{
+  if (e->epfd != -1)
+    close(e->epfd);
+
+  e->epfd = -1;
+}
+
+
+/** O que event_expire() precisa para acordar os handlers. */
+struct event_expire_arg
+{
+  struct server_config*  cfg;
+  struct c_handler_list* list;
+};
+
+
+/** Chamada pela roda de timers para cada timer de um handler que expira.
+ *
+ *  Ou o controle de banda liberou o cliente (#wake), ou ele estourou
+ *  o prazo (#deadline) - nos dois casos o handler volta para a lista
+ *  de prontos e o loop principal cuida do resto.
+ */
+static void event_expire(struct wheel_timer* t, void* arg)
+{
+  struct event_expire_arg* ea = arg;
+  struct c_handler* h = t->data;
+
+  METRICS_ADD(timers, 1);
+
+  if (t == &(h->wake))
+  {
+    LOG_DEBUG("Continuar a enviar arquivo para cliente %d", h->client);
+    state_woken(h);
+  }
+  else
+  {
+    if (!state_deadline_expired(h, &(ea->list->wheel), ea->cfg))
+      return;
+
+    c_handler_set_state(h, FINISHED);
+  }
+
+  c_handler_set_ready(h, ea->list);
+}
+
+
+/** Aceita os clientes na fila de 'listener' - no maximo
+ *  EVENT_ACCEPT_BATCH, e nunca mais do que cabe em 'l'.
+ *
+ *  accept4() ja devolve os sockets nao-bloqueantes, como o modo
+ *  edge-triggered exige.
+ *
+ *  @return Quantos clientes foram aceitos.
+ */
+static int event_accept(struct event_loop* loop, struct server_config* cfg,
+                        struct c_handler_list* l, int listener)
+{
+  int accepted = 0;
+
+  LOG_DEBUG("Novo cliente tentando se conectar");
+
+  while ((accepted < EVENT_ACCEPT_BATCH) && (l->current < l->max))
+  {
+    struct c_handler* handler = NULL;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int new_client;
+
+    new_client = accept4(listener, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK);
+    if (new_client == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if ((errno != EWOULDBLOCK) && (errno != EAGAIN))
+        LOG_PERROR("Erro em accept4()");
+      break;
+    }
+
+    if (c_handler_init(&handler, l, new_client, &addr, cfg->bandwidth, cfg->burst, cfg->kernel_pacing) == -1)
+    {
+      LOG_PERROR("Erro em c_handler_init()");
+      close(new_client);
+      continue;
+    }
+
+    if (c_handler_add(handler, l) == -1)
+    {
+      LOG_ERROR("Erro em c_handler_add()");
+      close(new_client);
+      c_handler_exit(handler, l);
+      continue;
+    }
+
+    if (event_watch(loop, new_client, handler, EVENT_CLIENT_FLAGS) == -1)
+    {
+      LOG_PERROR("Erro em epoll_ctl()");
+      c_handler_remove(handler, l);
+      close(new_client);
+      c_handler_exit(handler, l);
+      continue;
+    }
+
+    state_deadline_start(handler, &(l->wheel), cfg);
+
+    LOG_DEBUG("*** Nova conexao de cliente aceita! ***");
+    METRICS_ADD(accepts, 1);
+    accepted++;
+  }
+  return accepted;
+}
+
+
+/** O loop principal usando epoll() como motor de I/O.
+ *
+ *  Aceita clientes em 'listener' e os serve de acordo com 'cfg'.
+ *  So retorna em caso de erro na inicializacao.
+ *
+ *  @return -1 caso nao consiga inicializar o epoll.
+ */
+int event_run(struct server_config* cfg, int listener)
+{
+  int nevents;
+  int timeout_ms;
+  int retval;
+  int i;
+
+  struct event_loop loop;
+  struct c_handler_list handler_list;
+  struct c_handler* handler = NULL;
+  struct c_handler* next_handler = NULL;
+  struct event_expire_arg expire_arg;
+
+  int total_clients = 0;
+  int listening = 1;
+
+
+  /* Inicializar epoll() */
+  retval = event_loop_init(&loop);
+  if (retval == -1)
+  {
+    perror("Erro em epoll_create1()");
+    return -1;
+  }
+
+  // O listener fica level-triggered: o que nao couber no lote de
+  // event_accept() fica para a proxima volta
+  retval = event_watch(&loop, listener, NULL, EVENT_LISTENER_FLAGS);
+  if (retval == -1)
+  {
+    perror("Erro em epoll_ctl()");
+    event_loop_exit(&loop);
+    return -1;
+  }
+
+
+  /* Inicializar clienthandlers */
+  if (c_handler_list_init(&handler_list, cfg->max_clients) == -1)
+  {
+    perror("Erro em c_handler_list_init()");
+    event_loop_exit(&loop);
+    return -1;
+  }
+
+  expire_arg.cfg  = cfg;
+  expire_arg.list = &handler_list;
+
+  LOG_WRITE("Inicializacao completa!");
+
+  /* Main Loop */
+  while (1)
+  {
+    // Alguem saiu - ja cabe mais um cliente
+    if ((!listening) && (handler_list.current < handler_list.max))
+    {
+      if (event_watch(&loop, listener, NULL, EVENT_LISTENER_FLAGS) == 0)
+        listening = 1;
+      else
+        perror("Erro em epoll_ctl()");
+    }
+
+    // Se alguem ainda tem o que fazer, nao podemos dormir
+    // Senao, dormimos ate o proximo timer da roda (ou para sempre)
+    if (handler_list.ready_begin != NULL)
+      timeout_ms = 0;
+    else
+      timeout_ms = wheel_next_timeout(&(handler_list.wheel));
+
+    nevents = event_wait(&loop, timeout_ms);
+    METRICS_ADD(iterations, 1);
+    METRICS_ADD(events, nevents);
+
+    /* Le o relogio (uma vez so nessa volta) e acorda quem tem timer vencido */
+    wheel_advance(&(handler_list.wheel), timer_ns_to_ms(timer_update()), event_expire, &expire_arg);
+
+    for (i = 0; i < nevents; i++)
+    {
+      struct epoll_event* ev = &(loop.events[i]);
+
+      /* novas conexoes */
+      if (ev->data.ptr == NULL)
+      {
+        total_clients += event_accept(&loop, cfg, &handler_list, listener);
+
+        // Cheio: o listener sairia pronto de todo epoll_wait() sem que
+        // pudessemos aceitar ninguem - para de observa-lo ate alguem sair
+        if (handler_list.current == handler_list.max)
+        {
+          LOG_WARN("Limite de clientes atingido - parando de aceitar");
+          event_unwatch(&loop, listener);
+          listening = 0;
+        }
+        continue;
+      }
+
+      /* cliente pronto */
+      handler = ev->data.ptr;
+
+      if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        handler->can_read = 1;
+      if (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        handler->can_write = 1;
+
+      c_handler_set_ready(handler, &handler_list);
+    }
+
+
+    /* Apenas os handlers prontos sao visitados */
+    handler = c_handler_take_ready(&handler_list);
+    while (handler != NULL)
+    {
+      next_handler = handler->next_ready;
+      handler->next_ready = NULL;
+      handler->in_ready   = 0;
+
+      /* Maquina de estados dos c_handlers */
+      switch (handler->state)
+      {
+      case HEADER_RECEIVING:
+        /** @todo @bug @warning
+         *  Caso o cliente conecte mas tenha um 'lag', o epoll nao vai
+         *  avisar que tem dados.
+         *  Porem, se o cliente terminar de mandar a mensagem, vai acontecer
+         *  a mesma coisa.
+         *  Como diferenciar o fato de que o cliente pode estar numa conexao
+         *  lenta com o fato de que o cliente pode ter terminado de enviar?
+         */
+        if (handler->can_read)
+        {
+          handler->last_active = handler_list.wheel.now;
+
+          // Os buffers so existem enquanto ha uma request chegando
+          if (c_handler_get_buffers(handler, &handler_list) == -1)
+          {
+            LOG_ERROR("Erro em c_handler_get_buffers()");
+            c_handler_set_state(handler, FINISHED);
+            break;
+          }
+
+          retval = receive_request(handler);
+          if (retval == -1)
+          {
+            LOG_DEBUG("Erro de conexao com cliente!");
+            c_handler_set_state(handler, FINISHED);
+            break;
+          }
+          if (retval == 1)
+          {
+            LOG_DEBUG("Cliente desconectou");
+            c_handler_set_state(handler, FINISHED);
+            break;
+          }
+
+          state_request_check(handler);
+
+          // Nada chegou (conexao persistente ociosa): devolve os buffers
+          c_handler_put_buffers(handler, &handler_list);
+        }
+        break;
+
+      case FILE_SENDING:
+        // Checar se o cliente desconectou (sem consumir a proxima request)
+        if (handler->can_read)
+        {
+          retval = peek_disconnect(handler);
+          if (retval != 0)
+            c_handler_set_state(handler, FINISHED);
+        }
+
+        // Continuar mandando arquivo
+        if ((handler->state == FILE_SENDING) && (handler->can_write) && (handler->waiting == 0))
+        {
+          int budget;
+
+          // Com sendfile(), mmap() ou so pedacos em memoria nao ha buffer para encher
+          if ((handler->cold->need_file_chunk == 1) && ((handler->cold->output != NULL) || (handler->cold->output_pread)))
+          {
+            retval = get_chunk(handler);
+            if (retval == -1)
+            {
+              LOG_WARN("Erro na leitura do arquivo!");
+              c_handler_set_state(handler, FINISHED);
+              break;
+            }
+            if (retval == 1)
+            {
+              //terminou de pegar do arquivo!
+            }
+            handler->cold->need_file_chunk = 0;
+          }
+
+          // Sem fichas no balde, a roda de timers acorda o cliente depois
+          budget = state_send_budget(handler, &(handler_list.wheel), cfg);
+          if (budget > 0)
+          {
+            if (handler->cold->output_map != NULL)
+              retval = send_map_chunk(handler, budget);
+            else if ((handler->cold->output_fd != -1) && (!handler->cold->output_pread))
+              retval = send_file_chunk(handler, budget);
+            else if ((handler->cold->output != NULL) || (handler->cold->output_pread))
+              retval = send_chunk(handler, budget);
+            else
+              retval = send_parts_chunk(handler, budget);
+
+            if (retval == -1)
+            {
+              LOG_DEBUG("Erro de conexao!");
+              c_handler_set_state(handler, FINISHED);
+              break;
+            }
+
+            // Socket cheio - o epoll avisa quando puder escrever de novo
+            if (retval == -2)
+              break;
+
+            if (retval == 0)
+              handler->cold->need_file_chunk = 1;
+
+            handler->last_active = handler_list.wheel.now;
+
+            // So um envio que andou marca o primeiro byte e gasta fichas
+            if (retval > 0)
+            {
+              state_sent(handler, cfg, retval);
+              handler->cold->output_sizesent += retval;
+              handler->cold->output_sizeleft -= retval;
+            }
+          }
+
+          if (handler->cold->output_sizesent >= handler->cold->output_size)
+            c_handler_set_state(handler, FILE_SENT);
+        }
+        break;
+
+      case FINISHED:
+        close_file(handler);
+        state_release(handler, cfg);
+
+        wheel_del(&(handler_list.wheel), &(handler->wake));
+        wheel_del(&(handler_list.wheel), &(handler->deadline));
+
+        // close() tambem tira o cliente do epoll
+        close(handler->client);
+        c_handler_remove(handler, &handler_list);
+        c_handler_exit(handler, &handler_list);
+        handler = NULL;
+
+        LOG_DEBUG("Cliente desconectou");
+        LOG_DEBUG("Requests Servidas: %d", total_clients);
+        break;
+
+      default:
+        state_process(handler, &(handler_list.wheel), cfg);
+        break;
+      }
+
+    // Quem ainda tem o que fazer continua na lista de prontos
+    if ((handler != NULL) && (c_handler_is_ready(handler)))
+      c_handler_set_ready(handler, &handler_list);
+
+    handler = next_handler;
+
+    } /*  while (handler != NULL) */
+
+  } /* while(1) */
+
+  event_loop_exit(&loop);
+  return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * @file event.h
+ *
+ * Definicao do loop de eventos baseado em epoll().
+ *
+ * Substitui o select(): em vez de reconstruir os fd_set a cada volta e
+ * testar FD_ISSET para cada cliente, o kernel nos entrega apenas os
+ * sockets que ficaram prontos. Os clientes sao registrados em modo
+ * edge-triggered - o c_handler guarda se pode ler/escrever ate receber
+ * EAGAIN.
+ */
+
+#ifndef EVENT_H_DEFINED
+#define EVENT_H_DEFINED
+
+#include <sys/epoll.h>
+#include "config.h"
+
+
+/** Quantos eventos sao retirados do kernel por chamada de epoll_wait() */
+#define EVENT_MAX_EVENTS  64
+
+/** Quantos clientes event_run() aceita de uma vez, antes de voltar a
+ *  atender os que ja estao conectados */
+#define EVENT_ACCEPT_BATCH  64
+
+/** Eventos que registramos para cada cliente */
+#define EVENT_CLIENT_FLAGS  (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/** Eventos que registramos para o listener */
+#define EVENT_LISTENER_FLAGS  (EPOLLIN)
+
+
+struct event_loop
+{
+  int epfd;     /**< O descritor retornado por epoll_create1() */
+  int nevents;  /**< Quantos eventos a ultima chamada de event_wait() retornou */
+  struct epoll_event events[EVENT_MAX_EVENTS]; /**< Eventos prontos */
+};
+
+
+int  event_loop_init(struct event_loop* e);
+int  event_watch(struct event_loop* e, int fd, void* data, unsigned int flags);
+int  event_unwatch(struct event_loop* e, int fd);
+int  event_wait(struct event_loop* e, int timeout_ms);
+void event_loop_exit(struct event_loop* e);
+
+int  event_run(struct server_config* cfg, int listener);
+
+
+#endif /* EVENT_H_DEFINED */
@@ -0,0 +1,697 @@
+/**
+ * @file filecache.c
+ *
+ * Implementacao do cache de arquivos abertos.
+ *
+ * Cada diretorio no caminho de um arquivo guardado (desde a raiz) ganha
+ * um watch do inotify. Quando chega um evento sobre 'dir/nome', saem do
+ * cache todas as entradas cujo caminho pedido ou real seja 'dir/nome' ou
+ * esteja dentro dele - assim trocar um arquivo, um symlink ou renomear
+ * um diretorio inteiro invalida o que for preciso. Quando a ultima
+ * entrada de um diretorio sai do cache o watch dele e retirado - senao
+ * eles se acumulariam ate o limite do sistema (max_user_watches).
+ *
+ * No caminho de toda request so o lock de uma parte (#file_shard) e
+ * pego, e so em filecache_get(): devolver a entrada e usar o mapeamento
+ * dela nao travam nada, ja que #file_entry.refs e atomico.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>     /* malloc() free() realloc()                 */
+#include <string.h>     /* memset() strncpy() strdup()               */
+#include <errno.h>      /* errno                                     */
+#include <unistd.h>     /* close() read()                            */
+#include <sys/inotify.h> /* inotify_init1() inotify_add_watch() inotify_rm_watch() */
+#include <sys/mman.h>   /* mmap() munmap() madvise()                 */
+#include <sys/stat.h>   /* fstat() stat()                            */
+
+#include "filecache.h"
+#include "macros.h"
+
+
+/** Eventos que invalidam entradas */
+#define FILECACHE_EVENTS  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+                           IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |            \
+                           IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+/** Hash FNV-1a de 'key'. */
+static uint32_t filecache_hash(const char* key)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*key != '\0')
+  {
+    hash ^= (unsigned char)*key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+/** A parte de 'c' onde fica o hash 'hash'. */
+static struct file_shard* filecache_shard(struct file_cache* c, uint32_t hash)
+{
+  return &(c->shards[hash & (FILECACHE_SHARDS - 1)]);
+}
+
+
+/** A lista da tabela de 's' onde fica o hash 'hash'. */
+static struct file_entry** filecache_bucket(struct file_shard* s, uint32_t hash)
+{
+  return &(s->table[(hash / FILECACHE_SHARDS) & (FILECACHE_BUCKETS - 1)]);
+}
+
+
+/** Tira 'e' da LRU de 's'. */
+static void filecache_lru_unlink(struct file_shard* s, struct file_entry* e)
+{
+  if (e->newer != NULL)
+    e->newer->older = e->older;
+  else
+    s->newest = e->older;
+
+  if (e->older != NULL)
+    e->older->newer = e->newer;
+  else
+    s->oldest = e->newer;
+
+  e->newer = NULL;
+  e->older = NULL;
+}
+
+
+/** Coloca 'e' no comeco da LRU de 's' (a usada mais recentemente). */
+static void filecache_lru_push(struct file_shard* s, struct file_entry* e)
+{
+  e->newer = NULL;
+  e->older = s->newest;
+
+  if (s->newest != NULL)
+    s->newest->newer = e;
+  else
+    s->oldest = e;
+
+  s->newest = e;
+}
+
+
+/** Libera 'e' de vez - ninguem mais pode estar usando. */
+static void filecache_free(struct file_entry* e)
+{
+  if (e->map != NULL)
+    munmap(e->map, e->size);
+
+  close(e->fd);
+  free(e->response);
+  free(e);
+}
+
+
+/** Larga uma referencia a 'e' - a ultima libera ela. Nao precisa de lock. */
+static void filecache_unref(struct file_entry* e)
+{
+  if (__atomic_sub_fetch(&(e->refs), 1, __ATOMIC_ACQ_REL) == 0)
+    filecache_free(e);
+}
+
+
+static void filecache_unwatch(struct file_cache* c, const int* wds, int count);
+
+
+/** Tira 'e' da parte 's' do cache 'c', largando os seus watches. Ela
+ *  continua valendo para quem ainda a usa.
+ *
+ *  @note Chamar com #file_shard.lock travado.
+ */
+static void filecache_drop(struct file_cache* c, struct file_shard* s, struct file_entry* e)
+{
+  struct file_entry** link = filecache_bucket(s, e->hash);
+
+  while (*link != e)
+    link = &((*link)->hnext);
+  *link = e->hnext;
+
+  filecache_lru_unlink(s, e);
+  e->cached = 0;
+  s->count--;
+
+  pthread_mutex_lock(&(c->watch_lock));
+  filecache_unwatch(c, e->watched, e->nwatched);
+  pthread_mutex_unlock(&(c->watch_lock));
+
+  filecache_unref(e);
+}
+
+
+/** Procura 'key' na parte 's'.
+ *
+ *  @note Chamar com #file_shard.lock travado.
+ */
+static struct file_entry* filecache_find(struct file_shard* s, const char* key, uint32_t hash)
+{
+  struct file_entry* e = *filecache_bucket(s, hash);
+
+  while (e != NULL)
+  {
+    if ((e->hash == hash) && (strcmp(e->key, key) == 0))
+      return e;
+
+    e = e->hnext;
+  }
+  return NULL;
+}
+
+
+/** Diz se 's' e 'prefix' ou esta dentro dele. */
+static int filecache_under(const char* s, const char* prefix, int size)
+{
+  return (strncmp(s, prefix, size) == 0) && ((s[size] == '\0') || (s[size] == '/'));
+}
+
+
+/** Tira do cache tudo o que for 'prefix' ou estiver dentro dele.
+ *  Com 'prefix' NULL, tira tudo. Passa por todas as partes, uma de
+ *  cada vez.
+ *
+ *  @note Chamar sem nenhum lock travado.
+ */
+static void filecache_invalidate(struct file_cache* c, const char* prefix)
+{
+  int size = (prefix != NULL) ? (int)strlen(prefix) : 0;
+  int i;
+
+  for (i = 0; i < FILECACHE_SHARDS; i++)
+  {
+    struct file_shard* s = &(c->shards[i]);
+    struct file_entry* e;
+
+    pthread_mutex_lock(&(s->lock));
+    e = s->newest;
+    while (e != NULL)
+    {
+      struct file_entry* older = e->older;
+
+      if ((prefix == NULL) ||
+          (filecache_under(e->key, prefix, size)) ||
+          (filecache_under(e->path, prefix, size)))
+        filecache_drop(c, s, e);
+
+      e = older;
+    }
+    pthread_mutex_unlock(&(s->lock));
+  }
+}
+
+
+/** Observa o diretorio 'dir' (os 'size' primeiros bytes) - ou so conta
+ *  mais um usuario do watch dele, se ja estiver sendo observado.
+ *
+ *  @note Chamar com #file_cache.watch_lock travado.
+ *  @return O watch descriptor, ou -1 em caso de erro (errno e setado).
+ */
+static int filecache_watch(struct file_cache* c, const char* dir, int size)
+{
+  char path[BUFFER_SIZE];
+  int wd;
+  int i;
+
+  if (size >= BUFFER_SIZE)
+    return -1;
+
+  memcpy(path, dir, size);
+  path[size] = '\0';
+
+  for (i = 0; i < c->nwatches; i++)
+  {
+    if ((c->watches[i].dir != NULL) && (strcmp(c->watches[i].dir, path) == 0))
+    {
+      c->watches[i].refs++;
+      return i;
+    }
+  }
+
+  wd = inotify_add_watch(c->inotify, path, FILECACHE_EVENTS | IN_ONLYDIR);
+  if (wd == -1)
+    return -1;
+
+  if (wd >= c->nwatches)
+  {
+    struct file_watch* watches = realloc(c->watches, (wd + 1) * sizeof(struct file_watch));
+    if (watches == NULL)
+    {
+      inotify_rm_watch(c->inotify, wd);
+      return -1;
+    }
+
+    for (i = c->nwatches; i <= wd; i++)
+    {
+      watches[i].dir  = NULL;
+      watches[i].refs = 0;
+    }
+
+    c->watches  = watches;
+    c->nwatches = wd + 1;
+  }
+
+  // Com um symlink, outro caminho pode dar no mesmo diretorio - e no
+  // mesmo watch, que fica com o primeiro nome
+  if (c->watches[wd].dir == NULL)
+  {
+    c->watches[wd].dir = strdup(path);
+    if (c->watches[wd].dir == NULL)
+    {
+      inotify_rm_watch(c->inotify, wd);
+      return -1;
+    }
+  }
+
+  c->watches[wd].refs++;
+  return wd;
+}
+
+
+/** Larga os 'count' watches em 'wds', pegos com filecache_watch(). Os
+ *  que ficam sem usuarios deixam de ser observados.
+ *
+ *  @note Chamar com #file_cache.watch_lock travado.
+ */
+static void filecache_unwatch(struct file_cache* c, const int* wds, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    struct file_watch* w = &(c->watches[wds[i]]);
+
+    // O kernel ja tirou (IN_IGNORED)
+    if (w->dir == NULL)
+      continue;
+
+    w->refs--;
+    if (w->refs == 0)
+    {
+      inotify_rm_watch(c->inotify, wds[i]);
+      free(w->dir);
+      w->dir = NULL;
+    }
+  }
+}
+
+
+/** Quantos diretorios de 'path' filecache_watch_path() observa. */
+static int filecache_depth(struct file_cache* c, const char* path)
+{
+  int count = 0;
+  int i;
+
+  for (i = c->rootdirsize + 1; path[i] != '\0'; i++)
+    if (path[i] == '/')
+      count++;
+
+  return count;
+}
+
+
+/** Observa todos os diretorios de 'path', da raiz ate o arquivo, e
+ *  guarda os watches no fim de #e->watched.
+ *
+ *  @note Chamar com #file_cache.watch_lock travado.
+ *  @return 0 em sucesso, -1 em caso de erro.
+ */
+static int filecache_watch_path(struct file_cache* c, struct file_entry* e, const char* path)
+{
+  int wd;
+  int i;
+
+  for (i = c->rootdirsize + 1; path[i] != '\0'; i++)
+  {
+    if (path[i] != '/')
+      continue;
+
+    wd = filecache_watch(c, path, i);
+    if (wd == -1)
+      return -1;
+
+    e->watched[e->nwatched++] = wd;
+  }
+  return 0;
+}
+
+
+/** Diz se o arquivo aberto como 'fd', com os metadados 'st' de antes,
+ *  mudou desde entao - ou se 'path' ja nao e mais ele.
+ */
+static int filecache_changed(const char* path, int fd, const struct stat* st)
+{
+  struct stat now;
+  struct stat named;
+
+  if ((fstat(fd, &now) == -1) || (stat(path, &named) == -1))
+    return 1;
+
+  return (now.st_size != st->st_size) ||
+         (now.st_mtim.tv_sec  != st->st_mtim.tv_sec) ||
+         (now.st_mtim.tv_nsec != st->st_mtim.tv_nsec) ||
+         (now.st_ctim.tv_sec  != st->st_ctim.tv_sec) ||
+         (now.st_ctim.tv_nsec != st->st_ctim.tv_nsec) ||
+         (named.st_dev != now.st_dev) || (named.st_ino != now.st_ino);
+}
+
+
+/** Trata um evento do inotify. */
+static void filecache_event(struct file_cache* c, struct inotify_event* ev)
+{
+  char prefix[BUFFER_SIZE * 2];
+  char* dir;
+
+  if (ev->mask & IN_Q_OVERFLOW)
+  {
+    // Perdemos eventos - nao da pra saber o que mudou
+    filecache_invalidate(c, NULL);
+    return;
+  }
+
+  pthread_mutex_lock(&(c->watch_lock));
+  if ((ev->wd < 0) || (ev->wd >= c->nwatches) || (c->watches[ev->wd].dir == NULL))
+  {
+    pthread_mutex_unlock(&(c->watch_lock));
+    return;
+  }
+
+  dir = c->watches[ev->wd].dir;
+  if (ev->len > 0)
+    snprintf(prefix, sizeof(prefix), "%s/%s", dir, ev->name);
+  else
+    snprintf(prefix, sizeof(prefix), "%s", dir);
+
+  // O diretorio sumiu e o kernel ja tirou o watch - as entradas que
+  // ainda o usam saem logo abaixo
+  if (ev->mask & IN_IGNORED)
+  {
+    free(c->watches[ev->wd].dir);
+    c->watches[ev->wd].dir  = NULL;
+    c->watches[ev->wd].refs = 0;
+  }
+  pthread_mutex_unlock(&(c->watch_lock));
+
+  filecache_invalidate(c, prefix);
+}
+
+
+/** O corpo da thread que le o inotify. Nunca retorna. */
+static void* filecache_loop(void* arg)
+{
+  struct file_cache* c = arg;
+  char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1)
+  {
+    ssize_t size = read(c->inotify, buff, sizeof(buff));
+    ssize_t i;
+
+    if (size <= 0)
+    {
+      if ((size == -1) && (errno == EINTR))
+        continue;
+
+      // Sem como saber o que muda, o cache nao pode continuar valendo
+      LOG_PERROR("Erro em filecache_loop() - read()");
+      for (i = 0; i < FILECACHE_SHARDS; i++)
+      {
+        pthread_mutex_lock(&(c->shards[i].lock));
+        c->shards[i].max = 0;
+        pthread_mutex_unlock(&(c->shards[i].lock));
+      }
+      filecache_invalidate(c, NULL);
+      return NULL;
+    }
+
+    for (i = 0; i < size; )
+    {
+      struct inotify_event* ev = (struct inotify_event*)(buff + i);
+
+      filecache_event(c, ev);
+      i += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  return NULL;
+}
+
+
+/** Inicializa o cache 'c', com cerca de 'max' entradas, para arquivos
+ *  dentro de 'rootdir', e cria a thread que le o inotify.
+ *
+ *  Cada uma das #FILECACHE_SHARDS partes guarda 'max' / #FILECACHE_SHARDS
+ *  entradas, arredondado para cima.
+ *
+ *  @return 0 em sucesso, -1 em caso de erro (errno e setado).
+ */
+int filecache_init(struct file_cache* c, int max, const char* rootdir, int rootdirsize)
+{
+  int retval;
+  int i;
+
+  if ((c == NULL) || (max <= 0) || (rootdirsize >= BUFFER_SIZE))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(c, 0, sizeof(struct file_cache));
+  memcpy(c->rootdir, rootdir, rootdirsize);
+  c->rootdirsize = rootdirsize;
+
+  for (i = 0; i < FILECACHE_SHARDS; i++)
+  {
+    c->shards[i].max = (max + FILECACHE_SHARDS - 1) / FILECACHE_SHARDS;
+    if (pthread_mutex_init(&(c->shards[i].lock), NULL) != 0)
+      return -1;
+  }
+
+  if (pthread_mutex_init(&(c->watch_lock), NULL) != 0)
+    return -1;
+
+  c->inotify = inotify_init1(IN_CLOEXEC);
+  if (c->inotify == -1)
+    return -1;
+
+  if (filecache_watch(c, c->rootdir, c->rootdirsize) == -1)
+  {
+    close(c->inotify);
+    return -1;
+  }
+
+  retval = pthread_create(&(c->thread), NULL, filecache_loop, c);
+  if (retval != 0)
+  {
+    close(c->inotify);
+    errno = retval;
+    return -1;
+  }
+  pthread_detach(c->thread);
+
+  return 0;
+}
+
+
+/** Procura o arquivo pedido como 'key'.
+ *
+ *  @note Devolver com filecache_release() quando terminar de usar.
+ *  @return A entrada, ou NULL se 'key' nao estiver no cache.
+ */
+struct file_entry* filecache_get(struct file_cache* c, const char* key)
+{
+  uint32_t hash = filecache_hash(key);
+  struct file_shard* s = filecache_shard(c, hash);
+  struct file_entry* e;
+
+  pthread_mutex_lock(&(s->lock));
+
+  e = filecache_find(s, key, hash);
+  if (e != NULL)
+  {
+    __atomic_add_fetch(&(e->refs), 1, __ATOMIC_RELAXED);
+    filecache_lru_unlink(s, e);
+    filecache_lru_push(s, e);
+  }
+
+  pthread_mutex_unlock(&(s->lock));
+  return e;
+}
+
+
+/** Guarda no cache o arquivo pedido como 'key', que na verdade esta em
+ *  'path', ja foi aberto como 'fd' e tem os metadados 'st'.
+ *
+ *  'response' (alocada com malloc(), ou NULL) e a resposta pronta, com
+ *  'response_head' bytes de header - veja #file_entry.response.
+ *
+ *  O cache passa a ser dono de 'fd' e de 'response' - inclusive se der
+ *  erro, quando eles sao liberados. Se outro worker guardou 'key' antes,
+ *  a entrada dele e usada. Se o arquivo mudou desde 'st', nada e
+ *  guardado.
+ *
+ *  @note Devolver com filecache_release() quando terminar de usar.
+ *  @return A entrada, ou NULL em caso de erro.
+ */
+struct file_entry* filecache_put(struct file_cache* c, const char* key, const char* path,
+                                 const char* type, int fd, const struct stat* st,
+                                 char* response, int response_head, int response_size)
+{
+  uint32_t hash = filecache_hash(key);
+  struct file_shard* s = filecache_shard(c, hash);
+  struct file_entry* e;
+  int depth;
+  int watched;
+
+  pthread_mutex_lock(&(s->lock));
+
+  e = filecache_find(s, key, hash);
+  if (e != NULL)
+  {
+    __atomic_add_fetch(&(e->refs), 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(s->lock));
+    close(fd);
+    free(response);
+    return e;
+  }
+
+  depth = filecache_depth(c, key) + filecache_depth(c, path);
+  e = malloc(sizeof(struct file_entry) + (depth * sizeof(int)));
+  if (e == NULL)
+  {
+    pthread_mutex_unlock(&(s->lock));
+    close(fd);
+    free(response);
+    return NULL;
+  }
+  e->nwatched = 0;
+
+  // Sem os watches nao teriamos como saber que o arquivo mudou. E o
+  // que mudou entre o open() de quem chamou e os watches o inotify nao
+  // viu: por isso 'fd' e 'path' sao conferidos de novo, ja com eles
+  watched = 0;
+  if (s->max > 0)
+  {
+    pthread_mutex_lock(&(c->watch_lock));
+    watched = (filecache_watch_path(c, e, key) == 0) && (filecache_watch_path(c, e, path) == 0);
+    pthread_mutex_unlock(&(c->watch_lock));
+  }
+
+  if ((!watched) || (filecache_changed(path, fd, st)))
+  {
+    pthread_mutex_lock(&(c->watch_lock));
+    filecache_unwatch(c, e->watched, e->nwatched);
+    pthread_mutex_unlock(&(c->watch_lock));
+
+    pthread_mutex_unlock(&(s->lock));
+    free(e);
+    close(fd);
+    free(response);
+    return NULL;
+  }
+
+  strncpy(e->key,  key,  BUFFER_SIZE - 1);
+  strncpy(e->path, path, BUFFER_SIZE - 1);
+  strncpy(e->type, type, BUFFER_SIZE - 1);
+  e->key[BUFFER_SIZE - 1]  = '\0';
+  e->path[BUFFER_SIZE - 1] = '\0';
+  e->type[BUFFER_SIZE - 1] = '\0';
+  e->type_size = strlen(e->type);
+  e->size  = st->st_size;
+  e->mtime = st->st_mtime;
+  e->fd    = fd;
+  e->hash  = hash;
+
+  e->response      = response;
+  e->response_head = response_head;
+  e->response_size = response_size;
+
+  e->map        = NULL;
+  e->map_failed = 0;
+
+  while (s->count >= s->max)
+    filecache_drop(c, s, s->oldest);
+
+  e->hnext = *filecache_bucket(s, hash);
+  *filecache_bucket(s, hash) = e;
+  filecache_lru_push(s, e);
+  e->cached = 1;
+  e->refs   = 2;
+  s->count++;
+
+  pthread_mutex_unlock(&(s->lock));
+  return e;
+}
+
+
+/** Devolve 'e', pego com filecache_get() ou filecache_put(). Se ela ja
+ *  saiu do cache e esse era o ultimo usuario, o fd e fechado.
+ */
+void filecache_release(struct file_cache* c, struct file_entry* e)
+{
+  (void)c;
+  filecache_unref(e);
+}
+
+
+/** Mapeia o arquivo de 'e' na memoria, caso ainda nao esteja.
+ *
+ *  O mapeamento e um so para todos os clientes baixando o arquivo, e
+ *  so e desfeito quando o ultimo devolver 'e' - mesmo que o inotify ja
+ *  a tenha tirado do cache. As paginas sao as do page cache: nenhum
+ *  cliente tem buffer proprio.
+ *
+ *  Quem baixa um arquivo le do comeco ao fim, entao pedimos ao kernel
+ *  leitura antecipada agressiva (MADV_SEQUENTIAL).
+ *
+ *  So o primeiro mmap() de cada entrada trava a parte dela.
+ *
+ *  @return O comeco do arquivo, ou NULL se ele nao puder ser mapeado
+ *          (vazio, por exemplo).
+ */
+const char* filecache_map(struct file_cache* c, struct file_entry* e)
+{
+  struct file_shard* s = filecache_shard(c, e->hash);
+  void* map;
+
+  map = __atomic_load_n(&(e->map), __ATOMIC_ACQUIRE);
+  if ((map != NULL) || (__atomic_load_n(&(e->map_failed), __ATOMIC_ACQUIRE)))
+    return map;
+
+  pthread_mutex_lock(&(s->lock));
+
+  if ((e->map == NULL) && (!e->map_failed))
+  {
+    map = MAP_FAILED;
+    if (e->size > 0)
+      map = mmap(NULL, e->size, PROT_READ, MAP_SHARED, e->fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+      if (e->size > 0)
+        LOG_PERROR("Erro em filecache_map() - mmap()");
+      __atomic_store_n(&(e->map_failed), 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+      madvise(map, e->size, MADV_SEQUENTIAL);
+      __atomic_store_n(&(e->map), map, __ATOMIC_RELEASE);
+    }
+  }
+
+  pthread_mutex_unlock(&(s->lock));
+  return e->map;
+}
+
+
+/** Diz se o caminho 'key' pode ir para o cache.
+ *
+ *  Caminhos com "//", "/." ou "/.." nao batem com os diretorios que o
+ *  inotify observa - esses sempre vao pelo caminho normal.
+ */
+int filecache_can_store(const char* key)
+{
+  return (strstr(key, "//") == NULL) && (strstr(key, "/.") == NULL);
+}
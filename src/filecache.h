@@ -0,0 +1,119 @@
+/**
+ * @file filecache.h
+ *
+ * Definicao do cache de arquivos abertos (metadados + fd).
+ *
+ * Sem o cache, cada GET faz realpath(), tres stat() e um open() no mesmo
+ * arquivo. Aqui guardamos, pelo caminho pedido, o caminho ja resolvido,
+ * o tamanho, o MIME-type e um fd aberto, que e dividido por todos os
+ * clientes baixando o arquivo ao mesmo tempo (sendfile() e o read() do
+ * io_uring usam offset proprio, entao ninguem atrapalha ninguem).
+ *
+ * Arquivos pequenos ainda guardam a resposta inteira (#file_entry.response),
+ * ja pronta para ir ao socket de uma vez. Com --mmap, os outros ganham um
+ * mmap() (#file_entry.map), feito uma vez so e dividido do mesmo jeito.
+ *
+ * Uma thread le os eventos do inotify nos diretorios dos arquivos
+ * guardados e joga fora as entradas que mudaram. Cada watch conta
+ * quantas entradas dependem dele, e sai quando a ultima sai do cache.
+ *
+ * O cache e dividido em #FILECACHE_SHARDS partes pelo hash do caminho,
+ * cada uma com seu lock, sua tabela e sua LRU: workers pedindo arquivos
+ * diferentes quase nunca disputam o mesmo lock. Cada parte tem no maximo
+ * #file_shard.max entradas - quando enche, sai a usada ha mais tempo.
+ */
+
+#ifndef FILECACHE_H_DEFINED
+#define FILECACHE_H_DEFINED
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>  /* off_t                                     */
+#include <sys/stat.h>   /* struct stat                               */
+
+#include "client.h"
+
+
+/** Em quantas partes o cache e dividido - potencia de 2 */
+#define FILECACHE_SHARDS   16
+
+/** Quantas listas tem a tabela hash de cada parte - potencia de 2 */
+#define FILECACHE_BUCKETS  128
+
+
+struct file_entry
+{
+  char   key[BUFFER_SIZE];  /**< Caminho pedido (raiz + alvo), antes de resolver symlinks */
+  char   path[BUFFER_SIZE]; /**< Caminho real do arquivo (com o index.html, se for diretorio) */
+  char   type[BUFFER_SIZE]; /**< MIME-type */
+  int    type_size;
+  off_t  size;
+  time_t mtime;
+  int    fd;               /**< Aberto so para leitura - dividido por todos */
+
+  char* response;          /**< Header (sem a linha Connection) seguido do arquivo - ou NULL */
+  int   response_head;     /**< Tamanho do header em #response */
+  int   response_size;     /**< Tamanho total de #response */
+
+  char* map;               /**< O arquivo inteiro com mmap() - ou NULL ate filecache_map() */
+  int   map_failed;        /**< mmap() ja falhou - nao tentar de novo */
+
+  uint32_t hash;            /**< Hash de #key */
+
+  int refs;                 /**< Clientes usando + 1 enquanto estiver no cache - so muda com operacoes atomicas */
+  int cached;               /**< Ainda esta no cache (nao foi invalidada nem expulsa) */
+
+  struct file_entry* hnext; /**< Proxima na mesma lista da tabela hash */
+  struct file_entry* newer; /**< Vizinhos na LRU */
+  struct file_entry* older;
+
+  int nwatched;             /**< Tamanho de #watched */
+  int watched[];            /**< Os watches de #file_cache.watches que essa entrada usa, um por
+                              *  diretorio de #key e de #path - largados quando ela sai do cache */
+};
+
+/** Um diretorio observado pelo inotify. */
+struct file_watch
+{
+  char* dir;                /**< O caminho - NULL se o watch descriptor nao esta em uso */
+  int   refs;               /**< Entradas do cache que dependem dele (+ 1 na raiz) */
+};
+
+/** Uma parte do cache: as entradas cujo hash cai nela. */
+struct file_shard
+{
+  pthread_mutex_t lock;     /**< Os workers e a thread do inotify dividem a parte */
+  int max;                  /**< Maximo de entradas */
+  int count;
+  struct file_entry* table[FILECACHE_BUCKETS];
+  struct file_entry* newest; /**< Comeco da LRU - a usada mais recentemente */
+  struct file_entry* oldest; /**< Fim da LRU - a proxima a sair */
+} __attribute__((aligned(64)));
+
+struct file_cache
+{
+  struct file_shard shards[FILECACHE_SHARDS];
+
+  char rootdir[BUFFER_SIZE];
+  int  rootdirsize;
+
+  pthread_mutex_t watch_lock; /**< Protege #watches - pego com o lock de uma parte, nunca antes dele */
+  int    inotify;           /**< fd do inotify */
+  struct file_watch* watches; /**< Diretorio observado por cada watch descriptor */
+  int    nwatches;          /**< Tamanho de #watches */
+  pthread_t thread;
+};
+
+
+int  filecache_init(struct file_cache* c, int max, const char* rootdir, int rootdirsize);
+
+struct file_entry* filecache_get(struct file_cache* c, const char* key);
+struct file_entry* filecache_put(struct file_cache* c, const char* key, const char* path,
+                                 const char* type, int fd, const struct stat* st,
+                                 char* response, int response_head, int response_size);
+void filecache_release(struct file_cache* c, struct file_entry* e);
+const char* filecache_map(struct file_cache* c, struct file_entry* e);
+int  filecache_can_store(const char* key);
+
+
+#endif /* FILECACHE_H_DEFINED */
@@ -0,0 +1,109 @@
+/**
+ * @file histogram.c
+ *
+ * Implementacao dos histogramas log-lineares de latencia.
+ *
+ * Abaixo de 2*HIST_SUB cada valor tem a sua faixa. Dai para cima, um
+ * valor com o bit mais alto em 'e' cai na potencia 'e - HIST_SUB_BITS',
+ * na faixa dada pelos HIST_SUB_BITS bits logo abaixo do mais alto.
+ */
+
+#include <string.h>     /* memset()                                  */
+
+#include "histogram.h"
+
+
+/** A faixa de 'us'. */
+static int hist_index(uint64_t us)
+{
+  int shift;
+
+  if (us < HIST_SUB)
+    return (int)us;
+
+  if (us >= (1ULL << HIST_MAX_BITS))
+    us = (1ULL << HIST_MAX_BITS) - 1;
+
+  shift = (63 - __builtin_clzll(us)) - HIST_SUB_BITS;
+  return ((shift + 1) * HIST_SUB) + (int)((us >> shift) - HIST_SUB);
+}
+
+
+/** O maior valor que cai na faixa 'index'. */
+static uint64_t hist_value(int index)
+{
+  int shift = (index / HIST_SUB) - 1;
+  uint64_t sub = (index % HIST_SUB) + HIST_SUB;
+
+  if (shift <= 0)
+    return index;
+
+  return ((sub + 1) << shift) - 1;
+}
+
+
+/** Grava 'us' em 'h'. So a thread dona de 'h' pode chamar. */
+void hist_record(struct histogram* h, uint64_t us)
+{
+  int i = hist_index(us);
+
+  __atomic_store_n(&(h->count), h->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&(h->sum), h->sum + us, __ATOMIC_RELAXED);
+  __atomic_store_n(&(h->buckets[i]), h->buckets[i] + 1, __ATOMIC_RELAXED);
+}
+
+
+/** Soma 'src' (que pode estar sendo gravado por outra thread) em 'dst'. */
+void hist_merge(struct histogram* dst, const struct histogram* src)
+{
+  int i;
+
+  dst->count += __atomic_load_n(&(src->count), __ATOMIC_RELAXED);
+  dst->sum   += __atomic_load_n(&(src->sum), __ATOMIC_RELAXED);
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    dst->buckets[i] += __atomic_load_n(&(src->buckets[i]), __ATOMIC_RELAXED);
+}
+
+
+/** Zera 'h'. So a thread dona de 'h' pode chamar. */
+void hist_reset(struct histogram* h)
+{
+  int i;
+
+  __atomic_store_n(&(h->count), 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&(h->sum), 0, __ATOMIC_RELAXED);
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    __atomic_store_n(&(h->buckets[i]), 0, __ATOMIC_RELAXED);
+}
+
+
+/** O percentil 'permyriad' de 'h', em decimos de milesimo: 5000 e a
+ *  mediana, 9900 o p99 e 9990 o p999.
+ *
+ *  @return O maior valor da faixa onde o percentil cai (em us), ou 0
+ *          se 'h' esta vazio.
+ */
+uint64_t hist_quantile(const struct histogram* h, int permyriad)
+{
+  uint64_t rank;
+  uint64_t seen = 0;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+
+  // O menor 'rank' tal que pelo menos permyriad/10000 dos valores sao <= ele
+  rank = ((h->count * permyriad) + 9999) / 10000;
+  if (rank == 0)
+    rank = 1;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+  {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      return hist_value(i);
+  }
+  return hist_value(HIST_BUCKETS - 1);
+}
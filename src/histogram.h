@@ -0,0 +1,47 @@
+/**
+ * @file histogram.h
+ *
+ * Definicao dos histogramas log-lineares de latencia (no estilo do
+ * HdrHistogram).
+ *
+ * Os valores (em microssegundos) sao separados por potencia de 2 e,
+ * dentro de cada potencia, em HIST_SUB faixas do mesmo tamanho - o erro
+ * de qualquer percentil fica abaixo de 1/HIST_SUB (~3%), de 1us ate
+ * horas, com um vetor fixo de contadores. Gravar e so achar o indice
+ * (um clz) e somar 1: nada de alocacao nem de ordenar amostras.
+ *
+ * Como as metricas (metrics.h), cada histograma tem um escritor so e e
+ * lido de outras threads com loads 'relaxed'.
+ */
+
+#ifndef HISTOGRAM_H_DEFINED
+#define HISTOGRAM_H_DEFINED
+
+#include <stdint.h>
+
+
+/** Faixas por potencia de 2 = 2^HIST_SUB_BITS */
+#define HIST_SUB_BITS  5
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+
+/** Maior valor guardado: 2^HIST_MAX_BITS - 1 us (~19 horas) */
+#define HIST_MAX_BITS  36
+
+#define HIST_BUCKETS   ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+
+struct histogram
+{
+  uint64_t count;                 /**< Quantos valores foram gravados */
+  uint64_t sum;                   /**< A soma deles, em us */
+  uint64_t buckets[HIST_BUCKETS]; /**< Quantos cairam em cada faixa */
+};
+
+
+void     hist_record(struct histogram* h, uint64_t us);
+void     hist_merge(struct histogram* dst, const struct histogram* src);
+void     hist_reset(struct histogram* h);
+uint64_t hist_quantile(const struct histogram* h, int permyriad);
+
+
+#endif /* HISTOGRAM_H_DEFINED */
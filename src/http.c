@@ -9,15 +9,59 @@
  */
 
 #include <string.h>
+#include <strings.h>    /* strncasecmp()                             */
 #include <ctype.h>
 #include "http.h"
 
-#define PROTOCOL "HTTP/1.0"
+#define PROTOCOL "HTTP/1.1"
 #define PACKAGE_NAME PACKAGE"/"VERSION
 
 
 
-/** Constroi e atribui o header HTTP ao 'buf' (respeitando 'bufsize').
+/** Constroi o comeco do header HTTP em 'buf' (respeitando 'bufsize'):
+ *  tudo menos a linha "Connection:" e a linha vazia do fim.
+ *
+ *  Assim o cache de respostas guarda uma parte so, que serve tanto para
+ *  conexoes persistentes quanto para as que vao fechar.
+ *
+ *  @return O numero de caracteres atribuidos a 'buf' ou -1 se nao couber.
+ */
+int http_build_head(char* buf, size_t bufsize, int status, char* statusmsg, char* type, int length)
+{
+  int n;
+
+  //~ char last_modif[BUFFER_SIZE];
+  //LIDAR COM O TEMPO!!!!!!
+  //strftime (timebuf)
+
+  n = snprintf(buf, bufsize,
+                      "%s %d %s\r\n"
+                      "Server: %s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Length: %d\r\n",
+                      //~ "Last-Modified: %s"
+                      PROTOCOL, status, statusmsg,
+                      PACKAGE_NAME,
+                      type,
+                      length);
+  if ((n < 0) || ((size_t)n >= bufsize))
+    return -1;
+
+  return n;
+}
+
+
+/** A linha "Connection:" (e a linha vazia que termina o header) para
+ *  uma resposta com ou sem 'keep_alive'.
+ */
+const char* http_connection_line(int keep_alive)
+{
+  return (keep_alive) ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+
+/** Constroi e atribui o header HTTP ao #h->buf->answer_header (respeitando
+ *  #h->cold->answer_header_size).
  *
  *  A mensagem e construida de acordo com os parametros.
  *  @todo Remover valores arbitrarios dos buffers.
@@ -28,23 +72,15 @@ int http_build_header(struct c_handler* h)
 {
   int n;
 
-  //~ char last_modif[BUFFER_SIZE];
-  //LIDAR COM O TEMPO!!!!!!
-  //strftime (timebuf)
+  n = http_build_head(h->buf->answer_header, h->cold->answer_header_size,
+                      h->cold->filestatus, h->buf->filestatusmsg, h->buf->filetype, h->cold->filesize);
+  if (n == -1)
+    return -1;
 
-  n = snprintf(h->answer_header, h->answer_header_size,
-                                          "%s %d %s\r\n"
-                                          "Server: %s\r\n"
-                                          "Content-Type: %s\r\n"
-                                          "Content-Length: %d\r\n"
-                                          //~ "Last-Modified: %s"
-                                          "Connection: close\r\n"
-                                          "\r\n",
-                                          PROTOCOL, h->filestatus, h->filestatusmsg,
-                                          PACKAGE_NAME,
-                                          h->filetype,
-                                          h->filesize);
-  if (!find_crlf(h->answer_header))
+  n += snprintf(h->buf->answer_header + n, h->cold->answer_header_size - n, "%s",
+                http_connection_line(h->cold->keep_alive));
+
+  if (!find_crlf(h->buf->answer_header))
     return -1;
 
   return n;
@@ -52,6 +88,47 @@ int http_build_header(struct c_handler* h)
 
 
 
+/** Diz se o cliente quer manter a conexao aberta depois da resposta.
+ *
+ *  Em HTTP/1.1 a conexao fica aberta, a nao ser que venha um
+ *  "Connection: close". Em HTTP/1.0 so se vier "Connection: keep-alive".
+ *
+ *  @return 1 se a conexao deve ficar aberta, 0 caso contrario.
+ */
+int http_wants_keepalive(struct c_handler* h)
+{
+  struct http_span* value = http_parser_header(&(h->buf->parser), h->buf->request, "Connection");
+  char* connection;
+
+  if (value == NULL)
+    return (h->buf->parser.version == HTTP_1_1);
+
+  connection = h->buf->request + value->begin;
+
+  if ((value->size >= 5) && (strncasecmp(connection, "close", 5) == 0))
+    return 0;
+  if ((value->size >= 10) && (strncasecmp(connection, "keep-alive", 10) == 0))
+    return 1;
+
+  return (h->buf->parser.version == HTTP_1_1);
+}
+
+
+/** Diz se o fim do header HTTP ("\r\n\r\n") ja esta em 'where'.
+ *
+ *  @return 1 se estiver, 0 se nao estiver e -1 caso 'where' seja NULL.
+ */
+int find_crlf(char* where)
+{
+  if (where == NULL)
+    return -1;
+  if (strstr(where, "\r\n\r\n") == NULL)
+    return 0;
+  else
+    return 1;
+}
+
+
 /** Atribui ao 'buf' a resposta em HTML para o erro 'status'
  *  (respeitando 'bufsize');
  */
@@ -77,26 +154,38 @@ int build_error_html(char* buf, size_t bufsize, int status, char* status_msg)
  */
 int http_what_method(char *method, size_t size)
 {
-  if (size < 3)
-    return UNKNOWN_M;
-
-  if (strncmp(method, "GET", 3) == 0)
-    return GET_M;
-  if (strncmp(method, "PUT", 3) == 0)
-    return PUT_M;
-  if (strncmp(method, "HEAD", 4) == 0)
-    return HEAD_M;
-  if (strncmp(method, "POST", 4) == 0)
-    return POST_M;
-  if (strncmp(method, "TRACE", 5) == 0)
-    return TRACE_M;
-  if (strncmp(method, "DELETE", 6) == 0)
-    return DELETE_M;
-  if (strncmp(method, "OPTIONS", 7) == 0)
-    return OPTIONS_M;
-  if (strncmp(method, "CONNECT", 7) == 0)
-    return CONNECT_M;
+  switch (size)
+  {
+  case 3:
+    if (strncmp(method, "GET", 3) == 0)
+      return GET_M;
+    if (strncmp(method, "PUT", 3) == 0)
+      return PUT_M;
+    break;
+  case 4:
+    if (strncmp(method, "HEAD", 4) == 0)
+      return HEAD_M;
+    if (strncmp(method, "POST", 4) == 0)
+      return POST_M;
+    break;
+  case 5:
+    if (strncmp(method, "TRACE", 5) == 0)
+      return TRACE_M;
+    break;
+  case 6:
+    if (strncmp(method, "DELETE", 6) == 0)
+      return DELETE_M;
+    break;
+  case 7:
+    if (strncmp(method, "OPTIONS", 7) == 0)
+      return OPTIONS_M;
+    if (strncmp(method, "CONNECT", 7) == 0)
+      return CONNECT_M;
+    break;
 
+  default:
+    break;
+  }
   return UNKNOWN_M;
 }
 
@@ -106,9 +195,9 @@ int http_what_version(char *string, size_t size)
   switch(size)
   {
   case 8:
-    if (strcmp(string, "HTTP/1.0") == 0)
+    if (strncmp(string, "HTTP/1.0", 8) == 0)
       return HTTP_1_0;
-    if (strcmp(string, "HTTP/1.1") == 0)
+    if (strncmp(string, "HTTP/1.1", 8) == 0)
       return HTTP_1_1;
     break;
 
@@ -152,6 +241,9 @@ int http_get_status_msg(int status, char* buff, size_t buffsize)
   case SERVER_ERROR_S:
     msg = "Server Error";
     break;
+  case NOT_IMPLEMENTED_S:
+    msg = "Not Implemented";
+    break;
 
   default:
     msg = "Unknown";
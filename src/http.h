@@ -32,7 +32,8 @@ enum status_codes
   NOT_FOUND_S             = 404,
   REQUEST_URI_TOO_LARGE_S = 414,
 
-  SERVER_ERROR_S = 500
+  SERVER_ERROR_S    = 500,
+  NOT_IMPLEMENTED_S = 501
 };
 
 /** Valores para os metodos HTTP. Possuem posfixo '_M'.
@@ -60,6 +61,8 @@ enum http_versions
 };
 
 
+int http_build_head(char* buf, size_t bufsize, int status, char* statusmsg, char* type, int length);
+const char* http_connection_line(int keep_alive);
 int http_build_header(struct c_handler* h);
 int build_error_html(char* buf, size_t bufsize, int status, char* status_msg);
 int http_get_file_type(char* file, size_t filesize, char *buff, size_t buffsize);
@@ -68,6 +71,8 @@ int http_status_is_error(int status);
 int http_get_status_msg(int status, char* buff, size_t buffsize);
 int http_what_method(char *method, size_t size);
 int http_what_version(char *string, size_t);
+int find_crlf(char* where);
+int http_wants_keepalive(struct c_handler* h);
 
 
 #endif /* HTTP_H_DEFINED */
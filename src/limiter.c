@@ -0,0 +1,482 @@
+/**
+ * @file limiter.c
+ *
+ * Implementacao do limite de banda agregado.
+ *
+ * Cada classe tem um balde de fichas que enche com a sua parte de
+ * #limiter.rate. A cada LIMITER_SHARE_MS a procura de cada classe e
+ * medida pelo uso: uma classe que nao esperou pelo balde recebe so o
+ * que usou (com folga), e o que sobra e dividido pelo peso entre as
+ * que esperaram. Uma classe que comeca a enviar entra querendo tudo
+ * ate a proxima medida.
+ *
+ * Nenhum envio passa pelo lock do limiter. Cada worker tira do balde
+ * da classe uma fatia inteira de uma vez (o 'adiantamento', sob o lock
+ * da propria classe) e vai gastando dela sem lock nenhum; o balde so e
+ * visitado de novo quando o adiantamento acaba. Um worker que passou
+ * uma medida inteira sem enviar nada numa classe tem o adiantamento
+ * devolvido ao balde dela, para os outros usarem.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>     /* atoi()                                    */
+#include <string.h>     /* strncmp() strchr()                        */
+#include <arpa/inet.h>  /* inet_pton() ntohl()                       */
+
+#include "limiter.h"
+
+
+/** O adiantamento de um worker numa classe. */
+struct limiter_lease
+{
+  uint64_t bytes;   /**< Ja tirados do balde da classe e ainda nao enviados - atomico, ja
+                      *  que limiter_measure() pode devolve-los de outra thread */
+  uint64_t used;    /**< Enviados desde a ultima medida - atomico */
+  uint64_t slice;   /**< A fatia da classe da ultima vez que o balde foi visitado */
+};
+
+/** Os adiantamentos de um worker, na ordem de #limiter.classes. */
+struct limiter_worker
+{
+  struct limiter_lease leases[LIMITER_MAX_CLASSES];
+  struct limiter_worker* next;  /**< Proximo em #limiter.workers */
+  int joined;                   /**< Ja esta em #limiter.workers */
+};
+
+/** Os adiantamentos desse worker - as threads dos workers vivem ate o
+ *  fim do servidor, entao #limiter.workers pode apontar para ca */
+static __thread struct limiter_worker limiter_self;
+
+
+/** O adiantamento desse worker na classe 'c'. Na primeira vez, coloca
+ *  o worker em #l->workers.
+ */
+static struct limiter_lease* limiter_lease(struct limiter* l, struct traffic_class* c)
+{
+  if (!limiter_self.joined)
+  {
+    pthread_mutex_lock(&(l->lock));
+    limiter_self.next   = l->workers;
+    limiter_self.joined = 1;
+    l->workers = &limiter_self;
+    pthread_mutex_unlock(&(l->lock));
+  }
+  return &(limiter_self.leases[c - l->classes]);
+}
+
+
+/** Devolve ao balde de 'c' (a classe 'index' de 'l') o adiantamento dos
+ *  workers que nao enviaram nada nela desde a ultima medida.
+ *
+ *  @note Chamar com #l->lock e #c->lock travados.
+ */
+static void limiter_reclaim(struct limiter* l, struct traffic_class* c, int index)
+{
+  struct limiter_worker* w;
+  uint64_t back;
+
+  for (w = l->workers; w != NULL; w = w->next)
+  {
+    struct limiter_lease* lease = &(w->leases[index]);
+
+    if (__atomic_exchange_n(&(lease->used), 0, __ATOMIC_RELAXED) != 0)
+      continue;
+
+    back = __atomic_exchange_n(&(lease->bytes), 0, __ATOMIC_RELAXED);
+    if (back == 0)
+      continue;
+
+    bucket_refund(&(c->bucket), back);
+    c->used -= (back < c->used) ? back : c->used;
+  }
+}
+
+
+/** Mede a procura de cada classe pelo uso desde a ultima medida.
+ *
+ *  A procura de uma classe que esperou pelo balde e ilimitada; a das
+ *  outras e o que usaram mais 1/4, mais 1% do total (para poderem
+ *  crescer ate a proxima medida). Adiantamentos parados voltam para o
+ *  balde antes, e nao contam como uso.
+ *
+ *  @note Chamar com #l->lock travado.
+ */
+static void limiter_measure(struct limiter* l, uint64_t now)
+{
+  uint64_t elapsed = (now > l->shared) ? (now - l->shared) : 1;
+  int i;
+
+  for (i = 0; i < l->nclasses; i++)
+  {
+    struct traffic_class* c = &(l->classes[i]);
+
+    pthread_mutex_lock(&(c->lock));
+    limiter_reclaim(l, c, i);
+    if (c->starved)
+      c->demand = UINT64_MAX;
+    else
+    {
+      c->demand  = (c->used * 1000) / elapsed;
+      c->demand += (c->demand / 4) + (l->rate / 100);
+    }
+    c->used    = 0;
+    c->starved = 0;
+    pthread_mutex_unlock(&(c->lock));
+  }
+
+  __atomic_store_n(&(l->shared), now, __ATOMIC_RELAXED);
+}
+
+
+/** Recalcula a parte de cada classe ativa pela procura medida.
+ *
+ *  Quem procura menos que a sua parte pelo peso recebe so a procura, e
+ *  a sobra e redividida entre as outras, ate ninguem mais ficar abaixo
+ *  (a divisao justa 'max-min' ponderada). O que restar no fim vai para
+ *  todas as ativas, pelo peso.
+ *
+ *  @note Chamar com #l->lock travado.
+ */
+static void limiter_share(struct limiter* l, uint64_t now)
+{
+  uint64_t share[LIMITER_MAX_CLASSES];
+  int      open[LIMITER_MAX_CLASSES];
+  uint64_t remaining = l->rate;
+  uint64_t weights;
+  uint64_t given;
+  int changed;
+  int i;
+
+  for (i = 0; i < l->nclasses; i++)
+  {
+    share[i] = 0;
+    open[i]  = (l->classes[i].active > 0);
+  }
+
+  // Quem procura menos que a parte pelo peso sai da divisao
+  do
+  {
+    weights = 0;
+    for (i = 0; i < l->nclasses; i++)
+      if (open[i])
+        weights += l->classes[i].weight;
+
+    given   = 0;
+    changed = 0;
+    for (i = 0; (i < l->nclasses) && (weights > 0); i++)
+      if (open[i] && (l->classes[i].demand <= (remaining * l->classes[i].weight) / weights))
+      {
+        share[i] = l->classes[i].demand;
+        given   += share[i];
+        open[i]  = 0;
+        changed  = 1;
+      }
+    remaining -= given;
+  } while (changed);
+
+  // O resto vai para quem ainda quer mais - ou, se todos ja tem o que
+  // querem, para todas as ativas
+  if (weights == 0)
+    for (i = 0; i < l->nclasses; i++)
+      if (l->classes[i].active > 0)
+      {
+        open[i]  = 1;
+        weights += l->classes[i].weight;
+      }
+
+  for (i = 0; i < l->nclasses; i++)
+  {
+    struct traffic_class* c = &(l->classes[i]);
+
+    if (open[i])
+      share[i] += (remaining * c->weight) / weights;
+
+    pthread_mutex_lock(&(c->lock));
+    bucket_set_rate(&(c->bucket), share[i], now);
+    pthread_mutex_unlock(&(c->lock));
+  }
+}
+
+
+/** Prepara o lock e o balde (ainda sem banda) da classe 'c', que ja
+ *  foi preenchida.
+ *
+ *  @return 0 em sucesso, -1 em caso de erro.
+ */
+static int limiter_class_init(struct traffic_class* c, uint64_t now)
+{
+  if (pthread_mutex_init(&(c->lock), NULL) != 0)
+    return -1;
+
+  bucket_init(&(c->bucket), 0, 0, now);
+  return 0;
+}
+
+
+/** Inicializa 'l' com o limite total 'rate' (Bytes/s) e apenas a
+ *  classe 'default', com peso 1.
+ *
+ *  @return 0 em sucesso, -1 em caso de erro.
+ */
+int limiter_init(struct limiter* l, uint64_t rate, uint64_t now)
+{
+  if ((l == NULL) || (rate == 0))
+    return -1;
+
+  memset(l, 0, sizeof(struct limiter));
+
+  if (pthread_mutex_init(&(l->lock), NULL) != 0)
+    return -1;
+
+  l->rate     = rate;
+  l->shared   = now;
+  l->nclasses = 1;
+
+  l->classes[0].type   = CLASS_DEFAULT;
+  l->classes[0].weight = 1;
+  if (limiter_class_init(&(l->classes[0]), now) == -1)
+  {
+    pthread_mutex_destroy(&(l->lock));
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/** Adiciona uma classe descrita por 'spec', no formato "MATCH,PESO":
+ *
+ *  - "/downloads/,40"  - caminhos que comecam com /downloads/
+ *  - "10.0.0.0/8,20"   - clientes dessa sub-rede (IPv4)
+ *  - "default,60"      - muda o peso de quem nao casa com nenhuma
+ *
+ *  As classes sao testadas na ordem em que foram adicionadas.
+ *
+ *  @return 0 em sucesso, -1 se 'spec' for invalida ou nao houver
+ *          mais espaco para classes.
+ */
+int limiter_add_class(struct limiter* l, const char* spec, uint64_t now)
+{
+  struct traffic_class* c;
+  struct in_addr addr;
+  char match[LIMITER_PREFIX_SIZE];
+  const char* comma = strrchr(spec, ',');
+  int  weight;
+  int  size;
+
+  if (comma == NULL)
+    return -1;
+
+  size = comma - spec;
+  if ((size == 0) || (size >= LIMITER_PREFIX_SIZE))
+    return -1;
+
+  memcpy(match, spec, size);
+  match[size] = '\0';
+
+  weight = atoi(comma + 1);
+  if (weight < 1)
+    return -1;
+
+  if (strcmp(match, "default") == 0)
+  {
+    l->classes[0].weight = weight;
+    return 0;
+  }
+
+  if (l->nclasses == LIMITER_MAX_CLASSES)
+    return -1;
+
+  c = &(l->classes[l->nclasses]);
+  memset(c, 0, sizeof(struct traffic_class));
+  c->weight = weight;
+
+  if (match[0] == '/')
+  {
+    c->type = CLASS_PREFIX;
+    strcpy(c->prefix, match);
+    c->prefix_size = size;
+  }
+  else
+  {
+    char* slash = strchr(match, '/');
+    int   bits  = 32;
+
+    if (slash != NULL)
+    {
+      *slash = '\0';
+      bits = atoi(slash + 1);
+      if ((bits < 0) || (bits > 32))
+        return -1;
+    }
+
+    if (inet_pton(AF_INET, match, &addr) != 1)
+      return -1;
+
+    c->type = CLASS_SUBNET;
+    c->mask = (bits == 0) ? 0 : (0xFFFFFFFFu << (32 - bits));
+    c->net  = ntohl(addr.s_addr) & c->mask;
+  }
+
+  if (limiter_class_init(c, now) == -1)
+    return -1;
+
+  l->nclasses++;
+  return 0;
+}
+
+
+void limiter_exit(struct limiter* l)
+{
+  int i;
+
+  for (i = 0; i < l->nclasses; i++)
+    pthread_mutex_destroy(&(l->classes[i].lock));
+  pthread_mutex_destroy(&(l->lock));
+}
+
+
+/** Descobre a classe de quem pediu 'path', vindo de 'addr'.
+ *
+ *  'path' e relativo ao diretorio raiz ('/downloads/a.iso'). Qualquer
+ *  um dos dois pode ser NULL.
+ *
+ *  @return A primeira classe que casar, ou a 'default'.
+ */
+struct traffic_class* limiter_classify(struct limiter* l, const char* path, const struct sockaddr_in* addr)
+{
+  int i;
+
+  for (i = 1; i < l->nclasses; i++)
+  {
+    struct traffic_class* c = &(l->classes[i]);
+
+    if ((c->type == CLASS_PREFIX) && (path != NULL) &&
+        (strncmp(path, c->prefix, c->prefix_size) == 0))
+      return c;
+
+    if ((c->type == CLASS_SUBNET) && (addr != NULL) &&
+        ((ntohl(addr->sin_addr.s_addr) & c->mask) == c->net))
+      return c;
+  }
+  return &(l->classes[0]);
+}
+
+
+/** Um cliente da classe 'c' comecou a enviar. */
+void limiter_join(struct limiter* l, struct traffic_class* c, uint64_t now)
+{
+  pthread_mutex_lock(&(l->lock));
+
+  c->active++;
+  if (c->active == 1)
+  {
+    // Ainda nao ha uso para medir - comeca querendo tudo
+    c->demand = UINT64_MAX;
+    limiter_share(l, now);
+  }
+
+  pthread_mutex_unlock(&(l->lock));
+}
+
+
+/** Um cliente da classe 'c' terminou (ou desistiu) de enviar. */
+void limiter_leave(struct limiter* l, struct traffic_class* c, uint64_t now)
+{
+  pthread_mutex_lock(&(l->lock));
+
+  c->active--;
+  if (c->active == 0)
+    limiter_share(l, now);
+
+  pthread_mutex_unlock(&(l->lock));
+}
+
+
+/** Quanto a classe 'c' pode enviar agora, se tiver pelo menos 'bytes'
+ *  (ou uma fatia da classe, se for menos).
+ *
+ *  Sai do adiantamento desse worker, sem lock. So quando ele nao basta
+ *  o balde da classe e travado, e uma fatia inteira vem de uma vez. De
+ *  LIMITER_SHARE_MS em LIMITER_SHARE_MS, quem passar por aqui tambem
+ *  recalcula as partes (se ninguem ja estiver recalculando).
+ *
+ *  @return O adiantamento, ou 0 se for menos que 'bytes' - nesse caso
+ *          'wait_ms' diz quando deve haver o suficiente no balde.
+ */
+uint64_t limiter_request(struct limiter* l, struct traffic_class* c, uint64_t bytes, uint64_t now, uint64_t* wait_ms)
+{
+  struct limiter_lease* lease = limiter_lease(l, c);
+  uint64_t have = __atomic_load_n(&(lease->bytes), __ATOMIC_RELAXED);
+  uint64_t take;
+
+  if ((have > 0) && (have >= ((bytes < lease->slice) ? bytes : lease->slice)))
+    return have;
+
+  pthread_mutex_lock(&(c->lock));
+
+  bucket_refill(&(c->bucket), now);
+
+  lease->slice = bucket_slice(&(c->bucket));
+  if (bytes > lease->slice)
+    bytes = lease->slice;
+
+  take = bucket_available(&(c->bucket));
+  if (take > lease->slice)
+    take = lease->slice;
+
+  bucket_consume(&(c->bucket), take);
+  c->used += take;
+  have = __atomic_add_fetch(&(lease->bytes), take, __ATOMIC_RELAXED);
+
+  if (have < bytes)
+  {
+    c->starved = 1;
+    *wait_ms   = bucket_wait_ms(&(c->bucket), bytes - have);
+  }
+
+  pthread_mutex_unlock(&(c->lock));
+
+  if ((now >= (__atomic_load_n(&(l->shared), __ATOMIC_RELAXED) + LIMITER_SHARE_MS)) &&
+      (pthread_mutex_trylock(&(l->lock)) == 0))
+  {
+    if (now >= (l->shared + LIMITER_SHARE_MS))
+    {
+      limiter_measure(l, now);
+      limiter_share(l, now);
+    }
+    pthread_mutex_unlock(&(l->lock));
+  }
+
+  have = __atomic_load_n(&(lease->bytes), __ATOMIC_RELAXED);
+  return (have >= bytes) ? have : 0;
+}
+
+
+/** Gasta 'bytes' do adiantamento da classe 'c'. O que passar dele
+ *  (nao deveria - a nao ser que limiter_measure() o tenha devolvido
+ *  nesse meio tempo) vira divida no balde.
+ */
+void limiter_consume(struct limiter* l, struct traffic_class* c, uint64_t bytes)
+{
+  struct limiter_lease* lease = limiter_lease(l, c);
+  uint64_t have = __atomic_load_n(&(lease->bytes), __ATOMIC_RELAXED);
+  uint64_t take;
+
+  __atomic_add_fetch(&(lease->used), bytes, __ATOMIC_RELAXED);
+
+  do
+  {
+    take = (bytes < have) ? bytes : have;
+  } while (!__atomic_compare_exchange_n(&(lease->bytes), &have, have - take, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  bytes -= take;
+  if (bytes == 0)
+    return;
+
+  pthread_mutex_lock(&(c->lock));
+  bucket_consume(&(c->bucket), bytes);
+  c->used += bytes;
+  pthread_mutex_unlock(&(c->lock));
+}
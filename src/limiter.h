@@ -0,0 +1,89 @@
+/**
+ * @file limiter.h
+ *
+ * Definicao do limite de banda agregado - do servidor inteiro e de
+ * cada classe de trafego.
+ *
+ * O limite por cliente (#c_handler.bucket) continua valendo; por cima
+ * dele, a soma de todos os clientes (de todos os workers) nao passa de
+ * #limiter.rate. Essa banda e dividida entre as classes de acordo com
+ * o peso de cada uma - mas so ate o que cada classe de fato consegue
+ * usar. Uma classe parada, ou segurada abaixo da sua parte pelo limite
+ * de cada cliente, 'empresta' a sobra para as outras.
+ *
+ * Uma classe casa pelo comeco do caminho pedido ('/downloads/') ou
+ * pela sub-rede do cliente ('10.0.0.0/8'). Quem nao casa com nenhuma
+ * fica na classe 'default'.
+ */
+
+#ifndef LIMITER_H_DEFINED
+#define LIMITER_H_DEFINED
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h> /* struct sockaddr_in                        */
+
+#include "bucket.h"
+
+
+/** Maximo de classes, contando a 'default' */
+#define LIMITER_MAX_CLASSES  16
+
+/** Maior prefixo de caminho aceito por uma classe */
+#define LIMITER_PREFIX_SIZE  128
+
+/** De quantos em quantos ms as partes sao recalculadas pelo uso */
+#define LIMITER_SHARE_MS     100
+
+
+/** Como uma classe escolhe seus clientes. Possuem prefixo 'CLASS_'.
+ */
+enum class_types
+{
+  CLASS_DEFAULT,  /**< Quem nao casou com nenhuma outra */
+  CLASS_PREFIX,   /**< Caminho pedido comeca com #traffic_class.prefix */
+  CLASS_SUBNET    /**< Endereco do cliente esta em #traffic_class.net */
+};
+
+struct traffic_class
+{
+  int      type;                         /**< Veja #class_types */
+  char     prefix[LIMITER_PREFIX_SIZE];  /**< Para CLASS_PREFIX */
+  int      prefix_size;
+  uint32_t net;                          /**< Para CLASS_SUBNET - ja com a mascara aplicada */
+  uint32_t mask;
+  int      weight;                       /**< Peso na divisao de #limiter.rate */
+  int      active;                       /**< Quantos clientes dessa classe estao enviando agora - sob #limiter.lock */
+  uint64_t demand;                       /**< Procura medida, em Bytes/s - sob #limiter.lock */
+
+  pthread_mutex_t lock;                  /**< Protege o que vem abaixo */
+  struct token_bucket bucket;            /**< Enche com a parte atual da classe */
+  uint64_t used;                         /**< Bytes tirados do balde desde o ultimo calculo das partes */
+  int      starved;                      /**< Alguem esperou pelo balde desde o ultimo calculo */
+};
+
+struct limiter_worker;
+
+struct limiter
+{
+  pthread_mutex_t lock;   /**< Protege #traffic_class.active, #workers e o calculo das partes */
+  uint64_t rate;          /**< Limite do servidor inteiro, em Bytes/s */
+  uint64_t shared;        /**< Ultimo calculo das partes, em ms */
+  int nclasses;           /**< #classes[0] e sempre a 'default' */
+  struct traffic_class classes[LIMITER_MAX_CLASSES];
+  struct limiter_worker* workers; /**< Os adiantamentos de cada worker que ja enviou (limiter.c) */
+};
+
+
+int  limiter_init(struct limiter* l, uint64_t rate, uint64_t now);
+int  limiter_add_class(struct limiter* l, const char* spec, uint64_t now);
+void limiter_exit(struct limiter* l);
+
+struct traffic_class* limiter_classify(struct limiter* l, const char* path, const struct sockaddr_in* addr);
+void     limiter_join(struct limiter* l, struct traffic_class* c, uint64_t now);
+void     limiter_leave(struct limiter* l, struct traffic_class* c, uint64_t now);
+uint64_t limiter_request(struct limiter* l, struct traffic_class* c, uint64_t bytes, uint64_t now, uint64_t* wait_ms);
+void     limiter_consume(struct limiter* l, struct traffic_class* c, uint64_t bytes);
+
+
+#endif /* LIMITER_H_DEFINED */
@@ -0,0 +1,317 @@
+/**
+ * @file log.c
+ *
+ * Implementacao do log assincrono.
+ *
+ * O anel e uma fila limitada de varios escritores e um leitor: cada
+ * registro tem uma 'volta' (#log_record.turn) que diz se ele esta livre
+ * para a volta atual do anel ou se ja foi preenchido. Quem escreve pega
+ * uma posicao com um compare-and-swap em #log_head, formata direto no
+ * registro e so entao marca ele como cheio. Quem le so aceita registros
+ * marcados, na ordem - entao nunca ve uma mensagem pela metade.
+ *
+ * Antes de log_start() cada mensagem e escrita na hora, e no exit() o
+ * que sobrou no anel e escrito por log_flush() - nada se perde.
+ */
+
+#include <stdio.h>      /* vsnprintf()                               */
+#include <stdarg.h>     /* va_list                                   */
+#include <stdlib.h>     /* atexit() atoi()                           */
+#include <string.h>     /* strerror_r() strcmp() memcpy()            */
+#include <errno.h>      /* errno EINTR                               */
+#include <ctype.h>      /* isdigit()                                 */
+#include <unistd.h>     /* write() STDOUT_FILENO                     */
+#include <time.h>       /* nanosleep()                               */
+#include <pthread.h>    /* pthread_create() pthread_mutex_lock()     */
+
+#include "log.h"
+#include "timer.h"
+
+
+/** Tamanho do buffer de saida de cada fd - um write() quando enche */
+#define LOG_OUT_SIZE  65536
+
+
+/** Um registro do anel. */
+struct log_record
+{
+  uint64_t turn;             /**< 2 * volta: livre nessa volta; + 1: preenchido */
+  int      level;
+  int      size;             /**< Tamanho de #msg, sem o '\0' */
+  char     msg[LOG_MSG_SIZE];
+};
+
+/** O que vai ser escrito num fd. */
+struct log_output
+{
+  int  fd;
+  int  size;
+  char buf[LOG_OUT_SIZE];
+};
+
+
+int log_level = LOG_LEVEL_INFO;
+
+static struct log_record log_ring[LOG_RING_SIZE];
+
+/** Proxima posicao a ser preenchida - dividida por todos que escrevem */
+static uint64_t log_head __attribute__((aligned(64))) = 0;
+
+/** Mensagens descartadas porque o anel estava cheio */
+static uint64_t log_drops __attribute__((aligned(64))) = 0;
+
+/** So quem tem esse lock le do anel (a thread de escrita ou um log_flush()) */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t log_tail = 0;          /**< Proxima posicao a ser lida */
+static uint64_t log_drops_seen = 0;    /**< #log_drops ja avisados */
+static struct log_output log_out = { STDOUT_FILENO, 0, { 0 } };
+static struct log_output log_err = { STDERR_FILENO, 0, { 0 } };
+
+/** A thread de escrita esta rodando */
+static int log_running = 0;
+
+
+/** Escreve tudo que esta em 'out', mesmo que precise de varios write(). */
+static void log_output_flush(struct log_output* out)
+{
+  int done = 0;
+  ssize_t n;
+
+  while (done < out->size)
+  {
+    n = write(out->fd, out->buf + done, out->size - done);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;   // Sem ter onde escrever, nao ha o que fazer
+    }
+    done += n;
+  }
+  out->size = 0;
+}
+
+
+/** Junta 'size' bytes de 'msg' e uma quebra de linha em 'out'. */
+static void log_output_add(struct log_output* out, const char* msg, int size)
+{
+  if ((out->size + size + 1) > LOG_OUT_SIZE)
+    log_output_flush(out);
+
+  memcpy(out->buf + out->size, msg, size);
+  out->size += size;
+  out->buf[out->size++] = '\n';
+}
+
+
+/** Tira do anel tudo que ja esta preenchido e escreve.
+ *
+ *  @note Chamar com #log_lock.
+ *  @return Quantas mensagens sairam.
+ */
+static int log_drain(void)
+{
+  struct log_record* r;
+  struct log_output* out;
+  uint64_t turn;
+  uint64_t drops;
+  char msg[LOG_MSG_SIZE];
+  int count = 0;
+  int size;
+
+  while (1)
+  {
+    r    = &(log_ring[log_tail & (LOG_RING_SIZE - 1)]);
+    turn = 2 * (log_tail / LOG_RING_SIZE);
+
+    if (__atomic_load_n(&(r->turn), __ATOMIC_ACQUIRE) != (turn + 1))
+      break;
+
+    out = (r->level <= LOG_LEVEL_WARN) ? &log_err : &log_out;
+    log_output_add(out, r->msg, r->size);
+
+    __atomic_store_n(&(r->turn), turn + 2, __ATOMIC_RELEASE);
+    log_tail++;
+    count++;
+  }
+
+  drops = __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+  if (drops != log_drops_seen)
+  {
+    size = snprintf(msg, sizeof(msg), "*** %llu mensagens de log descartadas (anel cheio) ***",
+                    (unsigned long long)(drops - log_drops_seen));
+    log_output_add(&log_err, msg, size);
+    log_drops_seen = drops;
+  }
+
+  log_output_flush(&log_out);
+  log_output_flush(&log_err);
+  return count;
+}
+
+
+/** Escreve agora tudo que esta no anel. Pode ser chamada de qualquer
+ *  thread - e chamada sozinha no exit().
+ */
+void log_flush(void)
+{
+  pthread_mutex_lock(&log_lock);
+  log_drain();
+  pthread_mutex_unlock(&log_lock);
+}
+
+
+/** A thread de escrita: esvazia o anel e, se ele estava vazio, dorme
+ *  #LOG_FLUSH_MS antes de olhar de novo.
+ */
+static void* log_loop(void* arg)
+{
+  struct timespec nap = { 0, LOG_FLUSH_MS * TIMER_NS_PER_MS };
+  int count;
+
+  (void)arg;
+  while (1)
+  {
+    pthread_mutex_lock(&log_lock);
+    count = log_drain();
+    pthread_mutex_unlock(&log_lock);
+
+    if (count == 0)
+      nanosleep(&nap, NULL);
+  }
+  return NULL;
+}
+
+
+/** Cria a thread de escrita. Daqui em diante log_write() nao escreve
+ *  mais nada na hora.
+ *
+ *  @return 0 em sucesso, -1 em erro (e o log continua sincrono).
+ */
+int log_start(void)
+{
+  pthread_t thread;
+
+  if (log_running)
+    return 0;
+
+  atexit(log_flush);
+
+  if (pthread_create(&thread, NULL, log_loop, NULL) != 0)
+    return -1;
+
+  pthread_detach(thread);
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+/** Traduz o nome de um nivel ('error', 'warn', 'info', 'debug' ou o
+ *  numero dele).
+ *
+ *  @return O nivel, ou -1 se 'name' nao for nenhum.
+ */
+int log_parse_level(const char* name)
+{
+  static const char* names[] = { "error", "warn", "info", "debug" };
+  int i;
+
+  for (i = 0; i <= LOG_LEVEL_DEBUG; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+
+  if ((isdigit((unsigned char)name[0])) && (name[1] == '\0') && (atoi(name) <= LOG_LEVEL_DEBUG))
+    return atoi(name);
+
+  return -1;
+}
+
+
+/** Quantas mensagens ja foram descartadas por falta de lugar no anel. */
+uint64_t log_dropped(void)
+{
+  return __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+}
+
+
+/** Guarda a mensagem 'format' (como no printf()) de nivel 'level' no
+ *  anel. A quebra de linha do fim e colocada aqui.
+ *
+ *  Nunca bloqueia: se o anel esta cheio, a mensagem e descartada.
+ *  Nao muda 'errno'.
+ */
+void log_write(int level, const char* format, ...)
+{
+  struct log_record* r;
+  uint64_t pos;
+  uint64_t turn;
+  uint64_t seen;
+  va_list args;
+  int saved = errno;
+  int size;
+
+  if (level > log_level)
+    return;
+
+  // Pega uma posicao livre
+  pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  while (1)
+  {
+    r    = &(log_ring[pos & (LOG_RING_SIZE - 1)]);
+    turn = 2 * (pos / LOG_RING_SIZE);
+    seen = __atomic_load_n(&(r->turn), __ATOMIC_ACQUIRE);
+
+    if (seen == turn)
+    {
+      if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (seen < turn)
+    {
+      // Ainda nao foi lido da volta passada: anel cheio
+      __atomic_fetch_add(&log_drops, 1, __ATOMIC_RELAXED);
+      errno = saved;
+      return;
+    }
+    else
+      pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  }
+
+  va_start(args, format);
+  size = vsnprintf(r->msg, LOG_MSG_SIZE, format, args);
+  va_end(args);
+
+  if (size < 0)
+    size = 0;
+  if (size >= LOG_MSG_SIZE)
+    size = LOG_MSG_SIZE - 1;
+  while ((size > 0) && (r->msg[size - 1] == '\n'))
+    size--;
+
+  r->level = level;
+  r->size  = size;
+  __atomic_store_n(&(r->turn), turn + 1, __ATOMIC_RELEASE);
+
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+    log_flush();
+
+  errno = saved;
+}
+
+
+/** Como perror(), mas pelo anel: 'msg', ': ' e a descricao de 'errno'. */
+void log_perror(const char* msg)
+{
+  char error[128];
+  int saved = errno;
+
+  if (LOG_LEVEL_ERROR > log_level)
+    return;
+
+  if (strerror_r(saved, error, sizeof(error)) != 0)
+    snprintf(error, sizeof(error), "Erro %d", saved);
+
+  log_write(LOG_LEVEL_ERROR, "%s: %s", msg, error);
+  errno = saved;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file log.h
+ *
+ * Definicao do log assincrono.
+ *
+ * Quem loga (os workers, no meio do loop) so formata a mensagem num anel
+ * de registros de tamanho fixo, sem lock e sem syscall. Uma thread
+ * separada esvazia o anel de tempos em tempos e manda tudo para stdout
+ * (ou stderr, nos erros) com um write() por lote. Se o anel encher, a
+ * mensagem e descartada e contada - o loop nunca espera pelo disco.
+ *
+ * Cada mensagem tem um nivel. Os acima de LOG_LEVEL_MAX nem sao
+ * compilados (veja macros.h); os acima de #log_level, escolhido com
+ * --log-level, custam so uma comparacao.
+ */
+
+#ifndef LOG_H_DEFINED
+#define LOG_H_DEFINED
+
+#include <stdint.h>
+
+
+/** Niveis das mensagens, do mais grave ao mais falador. */
+enum log_levels
+{
+  LOG_LEVEL_ERROR,  /**< Vai para stderr */
+  LOG_LEVEL_WARN,   /**< Vai para stderr */
+  LOG_LEVEL_INFO,   /**< Inicializacao e eventos raros - o padrao */
+  LOG_LEVEL_DEBUG   /**< Uma ou mais linhas por request */
+};
+
+/** O nivel mais falador que chega a ser compilado - mude com
+ *  'make LOG_LEVEL_MAX=2', por exemplo.
+ */
+#ifndef LOG_LEVEL_MAX
+  #define LOG_LEVEL_MAX  LOG_LEVEL_DEBUG
+#endif
+
+/** Registros no anel - potencia de 2 */
+#define LOG_RING_SIZE  4096
+
+/** Maior mensagem guardada num registro (o resto e cortado) */
+#define LOG_MSG_SIZE   240
+
+/** Milissegundos que a thread de escrita dorme quando o anel esta vazio */
+#define LOG_FLUSH_MS   20
+
+
+extern int log_level;
+
+int  log_start(void);
+void log_flush(void);
+int  log_parse_level(const char* name);
+uint64_t log_dropped(void);
+
+void log_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void log_perror(const char* msg);
+
+
+#endif /* LOG_H_DEFINED */
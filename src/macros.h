@@ -1,40 +1,38 @@
 /** @file macros.h
  *  Macros para tornar mais facil escrever dados nos logs.
  *
- * Log normal:   stdout
- * Log de errro: stderr
+ * Todas passam pelo log assincrono (log.h): o loop so formata a mensagem
+ * num anel e uma thread separada escreve.
  *
+ * Log normal:   stdout (LOG_WRITE, LOG_DEBUG)
+ * Log de errro: stderr (LOG_ERROR, LOG_PERROR, LOG_WARN)
+ *
+ * Todas aceitam um formato e argumentos, como o printf(). Niveis acima
+ * de LOG_LEVEL_MAX somem na compilacao.
  */
 
+#ifndef MACROS_H_DEFINED
+#define MACROS_H_DEFINED
+
+#include "log.h"
+
 
-#define WILL_WRITE_TO_LOG              1
+#define LOG_AT(level, ...)             do                                        \
+                                       {                                         \
+                                         if (((level) <= LOG_LEVEL_MAX) &&       \
+                                             ((level) <= log_level))             \
+                                           log_write((level), __VA_ARGS__);      \
+                                       } while (0)
 
-#define LOG_WRITE(a)                   if (WILL_WRITE_TO_LOG == 1)     \
-                                       {                               \
-                                         fprintf(stdout, a);           \
-                                         fprintf(stdout, "\n");        \
-                                         fflush(stdout);               \
-                                       }
+#define LOG_WRITE(...)                 LOG_AT(LOG_LEVEL_INFO,  __VA_ARGS__)
 
-#define LOG_FLUSH                      fflush(stdout);
+#define LOG_DEBUG(...)                 LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
-#define LOG_ERROR(a)                   if (WILL_WRITE_TO_LOG == 1)     \
-                                       {                               \
-                                         fprintf(stderr, a);           \
-                                         fprintf(stdout, "Erro gravado em stderr\n"); \
-                                       }
+#define LOG_WARN(...)                  LOG_AT(LOG_LEVEL_WARN,  __VA_ARGS__)
 
-#define LOG_PERROR(a)                  if (WILL_WRITE_TO_LOG == 1)     \
-                                       {                               \
-                                         perror(a);                    \
-                                         fprintf(stdout, "Erro gravado em stderr\n"); \
-                                       }
+#define LOG_ERROR(...)                 LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
 
+#define LOG_PERROR(a)                  log_perror(a)
 
-#define VERBOSE_MODE                   0
 
-#define VERBOSE(printf_command)        if (VERBOSE_MODE == 1)          \
-                                       {                               \
-                                         printf_command;               \
-                                         fflush(stdout);               \
-                                       }
+#endif /* MACROS_H_DEFINED */
@@ -15,60 +15,429 @@
 #include <sys/stat.h>   /* stat() S_ISDIR()                          */
 #include <limits.h>     /* realpath()                                */
 #include <signal.h>     /* sigaction()                               */
+#include <getopt.h>     /* getopt_long()                             */
 
 #include "client.h"
 #include "server.h"
 #include "http.h"
 #include "macros.h"
 #include "timer.h"
-
-#define MAX_CLIENTS  10
+#include "config.h"
+#include "worker.h"
+#include "scan.h"
+#include "filecache.h"
+#include "metrics.h"
+#include "log.h"
+#include "accesslog.h"
+
+#define MAX_CLIENTS  1024
+#define BACKLOG       511  /**< Conexoes na fila do listener - o kernel limita a somaxconn */
 #define BUFFER_SIZE  256
 
+#define REQUEST_TIMEOUT  30  /**< Segundos para a request inteira chegar */
+#define IDLE_TIMEOUT     60  /**< Segundos que um cliente pode ficar parado */
+#define KEEPALIVE_TIMEOUT 5  /**< Segundos esperando a proxima request (keep-alive) */
+#define MAX_REQUESTS    100  /**< Requests por conexao persistente */
+#define FILE_CACHE      256  /**< Arquivos abertos guardados no cache */
+#define RESPONSE_CACHE  16384 /**< Maior arquivo guardado com a resposta pronta */
+#define STATUS_PATH  "/server-status" /**< Alvo padrao de --status */
+
+/** Opcoes que so existem na forma longa (--opcao). */
+enum long_only_options
+{
+  OPT_REQUEST_TIMEOUT = 256, OPT_IDLE_TIMEOUT, OPT_KEEPALIVE_TIMEOUT, OPT_MAX_REQUESTS,
+  OPT_FILE_CACHE, OPT_RESPONSE_CACHE, OPT_MAX_CLIENTS, OPT_BACKLOG,
+  OPT_STATUS, OPT_LATENCY_DUMP, OPT_LOG_LEVEL, OPT_ACCESS_LOG, OPT_ACCESS_LOG_SIZE,
+  OPT_ACCESS_LOG_KEEP
+};
 
-/** Lida com os argumentos passados pela linha de comando: port 'port number'
- *  e 'root directory'.
+
+/** Mostra como usar o programa.
  */
-int handle_args(int argc, char* argv[])
+void usage()
 {
-  int port;
-  int bandwidth;
+  printf("Usage: servw [options] [port_number] [root_directory] [bandwidth (Bytes/s)]\n"
+         "\n"
+         "Options:\n"
+         "  -e, --engine=ENGINE  I/O engine: 'epoll' (default) or 'uring'\n"
+         "  -z, --sendfile       Send regular files with sendfile() (zero-copy)\n"
+         "  -m, --mmap           Send cached files straight from one mmap() shared\n"
+         "                       by all clients downloading them\n"
+         "  -w, --workers=N      Run N event loops, one thread and listener each\n"
+         "  -p, --pin            Pin each worker thread to its own CPU\n"
+         "  -b, --burst=BYTES    Bytes a client may send at once when it has been\n"
+         "                       idle (default: 100ms worth of bandwidth)\n"
+         "  -k, --kernel-pacing  Let the kernel pace each client (SO_MAX_PACING_RATE);\n"
+         "                       falls back to userspace throttling if refused\n"
+         "  -B, --total-bandwidth=BYTES\n"
+         "                       Cap the whole server at BYTES/s, shared by all clients\n"
+         "  -c, --class=MATCH,WEIGHT\n"
+         "                       Traffic class for --total-bandwidth. MATCH is a path\n"
+         "                       prefix (/downloads/), an IPv4 subnet (10.0.0.0/8) or\n"
+         "                       'default'. Busy classes split the total by WEIGHT;\n"
+         "                       idle ones lend their share. Can be repeated.\n"
+         "      --request-timeout=SECS  Close clients that take longer than this to\n"
+         "                       send the request (default 30, 0 disables)\n"
+         "      --idle-timeout=SECS     Close clients that stall the transfer for\n"
+         "                       this long (default 60, 0 disables)\n"
+         "      --keepalive-timeout=SECS  Keep connections open this long waiting\n"
+         "                       for the next request (default 5, 0 disables keep-alive)\n"
+         "      --max-requests=N Requests served per connection (default 100, 0 unlimited)\n"
+         "      --file-cache=N   Keep up to N open files and their metadata, invalidated\n"
+         "                       by inotify (default 256, 0 disables)\n"
+         "      --response-cache=BYTES  Keep the whole response in memory for cached\n"
+         "                       files up to BYTES (default 16384, 0 disables)\n"
+         "      --max-clients=N  Clients served at once by each worker (default 1024);\n"
+         "                       further connections wait in the listen backlog\n"
+         "      --backlog=N      Connections waiting to be accepted on each listener\n"
+         "                       (default 511, capped by net.core.somaxconn)\n"
+         "      --status[=PATH]  Serve counters and gauges in Prometheus text format\n"
+         "                       at PATH (default /server-status) instead of a file\n"
+         "      --latency-dump=SECS  Print p50/p99/p999 of each request phase every\n"
+         "                       SECS seconds, then start new percentile windows\n"
+         "      --log-level=LEVEL  'error', 'warn', 'info' (default) or 'debug' (one\n"
+         "                       or more lines per request)\n"
+         "      --access-log=PREFIX  Record every response in binary segments named\n"
+         "                       PREFIX.WORKER.SEQ (read them with bin/servw-decode)\n"
+         "      --access-log-size=BYTES  Size of each segment (default 64 MiB)\n"
+         "      --access-log-keep=N  Segments kept per worker (default 16, 0 keeps all)\n"
+         "  -h, --help           Show this message\n");
+}
 
-  if (argc != 4)
+
+/** Lida com os argumentos passados pela linha de comando: port 'port number',
+ *  'root directory' e 'bandwidth', alem das opcoes.
+ *
+ *  Guarda tudo em 'cfg' - menos o diretorio raiz, que e tratado na main().
+ *
+ *  @return O indice de 'root directory' em argv em sucesso, -1 em erro.
+ */
+int handle_args(int argc, char* argv[], struct server_config* cfg)
+{
+  static struct option long_options[] =
   {
-    printf("Usage: servw [port_number] [root_directory] [bandwidth (Bytes/s)]\n");
+    { "engine",   required_argument, NULL, 'e' },
+    { "sendfile", no_argument,       NULL, 'z' },
+    { "mmap",     no_argument,       NULL, 'm' },
+    { "workers",  required_argument, NULL, 'w' },
+    { "pin",      no_argument,       NULL, 'p' },
+    { "burst",    required_argument, NULL, 'b' },
+    { "kernel-pacing",   no_argument,       NULL, 'k' },
+    { "total-bandwidth", required_argument, NULL, 'B' },
+    { "class",    required_argument, NULL, 'c' },
+    { "request-timeout", required_argument, NULL, OPT_REQUEST_TIMEOUT },
+    { "idle-timeout",    required_argument, NULL, OPT_IDLE_TIMEOUT    },
+    { "keepalive-timeout", required_argument, NULL, OPT_KEEPALIVE_TIMEOUT },
+    { "max-requests",    required_argument, NULL, OPT_MAX_REQUESTS    },
+    { "file-cache",      required_argument, NULL, OPT_FILE_CACHE      },
+    { "response-cache",  required_argument, NULL, OPT_RESPONSE_CACHE  },
+    { "max-clients",     required_argument, NULL, OPT_MAX_CLIENTS     },
+    { "backlog",         required_argument, NULL, OPT_BACKLOG         },
+    { "status",          optional_argument, NULL, OPT_STATUS          },
+    { "latency-dump",    required_argument, NULL, OPT_LATENCY_DUMP    },
+    { "log-level",       required_argument, NULL, OPT_LOG_LEVEL       },
+    { "access-log",      required_argument, NULL, OPT_ACCESS_LOG      },
+    { "access-log-size", required_argument, NULL, OPT_ACCESS_LOG_SIZE },
+    { "access-log-keep", required_argument, NULL, OPT_ACCESS_LOG_KEEP },
+    { "help",     no_argument,       NULL, 'h' },
+    { NULL,       0,                 NULL,  0  }
+  };
+  int opt;
+
+  cfg->engine      = ENGINE_EPOLL;
+  cfg->max_clients = MAX_CLIENTS;
+  cfg->backlog     = BACKLOG;
+  cfg->workers     = 1;
+  cfg->request_timeout = REQUEST_TIMEOUT;
+  cfg->idle_timeout    = IDLE_TIMEOUT;
+  cfg->keepalive_timeout = KEEPALIVE_TIMEOUT;
+  cfg->max_requests    = MAX_REQUESTS;
+  cfg->file_cache      = FILE_CACHE;
+  cfg->response_cache  = RESPONSE_CACHE;
+  cfg->access_log_size = ACCESSLOG_SEGMENT_SIZE;
+  cfg->access_log_keep = ACCESSLOG_KEEP;
+
+  while ((opt = getopt_long(argc, argv, "e:zmw:pb:kB:c:h", long_options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'e':
+      if (strcmp(optarg, "epoll") == 0)
+        cfg->engine = ENGINE_EPOLL;
+      else if (strcmp(optarg, "uring") == 0)
+        cfg->engine = ENGINE_URING;
+      else
+      {
+        printf("Invalid engine '%s'! Choose 'epoll' or 'uring'.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'z':
+      cfg->sendfile = 1;
+      break;
+
+    case 'm':
+      cfg->mmap = 1;
+      break;
+
+    case 'w':
+      cfg->workers = atoi(optarg);
+      if (cfg->workers < 1)
+      {
+        printf("Invalid number of workers '%s'! Choose a number greater than 0.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'p':
+      cfg->pin_cpus = 1;
+      break;
+
+    case 'b':
+      cfg->burst = atoi(optarg);
+      if (cfg->burst < 1)
+      {
+        printf("Invalid burst '%s'! Choose a number greater than 0.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'k':
+      cfg->kernel_pacing = 1;
+      break;
+
+    case 'B':
+      cfg->total_bandwidth = atoi(optarg);
+      if (cfg->total_bandwidth < 1)
+      {
+        printf("Invalid total bandwidth '%s'! Choose a number greater than 0.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'c':
+      if (cfg->nclasses == (LIMITER_MAX_CLASSES - 1))
+      {
+        printf("Too many classes! The maximum is %d.\n", LIMITER_MAX_CLASSES - 1);
+        return -1;
+      }
+      cfg->classes[cfg->nclasses] = optarg;
+      cfg->nclasses++;
+      break;
+
+    case OPT_REQUEST_TIMEOUT:
+      cfg->request_timeout = atoi(optarg);
+      if (cfg->request_timeout < 0)
+      {
+        printf("Invalid request timeout '%s'! Choose 0 or more seconds.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_IDLE_TIMEOUT:
+      cfg->idle_timeout = atoi(optarg);
+      if (cfg->idle_timeout < 0)
+      {
+        printf("Invalid idle timeout '%s'! Choose 0 or more seconds.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_KEEPALIVE_TIMEOUT:
+      cfg->keepalive_timeout = atoi(optarg);
+      if (cfg->keepalive_timeout < 0)
+      {
+        printf("Invalid keep-alive timeout '%s'! Choose 0 or more seconds.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_MAX_REQUESTS:
+      cfg->max_requests = atoi(optarg);
+      if (cfg->max_requests < 0)
+      {
+        printf("Invalid maximum of requests '%s'! Choose 0 or more.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_FILE_CACHE:
+      cfg->file_cache = atoi(optarg);
+      if (cfg->file_cache < 0)
+      {
+        printf("Invalid file cache size '%s'! Choose 0 or more files.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_RESPONSE_CACHE:
+      cfg->response_cache = atoi(optarg);
+      if (cfg->response_cache < 0)
+      {
+        printf("Invalid response cache limit '%s'! Choose 0 or more bytes.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_MAX_CLIENTS:
+      cfg->max_clients = atoi(optarg);
+      if (cfg->max_clients < 1)
+      {
+        printf("Invalid maximum of clients '%s'! Choose a number greater than 0.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_BACKLOG:
+      cfg->backlog = atoi(optarg);
+      if (cfg->backlog < 1)
+      {
+        printf("Invalid backlog '%s'! Choose a number greater than 0.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_STATUS:
+      cfg->status_path = (optarg != NULL) ? optarg : STATUS_PATH;
+      if (cfg->status_path[0] != '/')
+      {
+        printf("Invalid status path '%s'! It must start with '/'.\n", cfg->status_path);
+        return -1;
+      }
+      cfg->status_path_size = strlen(cfg->status_path);
+      break;
+
+    case OPT_LATENCY_DUMP:
+      cfg->latency_dump = atoi(optarg);
+      if (cfg->latency_dump < 1)
+      {
+        printf("Invalid latency dump interval '%s'! Choose 1 or more seconds.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case OPT_LOG_LEVEL:
+      log_level = log_parse_level(optarg);
+      if (log_level == -1)
+      {
+        printf("Invalid log level '%s'! Choose error, warn, info or debug.\n", optarg);
+        return -1;
+      }
+      if (log_level > LOG_LEVEL_MAX)
+        printf("Log level '%s' was compiled out (LOG_LEVEL_MAX is %d)\n", optarg, LOG_LEVEL_MAX);
+      break;
+
+    case OPT_ACCESS_LOG:
+      cfg->access_log = optarg;
+      break;
+
+    case OPT_ACCESS_LOG_SIZE:
+      cfg->access_log_size = atol(optarg);
+      if (cfg->access_log_size < (2 * ACCESSLOG_RECORD_SIZE))
+      {
+        printf("Invalid access log segment size '%s'! Choose at least %d bytes.\n",
+               optarg, 2 * ACCESSLOG_RECORD_SIZE);
+        return -1;
+      }
+      break;
+
+    case OPT_ACCESS_LOG_KEEP:
+      cfg->access_log_keep = atoi(optarg);
+      if (cfg->access_log_keep < 0)
+      {
+        printf("Invalid number of access log segments '%s'! Choose 0 or more.\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'h':
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if ((cfg->nclasses > 0) && (cfg->total_bandwidth == 0))
+  {
+    printf("Traffic classes need a --total-bandwidth to share!\n");
     return -1;
   }
 
-  port = atoi(argv[1]);
-  if ((port < 0) || (port > 65535))
+  if ((argc - optind) != 3)
   {
-    printf("Invalid port number %d! Choose between 0 and 65535!\n", port);
+    usage();
     return -1;
   }
 
-  bandwidth = atoi(argv[3]);
-  if (bandwidth <= 0)
+  cfg->port = atoi(argv[optind]);
+  if ((cfg->port < 0) || (cfg->port > 65535))
   {
-    printf("Invalid bandwidth '%d bytes/s'! Choose a number greater than 0.\n", atoi(argv[3]));
+    printf("Invalid port number %d! Choose between 0 and 65535!\n", cfg->port);
     return -1;
   }
-  return 0;
+
+  cfg->bandwidth = atoi(argv[optind + 2]);
+  if (cfg->bandwidth <= 0)
+  {
+    printf("Invalid bandwidth '%d bytes/s'! Choose a number greater than 0.\n", cfg->bandwidth);
+    return -1;
+  }
+  return optind + 1;
 }
 
 
+/** Cria o limite agregado descrito por #cfg->total_bandwidth e
+ *  #cfg->classes em 'limiter', deixando-o em #cfg->limiter.
+ *
+ *  @return 0 em sucesso (ou se nao ha limite agregado), -1 em erro.
+ */
+int setup_limiter(struct server_config* cfg, struct limiter* limiter)
+{
+  uint64_t now = timer_monotonic_ms();
+  int i;
+
+  if (cfg->total_bandwidth == 0)
+    return 0;
+
+  if (limiter_init(limiter, cfg->total_bandwidth, now) == -1)
+  {
+    perror("Erro em limiter_init()");
+    return -1;
+  }
 
+  for (i = 0; i < cfg->nclasses; i++)
+  {
+    if (limiter_add_class(limiter, cfg->classes[i], now) == -1)
+    {
+      printf("Invalid class '%s'! Use MATCH,WEIGHT - for example /downloads/,40\n", cfg->classes[i]);
+      limiter_exit(limiter);
+      return -1;
+    }
+  }
 
+  cfg->limiter = limiter;
+  return 0;
+}
 
 
-int find_crlf(char* where)
+/** Cria o cache de arquivos em 'cache', com #cfg->file_cache entradas,
+ *  deixando-o em #cfg->filecache.
+ *
+ *  Sem inotify o cache nao teria como saber que um arquivo mudou - nesse
+ *  caso o servidor continua, so que sem cache.
+ */
+void setup_filecache(struct server_config* cfg, struct file_cache* cache)
 {
-  if (where == NULL)
-    return -1;
-  if (strstr(where, "\r\n\r\n") == NULL)
-    return 0;
-  else
-    return 1;
+  if (cfg->file_cache == 0)
+    return;
+
+  if (filecache_init(cache, cfg->file_cache, cfg->rootdir, cfg->rootdirsize) == -1)
+  {
+    perror("Erro em filecache_init() - continuando sem cache de arquivos");
+    return;
+  }
+  cfg->filecache = cache;
 }
 
 
@@ -153,556 +522,89 @@ int main(int argc, char *argv[])
   FILE *logfile = NULL;
   FILE *errfile = NULL;
 
-  int  port_number;
-  char rootdir[BUFFER_SIZE];
-  int  rootdirsize;
-
-  int listener = -1;
-  int maxfds;
-  int select_retval;
-
-  struct c_handler_list handler_list;
-  struct c_handler* handler = NULL;
-
-  fd_set readfds;
-  fd_set writefds;
-  fd_set clientfds;
-  fd_set total_readfds;
-  fd_set total_writefds;
-  int total_clients = 0;
-
-  struct timeval tmp_timer;
+  struct server_config cfg;
+  struct limiter limiter;
+  struct file_cache filecache;
+  char *rootdir_arg;
 
   char buffer[BUFFER_SIZE];
   int retval;
 
 
-  retval = handle_args(argc, argv);
+  memset(&cfg, 0, sizeof(cfg));
+
+  retval = handle_args(argc, argv, &cfg);
   if (retval == -1)
     exit (EXIT_FAILURE);
 
+  rootdir_arg = argv[retval];
+
+  if (setup_limiter(&cfg, &limiter) == -1)
+    exit (EXIT_FAILURE);
+
   /* Inicializar daemon - pode ser commented-out */
   //~ daemonize(logfile, "servw.log", errfile, "servwERR.log");
 
   /* Inicializar servidor */
-  port_number = atoi(argv[1]);
-
   set_signals();
 
-  memset(rootdir, '\0', BUFFER_SIZE);
-  rootdirsize = 0;
-  if (argv[2][0] == '/')
+  memset(cfg.rootdir, '\0', BUFFER_SIZE);
+  cfg.rootdirsize = 0;
+  if (rootdir_arg[0] == '/')
   {
     // Caminho absoluto
-    strncpy(rootdir, argv[2], (BUFFER_SIZE - 1));
-    rootdirsize = strlen(argv[2]);
+    strncpy(cfg.rootdir, rootdir_arg, (BUFFER_SIZE - 1));
+    cfg.rootdirsize = strlen(rootdir_arg);
   }
   else
   {
     // Caminho relativo
-    strncpy(rootdir, getenv("PWD"), (BUFFER_SIZE - 1));
-    rootdirsize = strlen (rootdir);
-    rootdir[rootdirsize] = '/';
-    rootdirsize++;
-    strncat(rootdir, argv[2], (BUFFER_SIZE - 1) - rootdirsize);
-    rootdirsize += strlen (argv[2]);
+    strncpy(cfg.rootdir, getenv("PWD"), (BUFFER_SIZE - 1));
+    cfg.rootdirsize = strlen (cfg.rootdir);
+    cfg.rootdir[cfg.rootdirsize] = '/';
+    cfg.rootdirsize++;
+    strncat(cfg.rootdir, rootdir_arg, (BUFFER_SIZE - 1) - cfg.rootdirsize);
+    cfg.rootdirsize += strlen (rootdir_arg);
   }
 
   // Expandir os symbolic links do diretorio root
-  if (realpath(rootdir, buffer) == NULL)
+  if (realpath(cfg.rootdir, buffer) == NULL)
   {
     if (errno == ENOENT)
-      printf("Error! Directory doesn't exist: %s\n", rootdir);
+      printf("Error! Directory doesn't exist: %s\n", cfg.rootdir);
     else
       perror("Erro em realpath()");
     exit(EXIT_FAILURE);
   }
-  strncpy(rootdir, buffer, (BUFFER_SIZE - 1));
-  rootdirsize = strlen(rootdir);
-  printf("Diretorio raiz: %s\n", rootdir);
-
-  // server_start -  muito importante!
-  listener = server_start(port_number);
-  if (listener == -1)
-    exit(EXIT_FAILURE);
+  strncpy(cfg.rootdir, buffer, (BUFFER_SIZE - 1));
+  cfg.rootdirsize = strlen(cfg.rootdir);
 
+  // Daqui em diante o log e escrito por outra thread
+  if (log_start() == -1)
+    perror("Erro em log_start() - log continua sincrono");
 
-  /* Inicializar select() */
-  FD_ZERO(&readfds);
-  FD_ZERO(&writefds);
-  FD_ZERO(&clientfds);
-  FD_ZERO(&total_readfds);
-  FD_ZERO(&total_writefds);
-  FD_SET(listener, &total_readfds);
+  LOG_WRITE("Diretorio raiz: %s", cfg.rootdir);
 
-  maxfds = listener;
+  setup_filecache(&cfg, &filecache);
+  if ((cfg.mmap) && (cfg.filecache == NULL))
+    LOG_WARN("Sem cache de arquivos, --mmap nao tem efeito");
 
+  scan_init();
+  LOG_WRITE("Busca de delimitadores: %s", scan_name());
 
-  /* Inicializar clienthandlers */
-  c_handler_list_init(&handler_list, MAX_CLIENTS);
-  if (handler_list.max > FD_SETSIZE)
+  cfg.metrics = metrics_init(cfg.workers);
+  if (cfg.metrics == NULL)
   {
-    LOG_ERROR("O maximo de clientes permitido por select() e FD_SETSIZE");
+    perror("Erro em metrics_init()");
     exit(EXIT_FAILURE);
   }
+  if (cfg.status_path != NULL)
+    LOG_WRITE("Metricas em %s", cfg.status_path);
+  if ((cfg.latency_dump > 0) && (metrics_dump_start(cfg.metrics, cfg.workers, cfg.latency_dump) == -1))
+    perror("Erro em metrics_dump_start()");
 
-  LOG_WRITE("Inicializacao completa!");
+  /* Main Loop(s) - so retorna em caso de erro */
+  workers_run(&cfg);
 
-
-  /* Main Loop */
-  while (1)
-  {
-    readfds  = total_readfds;
-    writefds = total_writefds;
-
-    // 'backup' do smaller_timeout - veja 'man 2 select', Linux Notes
-    if (handler_list.smaller_timeout != NULL)
-    {
-      tmp_timer.tv_sec  = handler_list.smaller_timeout->tv_sec;
-      tmp_timer.tv_usec = handler_list.smaller_timeout->tv_usec;
-    }
-
-
-    select_retval = select(maxfds + 1, &readfds, &writefds, NULL, handler_list.smaller_timeout);
-
-
-    if (handler_list.smaller_timeout != NULL)
-    {
-      handler_list.smaller_timeout->tv_sec = tmp_timer.tv_sec;
-      handler_list.smaller_timeout->tv_usec = tmp_timer.tv_usec;
-    }
-
-    if (select_retval == -1)
-      perror("Erro em select()");
-
-    /* nova conexao */
-    if (FD_ISSET (listener, &readfds))
-    {
-      struct c_handler* handler = NULL;
-      int new_client = -1;
-
-      VERBOSE(printf("Novo cliente tentando se conectar\n"));
-
-      if (handler_list.current > handler_list.max)
-      {
-        LOG_ERROR("Limite de clientes excedido!");
-        continue;
-      }
-
-      new_client = accept(listener, NULL, NULL);
-      if (new_client == -1)
-      {
-        perror("Erro em accept()");
-        continue;
-      }
-
-      retval = c_handler_init(&handler, new_client, rootdir, rootdirsize, atoi(argv[3]));
-      if (retval == -1)
-      {
-        perror("Erro em c_handler_init()");
-        close(new_client);
-        continue;
-      }
-
-      retval = c_handler_add(handler, &handler_list);
-      if (retval == -1)
-      {
-        LOG_ERROR("Erro em c_handler_add()");
-        close(new_client);
-        continue;
-      }
-
-      if (new_client > maxfds)
-        maxfds = new_client;
-      FD_SET(new_client, &total_readfds);
-      FD_SET(new_client, &total_writefds);
-      LOG_WRITE("*** Nova conexao de cliente aceita! ***");
-      total_clients++;
-    }
-
-
-    if (handler_list.current == 0)
-      continue;
-
-
-    handler = handler_list.begin;
-    while (handler != NULL)
-    {
-      /* Lidar com quem esta esperando */
-      if (handler->waiting == 1)
-      {
-        timer_stop(&(handler->cronometro));
-        timer_delta(&(handler->cronometro));
-        // tirar do tempo de espera o tempo que acabou de passar
-        timersub(&(handler->timer.delta), &(handler->cronometro.delta), &(handler->timer.delta));
-
-        float tmptmp =  handler->timer.delta.tv_sec + handler->timer.delta.tv_usec / 1e6;
-        if (tmptmp <= 0)
-        {
-          VERBOSE(printf("Continuar a enviar arquivo para cliente %d\n", handler->client));
-          FD_SET(handler->client, &total_writefds);
-          if (handler->client > maxfds)
-            maxfds = handler->client;
-
-          if (handler_list.smaller_timeout == &(handler->timer.delta))
-          {
-            if (handler_list.current == 1)
-              handler_list.smaller_timeout = NULL;
-            else
-              get_new_smaller_timeout(&handler_list, handler);
-          }
-          handler->waiting = 0;
-        }
-        else
-        {
-          timer_start(&(handler->cronometro));
-        }
-      }
-
-      /* Maquina de estados dos c_handlers */
-      switch (handler->state)
-      {
-      case HEADER_RECEIVING:
-        /** @todo @bug @warning
-         *  Caso o cliente conecte mas tenha um 'lag', o FD_ISSET do readfds
-         *  nao vai dar.
-         *  Porem, se o cliente terminar de mandar a mensagem, vai acontecer
-         *  a mesma coisa.
-         *  Como diferenciar o fato de que o cliente pode estar numa conexao
-         *  lenta com o fato de que o cliente pode ter terminado de enviar?
-         */
-        if (FD_ISSET(handler->client, &readfds))
-        {
-          retval = receive_request(handler);
-          if (retval == -1)
-          {
-            LOG_WRITE("Erro de conexao com cliente!");
-            handler->state = FINISHED;
-          }
-          if (retval == 1)
-          {
-            LOG_WRITE("Cliente desconectou");
-            handler->state = FINISHED;
-          }
-
-          // tomar diferentes acoes baseado no metodo
-          // (continuar recebendo dados ou nao)
-          if (find_crlf(handler->request))
-          {
-            switch (http_what_method(handler->request, handler->request_size))
-            {
-            case GET_M:
-              handler->state = REQUEST_RECEIVED;
-              break;
-            case PUT_M:
-              handler->state = BODY_RECEIVING;
-              break;
-            case UNKNOWN_M:
-              // mandar mensagem de erro (wtf)
-              break;
-            default:
-              // mandar mensagem de erro (metodo nao suportado)
-              break;
-            }
-
-          }
-        }
-        break;
-
-      case BODY_RECEIVING:
-        //put - vou implementar depois
-
-        break;
-
-      case REQUEST_RECEIVED:
-        LOG_WRITE("Mensagem recebida!");
-        handler->state = REQUEST_ANALYZE;
-        break;
-
-      case REQUEST_ANALYZE:
-        LOG_WRITE("Analisando pedido...");
-        parse_request(handler);
-        switch (http_what_method(handler->request, handler->request_size))
-        {
-        case GET_M:
-          handler->state = GET_CHECK_FILE;
-          break;
-        case PUT_M:
-          handler->state = PUT_CHECK_FILE;
-          break;
-        case UNKNOWN_M:
-          // mandar mensagem de erro (wtf)
-          break;
-        default:
-          // mandar mensagem de erro (metodo nao suportado)
-          break;
-        }
-        break;
-
-      case GET_CHECK_FILE:
-        //checar arquivo handler->filepath
-        retval = resolve_symlinks(handler->filepath, handler->filepathsize);
-        if (http_status_is_error(retval))
-        {
-          handler->filestatus = retval;
-          handler->state = ERROR_HANDLE;
-          break;
-        }
-
-        retval = check_path(handler->filepath, rootdir, rootdirsize);
-        if (http_status_is_error(retval))
-        {
-          handler->filestatus = retval;
-          handler->state = ERROR_HANDLE;
-          break;
-        }
-
-        if (check_file_is_dir(handler->filepath))
-        {
-          retval = append_index_html(handler->filepath, handler->filepathsize);
-          if (retval == -1)
-          {
-            // buffer overflow, nao da pra anexar...
-          }
-        }
-
-        retval = check_file(handler->filepath);
-        if (http_status_is_error(retval))
-        {
-          handler->filestatus = retval;
-          handler->state = ERROR_HANDLE;
-          break;
-        }
-
-        // se chegou ate aqui, significa que nao tem erros! \o/
-        handler->filestatus = OK_S;
-        handler->filetype_size = http_get_file_type(handler->filepath, handler->filepathsize, handler->filetype, BUFFER_SIZE);
-        handler->state = HEADER_PREPARE;
-        break;
-
-      case ERROR_HANDLE:
-
-        strncpy(handler->filetype, "text/html", BUFFER_SIZE);
-        handler->state = HEADER_PREPARE;
-        break;
-
-      case HEADER_PREPARE:
-        handler->filestatusmsg_size = http_get_status_msg(handler->filestatus, handler->filestatusmsg, BUFFER_SIZE);
-
-        if (http_status_is_error(handler->filestatus))
-        {
-          handler->error_html_size = build_error_html(handler->error_html, BUFFER_SIZE, handler->filestatus, handler->filestatusmsg);
-          handler->filesize = handler->error_html_size;
-        }
-        else
-        {
-          handler->filesize = get_file_size(handler->filepath);
-        }
-
-        handler->answer_header_size = http_build_header(handler);
-
-        FILE *fp = fmemopen(handler->answer_header, handler->answer_header_size, "r");
-        if (fp == NULL)
-        {
-          //errno
-        }
-
-        open_file(handler, fp, handler->answer_header_size);
-
-        handler->state = FILE_SENDING;
-        handler->next_state = FILE_PREPARE;
-        handler->timer_sizesent = 0;
-        timer_start(&(handler->timer));
-        LOG_WRITE("Enviando Header...");
-        break;
-
-      case FILE_PREPARE:
-
-        if (http_status_is_error(handler->filestatus))
-        {
-          handler->filep = fmemopen(handler->error_html, handler->error_html_size, "r");
-          if (handler->filep == NULL)
-          {
-            LOG_PERROR("Erro em main()->FILE_PREPARE->fmemopen()");
-            handler->state = FINISHED;
-            break;
-          }
-        }
-        else
-        {
-          handler->filep = fopen(handler->filepath, "r");
-          if (handler->filep == NULL)
-          {
-            LOG_PERROR("Erro em main()->FILE_PREPARE->fopen()");
-            handler->state = FINISHED;
-            break;
-          }
-        }
-
-        open_file(handler, handler->filep, handler->filesize);
-
-        handler->state = FILE_SENDING;
-        handler->next_state = FINISHED;
-        handler->timer_sizesent = 0;
-        timer_start(&(handler->timer));
-        LOG_WRITE("Enviando Arquivo...");
-        break;
-
-      case PUT_CHECK_FILE:
-        //put - implementar depois
-        break;
-
-
-      case FILE_SENDING:
-        // Checar se o cliente desconectou
-        if (FD_ISSET(handler->client, &readfds))
-        {
-          retval = receive_request(handler);
-          if (retval != 0)
-            handler->state = FINISHED;
-        }
-
-        // Continuar mandando arquivo
-        if (FD_ISSET(handler->client, &writefds))
-        {
-          float delta;
-
-          if (handler->need_file_chunk == 1)
-          {
-            retval = get_chunk(handler);
-            if (retval == -1)
-            {
-              LOG_WRITE("Erro na leitura do arquivo!");
-              handler->state = FINISHED;
-              break;
-            }
-            if (retval == 1)
-            {
-              //terminou de pegar do arquivo!
-            }
-            handler->need_file_chunk = 0;
-          }
-
-          timer_stop(&(handler->timer));
-          delta = timer_delta(&(handler->timer));
-          if (delta < 1)
-          {
-            if ((handler->timer_sizesent) < (handler->bandwidth))
-            {
-              retval = send_chunk(handler);
-              if (retval == -1)
-              {
-                LOG_WRITE("Erro de conexao!");
-                handler->state = FINISHED;
-                break;
-              }
-
-              if (retval == 0)
-                handler->need_file_chunk = 1;
-
-              handler->timer_sizesent += retval;
-              handler->output_sizesent += retval;
-              handler->output_sizeleft -= retval;
-            }
-            // Ja mandei tudo o que podia mas ainda nao deu 1 segundo
-            else
-            {
-              // Pra poupar processamento, tirar cliente do select()
-              FD_CLR(handler->client, &total_writefds);
-
-              VERBOSE(printf("Pausar o envio de arquivo para cliente %d\n", handler->client));
-
-              if (maxfds == handler->client)
-              {
-                if (handler_list.current == 1)
-                  maxfds = listener;
-                else
-                  get_new_maxfds(&maxfds, &handler_list, handler);
-              }
-
-              // delta = (1 - delta)
-              timersub(&(handler_list.onesec_timeout), &(handler->timer.delta), &(handler->timer.delta));
-
-              if (handler_list.smaller_timeout == NULL)
-                handler_list.smaller_timeout = &(handler->timer.delta);
-              else
-              {
-                if (timercmp(&(handler->timer.delta), handler_list.smaller_timeout, <))
-                  handler_list.smaller_timeout = &(handler->timer.delta);
-              }
-
-              timer_start(&(handler->cronometro));
-              handler->waiting = 1;
-            }
-          }
-          // Ja passou de 1 segundo
-          else
-          {
-            VERBOSE(printf ("Velocidade: %.2f Bytes/s para o cliente %d\n", (handler->timer_sizesent / delta), handler->client));
-            timer_start(&(handler->timer));
-            handler->timer_sizesent = 0;
-
-            // Novo smaller timeout
-            if (handler_list.smaller_timeout == &(handler->timer.delta))
-            {
-              if (handler_list.current == 1)
-                handler_list.smaller_timeout = NULL;
-              else
-                get_new_smaller_timeout(&handler_list, handler);
-            }
-          }
-
-          if (handler->output_sizesent >= handler->output_size)
-            handler->state = FILE_SENT;
-        }
-        break;
-
-      case FILE_SENT:
-        LOG_WRITE("Enviado!");
-        close_file(handler);
-        handler->state = handler->next_state;
-        break;
-
-      case FINISHED:
-        close_file(handler);
-        FD_CLR(handler->client, &total_writefds);
-        FD_CLR(handler->client, &total_readfds);
-
-        if (handler_list.smaller_timeout == &(handler->timer.delta))
-        {
-          if (handler_list.current == 1)
-            handler_list.smaller_timeout = NULL;
-          else
-            get_new_smaller_timeout(&handler_list, handler);
-        }
-
-        if (maxfds == handler->client)
-        {
-          if (handler_list.current == 1)
-            maxfds = listener;
-          else
-            get_new_maxfds(&maxfds, &handler_list, handler);
-        }
-
-        close(handler->client);
-        c_handler_remove(handler, &handler_list);
-        c_handler_exit(handler);
-        handler = NULL;
-
-        LOG_WRITE("Cliente desconectou\n");
-        printf("Requests Servidas: %d\n", total_clients);
-        break;
-
-      default:
-        break;
-      }
-
-    if (handler != NULL)
-      handler = handler->next;
-
-    } /*  while (handler != NULL) */
-
-  } /* while(1) */
-
-  return 0;
+  exit(EXIT_FAILURE);
 }
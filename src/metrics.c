@@ -0,0 +1,374 @@
+/**
+ * @file metrics.c
+ *
+ * Implementacao das metricas do servidor e do seu formato de texto,
+ * o mesmo do Prometheus.
+ *
+ * Zerar os histogramas (metrics_reset()) so avanca uma 'epoca' global:
+ * cada worker zera os seus na proxima vez que for gravar, e quem le
+ * ignora os workers que ainda nao viram a epoca nova. Assim cada
+ * histograma continua tendo um escritor so. So os percentis recomecam:
+ * o _sum e o _count de cada fase sao contadores a parte, que nunca
+ * voltam - como o Prometheus espera.
+ */
+
+#include <stdio.h>      /* snprintf()                                */
+#include <stddef.h>     /* offsetof()                                */
+#include <stdlib.h>     /* aligned_alloc()                           */
+#include <string.h>     /* memset()                                  */
+#include <unistd.h>     /* sleep()                                   */
+#include <pthread.h>    /* pthread_create()                          */
+
+#include "metrics.h"
+#include "client.h"
+#include "http.h"
+#include "macros.h"
+
+
+_Static_assert((FILE_SENT + 2) == METRICS_STATES, "METRICS_STATES nao bate com enum states");
+
+
+/** Para onde vao as contas de quem ainda nao chamou metrics_attach() */
+static struct metrics metrics_none;
+
+__thread struct metrics* metrics_local = &metrics_none;
+
+/** Quantas vezes metrics_reset() foi chamada */
+static uint64_t metrics_epoch = 0;
+
+
+/** O nome de cada estado, na ordem de enum states (a partir de FINISHED) */
+static const char* metrics_state_names[METRICS_STATES] =
+{
+  "finished", "header_receiving", "body_receiving", "request_received",
+  "request_analyze", "get_check_file", "put_check_file", "header_prepare",
+  "file_prepare", "error_handle", "file_sending", "file_sent"
+};
+
+/** O nome de cada fase, na ordem de enum metrics_phases */
+static const char* metrics_phase_names[METRICS_PHASES] =
+{
+  "header", "prepare", "first_byte", "transfer", "throttled", "unthrottled"
+};
+
+/** Os percentis publicados, em decimos de milesimo (veja hist_quantile()) */
+static const int   metrics_quantiles[] = { 5000, 9900, 9990 };
+static const char* metrics_quantile_names[] = { "0.5", "0.99", "0.999" };
+
+#define METRICS_QUANTILES  ((int)(sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0])))
+
+
+/** Os status codes contados um a um; o ultimo indice e 'other' */
+static const int metrics_codes[METRICS_CODES - 1] =
+{
+  OK_S, CREATED_S, BAD_REQUEST_S, FORBIDDEN_S, NOT_FOUND_S,
+  REQUEST_URI_TOO_LARGE_S, SERVER_ERROR_S, NOT_IMPLEMENTED_S
+};
+
+
+/** Cria as metricas (zeradas) de 'workers' workers.
+ *
+ *  @return O vetor, ou NULL se falta memoria.
+ */
+struct metrics* metrics_init(int workers)
+{
+  struct metrics* m;
+  size_t size = workers * sizeof(struct metrics);
+
+  m = aligned_alloc(__alignof__(struct metrics), size);
+  if (m == NULL)
+    return NULL;
+
+  memset(m, 0, size);
+  return m;
+}
+
+
+/** Faz a thread atual contar em 'm' - chamar no comeco de cada worker. */
+void metrics_attach(struct metrics* m)
+{
+  if (m != NULL)
+    metrics_local = m;
+}
+
+
+/** Conta uma resposta com o status 'status'. */
+void metrics_response(int status)
+{
+  int i;
+
+  for (i = 0; i < (METRICS_CODES - 1); i++)
+    if (metrics_codes[i] == status)
+      break;
+
+  METRICS_ADD(responses[i], 1);
+}
+
+
+/** A fase 'phase' da request atual durou 'ns' nanossegundos. */
+void metrics_phase(int phase, int64_t ns)
+{
+  struct metrics* m = metrics_local;
+  uint64_t epoch = __atomic_load_n(&metrics_epoch, __ATOMIC_RELAXED);
+  uint64_t us;
+  int i;
+
+  if (m->epoch != epoch)
+  {
+    for (i = 0; i < METRICS_PHASES; i++)
+      hist_reset(&(m->phases[i]));
+
+    __atomic_store_n(&(m->epoch), epoch, __ATOMIC_RELAXED);
+  }
+
+  us = (ns > 0) ? (uint64_t)(ns / 1000) : 0;
+  hist_record(&(m->phases[phase]), us);
+  METRICS_ADD(phase_count[phase], 1);
+  METRICS_ADD(phase_sum[phase], us);
+}
+
+
+/** Zera os histogramas de todos os workers - os percentis recomecam, os
+ *  totais nao (veja o comeco do arquivo).
+ */
+void metrics_reset(void)
+{
+  __atomic_fetch_add(&metrics_epoch, 1, __ATOMIC_RELAXED);
+}
+
+
+/** Junta em 'out' a fase 'phase' dos 'workers' workers de 'm' - menos a
+ *  dos que ainda nao aplicaram o ultimo metrics_reset().
+ */
+static void metrics_merge_phase(struct metrics* m, int workers, int phase, struct histogram* out)
+{
+  uint64_t epoch = __atomic_load_n(&metrics_epoch, __ATOMIC_RELAXED);
+  int i;
+
+  memset(out, 0, sizeof(struct histogram));
+  for (i = 0; i < workers; i++)
+    if (__atomic_load_n(&(m[i].epoch), __ATOMIC_RELAXED) == epoch)
+      hist_merge(out, &(m[i].phases[phase]));
+}
+
+
+/** O campo 'offset' (em bytes) de 'm', somado nos 'workers' workers. */
+static int64_t metrics_sum(struct metrics* m, int workers, size_t offset)
+{
+  int64_t sum = 0;
+  int i;
+
+  for (i = 0; i < workers; i++)
+    sum += __atomic_load_n((int64_t*)((char*)&(m[i]) + offset), __ATOMIC_RELAXED);
+
+  return sum;
+}
+
+
+/** Escreve em 'buf' uma metrica 'name' do tipo 'type', com ajuda 'help'.
+ *
+ *  Cada amostra vem de metrics_sum() sobre 'offset', e a 'count' amostras
+ *  seguidas (um vetor da struct) recebem os rotulos label="values[i]".
+ *
+ *  @return Quantos bytes foram escritos, ou -1 se nao coube.
+ */
+static int metrics_write(char* buf, int size, const char* name, const char* type, const char* help,
+                         struct metrics* m, int workers, size_t offset,
+                         const char* label, const char** values, int count)
+{
+  int n;
+  int i;
+
+  n = snprintf(buf, size, "# HELP servw_%s %s\n# TYPE servw_%s %s\n", name, help, name, type);
+  if ((n < 0) || (n >= size))
+    return -1;
+
+  for (i = 0; i < count; i++)
+  {
+    int64_t value = metrics_sum(m, workers, offset + (i * sizeof(int64_t)));
+    int w;
+
+    if (label != NULL)
+      w = snprintf(buf + n, size - n, "servw_%s{%s=\"%s\"} %lld\n", name, label, values[i], (long long)value);
+    else
+      w = snprintf(buf + n, size - n, "servw_%s %lld\n", name, (long long)value);
+
+    if ((w < 0) || (w >= (size - n)))
+      return -1;
+    n += w;
+  }
+  return n;
+}
+
+
+/** Escreve em 'buf' o tempo de cada fase como um 'summary' do Prometheus,
+ *  em segundos.
+ *
+ *  @return Quantos bytes foram escritos, ou -1 se nao coube.
+ */
+static int metrics_write_phases(char* buf, int size, struct metrics* m, int workers)
+{
+  struct histogram h;
+  uint64_t sum;
+  uint64_t count;
+  int n;
+  int w;
+  int i;
+  int q;
+
+  n = snprintf(buf, size, "# HELP servw_phase_seconds Time spent in each phase of a request.\n"
+                          "# TYPE servw_phase_seconds summary\n");
+  if ((n < 0) || (n >= size))
+    return -1;
+
+  for (i = 0; i < METRICS_PHASES; i++)
+  {
+    metrics_merge_phase(m, workers, i, &h);
+
+    for (q = 0; q < METRICS_QUANTILES; q++)
+    {
+      uint64_t us = hist_quantile(&h, metrics_quantiles[q]);
+
+      w = snprintf(buf + n, size - n, "servw_phase_seconds{phase=\"%s\",quantile=\"%s\"} %llu.%06llu\n",
+                   metrics_phase_names[i], metrics_quantile_names[q],
+                   (unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000));
+      if ((w < 0) || (w >= (size - n)))
+        return -1;
+      n += w;
+    }
+
+    sum   = metrics_sum(m, workers, offsetof(struct metrics, phase_sum) + (i * sizeof(uint64_t)));
+    count = metrics_sum(m, workers, offsetof(struct metrics, phase_count) + (i * sizeof(uint64_t)));
+
+    w = snprintf(buf + n, size - n, "servw_phase_seconds_sum{phase=\"%s\"} %llu.%06llu\n"
+                                    "servw_phase_seconds_count{phase=\"%s\"} %llu\n",
+                 metrics_phase_names[i],
+                 (unsigned long long)(sum / 1000000), (unsigned long long)(sum % 1000000),
+                 metrics_phase_names[i], (unsigned long long)count);
+    if ((w < 0) || (w >= (size - n)))
+      return -1;
+    n += w;
+  }
+  return n;
+}
+
+
+/** Escreve em 'buf' as metricas dos 'workers' workers de 'm', no formato
+ *  de texto do Prometheus.
+ *
+ *  @return O tamanho do texto, ou -1 se nao coube em 'size' bytes.
+ */
+int metrics_render(struct metrics* m, int workers, char* buf, int size)
+{
+  char codes[METRICS_CODES][8];
+  const char* code_names[METRICS_CODES];
+  int n = 0;
+  int w;
+  int i;
+
+  for (i = 0; i < (METRICS_CODES - 1); i++)
+  {
+    snprintf(codes[i], sizeof(codes[i]), "%d", metrics_codes[i]);
+    code_names[i] = codes[i];
+  }
+  code_names[METRICS_CODES - 1] = "other";
+
+#define METRICS_WRITE(name, type, help, field, label, values, count)                 \
+  w = metrics_write(buf + n, size - n, name, type, help, m, workers,                 \
+                    offsetof(struct metrics, field), label, values, count);          \
+  if (w == -1)                                                                       \
+    return -1;                                                                       \
+  n += w;
+
+  METRICS_WRITE("connections", "gauge", "Open connections in each handler state.",
+                states, "state", metrics_state_names, METRICS_STATES);
+  METRICS_WRITE("throttled_connections", "gauge", "Connections paused by bandwidth limits right now.",
+                waiting, NULL, NULL, 1);
+  METRICS_WRITE("accepts_total", "counter", "Accepted connections.",
+                accepts, NULL, NULL, 1);
+  METRICS_WRITE("sent_bytes_total", "counter", "Bytes sent to clients.",
+                bytes_sent, NULL, NULL, 1);
+  METRICS_WRITE("throttled_total", "counter", "Times a connection was paused by bandwidth limits.",
+                throttled, NULL, NULL, 1);
+  METRICS_WRITE("responses_total", "counter", "Responses by HTTP status code.",
+                responses, "code", code_names, METRICS_CODES);
+  METRICS_WRITE("file_cache_hits_total", "counter", "File cache lookups that found the file.",
+                cache_hits, NULL, NULL, 1);
+  METRICS_WRITE("file_cache_misses_total", "counter", "File cache lookups that did not.",
+                cache_misses, NULL, NULL, 1);
+  METRICS_WRITE("loop_iterations_total", "counter", "Event loop iterations.",
+                iterations, NULL, NULL, 1);
+  METRICS_WRITE("loop_events_total", "counter", "epoll events or io_uring completions handled.",
+                events, NULL, NULL, 1);
+  METRICS_WRITE("timer_expirations_total", "counter", "Timer wheel expirations (throttling wake-ups and deadlines).",
+                timers, NULL, NULL, 1);
+
+#undef METRICS_WRITE
+
+  w = metrics_write_phases(buf + n, size - n, m, workers);
+  if (w == -1)
+    return -1;
+
+  return n + w;
+}
+
+
+/** O que a thread de metrics_dump_start() precisa. */
+struct metrics_dump
+{
+  struct metrics* m;
+  int workers;
+  int interval;
+};
+
+
+/** A thread de metrics_dump_start(): a cada intervalo, mostra os
+ *  percentis de cada fase e zera os histogramas.
+ */
+static void* metrics_dump_loop(void* arg)
+{
+  struct metrics_dump* d = arg;
+  struct histogram h;
+  int i;
+
+  while (1)
+  {
+    sleep(d->interval);
+
+    LOG_WRITE("Latencias dos ultimos %ds (p50 / p99 / p999, em us):", d->interval);
+    for (i = 0; i < METRICS_PHASES; i++)
+    {
+      metrics_merge_phase(d->m, d->workers, i, &h);
+      LOG_WRITE("  %-12s %10llu %10llu %10llu  (%llu requests)", metrics_phase_names[i],
+             (unsigned long long)hist_quantile(&h, 5000),
+             (unsigned long long)hist_quantile(&h, 9900),
+             (unsigned long long)hist_quantile(&h, 9990),
+             (unsigned long long)h.count);
+    }
+
+    metrics_reset();
+  }
+  return NULL;
+}
+
+
+/** Cria a thread que mostra (e zera) as latencias dos 'workers' workers
+ *  de 'm' a cada 'interval' segundos.
+ *
+ *  @return 0 em sucesso, -1 em erro.
+ */
+int metrics_dump_start(struct metrics* m, int workers, int interval)
+{
+  static struct metrics_dump d;
+  pthread_t thread;
+
+  d.m        = m;
+  d.workers  = workers;
+  d.interval = interval;
+
+  if (pthread_create(&thread, NULL, metrics_dump_loop, &d) != 0)
+    return -1;
+
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file metrics.h
+ *
+ * Definicao das metricas do servidor (contadores e medidores).
+ *
+ * Cada worker tem a sua #metrics, que so ele escreve - sem lock e sem
+ * instrucao atomica de verdade no caminho quente, so um store 'relaxed'.
+ * Quem responde o /server-status (veja --status) soma as de todos os
+ * workers na hora: nada de percorrer a lista de clientes.
+ *
+ * Os medidores por estado acompanham cada troca de #c_handler.state
+ * (veja c_handler_set_state()), entao tambem nao precisam de varredura.
+ * As mesmas trocas marcam o tempo de cada fase das requests, guardado
+ * em histogramas (histogram.h) - p50, p99 e p999 saem no /server-status
+ * e, com --latency-dump, no log a cada tantos segundos.
+ */
+
+#ifndef METRICS_H_DEFINED
+#define METRICS_H_DEFINED
+
+#include <stdint.h>
+#include "histogram.h"
+
+
+/** Quantos valores tem enum states (de FINISHED = -1 ate FILE_SENT) */
+#define METRICS_STATES  12
+
+/** Status codes contados um a um - o resto cai em 'other' */
+#define METRICS_CODES   9
+
+/** Tamanho do buffer onde metrics_render() escreve */
+#define METRICS_RENDER_SIZE  16384
+
+
+/** As fases de uma request que tem o tempo medido. Possuem prefixo 'PHASE_'. */
+enum metrics_phases
+{
+  PHASE_HEADER,      /**< Do accept() (ou do primeiro byte, no keep-alive) ao header inteiro */
+  PHASE_PREPARE,     /**< Do header inteiro a resposta pronta (GET_CHECK_FILE ate FILE_SENDING) */
+  PHASE_FIRST_BYTE,  /**< Do header inteiro ao primeiro byte da resposta */
+  PHASE_TRANSFER,    /**< De FILE_SENDING a FILE_SENT */
+  PHASE_THROTTLED,   /**< A parte de PHASE_TRANSFER parada pelo controle de banda */
+  PHASE_UNTHROTTLED, /**< O resto de PHASE_TRANSFER */
+  METRICS_PHASES
+};
+
+
+/** As metricas de um worker. Ocupa linhas de cache so suas. */
+struct metrics
+{
+  int64_t  states[METRICS_STATES];   /**< Clientes em cada estado - o indice e o estado + 1 */
+  int64_t  waiting;                  /**< Clientes parados agora pelo controle de banda */
+
+  uint64_t accepts;                  /**< Conexoes aceitas */
+  uint64_t bytes_sent;               /**< Bytes enviados (headers e corpos) */
+  uint64_t throttled;                /**< Vezes que algum cliente foi parado pelo controle de banda */
+  uint64_t responses[METRICS_CODES]; /**< Respostas por status code */
+  uint64_t cache_hits;               /**< Arquivos achados no cache de arquivos */
+  uint64_t cache_misses;             /**< Arquivos procurados no cache e nao achados */
+
+  uint64_t iterations;               /**< Voltas do loop principal */
+  uint64_t events;                   /**< Eventos do epoll ou completions do io_uring */
+  uint64_t timers;                   /**< Timers da roda que venceram */
+
+  uint64_t phase_count[METRICS_PHASES]; /**< Vezes que cada fase foi medida - metrics_reset() nao zera */
+  uint64_t phase_sum[METRICS_PHASES];   /**< Tempo total de cada fase, em us - idem */
+
+  uint64_t epoch;                    /**< Ultimo metrics_reset() que esse worker ja aplicou */
+  struct histogram phases[METRICS_PHASES]; /**< Tempo de cada fase, em us, desde o ultimo metrics_reset() */
+} __attribute__((aligned(64)));
+
+
+/** As metricas do worker desta thread (veja metrics_attach()) */
+extern __thread struct metrics* metrics_local;
+
+/** Soma 'n' ao campo 'field' das metricas desta thread.
+ *
+ *  So a propria thread escreve, entao ler-somar-gravar e seguro; o store
+ *  'relaxed' e so para quem le de outra thread nunca ver um valor pela
+ *  metade.
+ */
+#define METRICS_ADD(field, n) \
+  __atomic_store_n(&(metrics_local->field), metrics_local->field + (n), __ATOMIC_RELAXED)
+
+
+struct metrics* metrics_init(int workers);
+void metrics_attach(struct metrics* m);
+void metrics_response(int status);
+void metrics_phase(int phase, int64_t ns);
+void metrics_reset(void);
+int  metrics_render(struct metrics* m, int workers, char* buf, int size);
+int  metrics_dump_start(struct metrics* m, int workers, int interval);
+
+
+/** Um cliente passou do estado 'from' para 'to'. */
+static inline void metrics_state(int from, int to)
+{
+  METRICS_ADD(states[from + 1], -1);
+  METRICS_ADD(states[to + 1], 1);
+}
+
+
+#endif /* METRICS_H_DEFINED */
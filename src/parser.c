@@ -0,0 +1,277 @@
+/**
+ * @file parser.c
+ *
+ * Implementacao do parser incremental de requests HTTP.
+ *
+ * Cada chamada de http_parser_execute() continua de #http_parser.pos,
+ * entao um cliente lento que manda a request de byte em byte custa O(n)
+ * no total - e nao O(n^2), como procurar "\r\n\r\n" no buffer inteiro a
+ * cada recv().
+ */
+
+#include <string.h>     /* strchr() strlen()                         */
+#include <strings.h>    /* strncasecmp()                             */
+#include <ctype.h>      /* isalnum()                                 */
+
+#include "parser.h"
+#include "http.h"
+#include "scan.h"
+
+
+/** Maior metodo conhecido ("OPTIONS", "CONNECT") */
+#define PARSER_MAX_METHOD   7
+
+/** Tamanho de "HTTP/1.x" */
+#define PARSER_VERSION_SIZE 8
+
+
+/** Onde o parser esta dentro da request. Possuem prefixo 'P_'. */
+enum parser_states
+{
+  P_METHOD,        /**< Lendo o metodo - linhas vazias antes dele sao ignoradas */
+  P_TARGET,        /**< Lendo o alvo, ate o espaco */
+  P_VERSION,       /**< Lendo a versao, ate o '\r' */
+  P_REQUEST_LF,    /**< Esperando o '\n' da linha de request */
+  P_HEADER_START,  /**< Comeco de linha: outro header ou o fim */
+  P_HEADER_NAME,   /**< Lendo o nome do header, ate o ':' */
+  P_VALUE_START,   /**< Pulando os espacos antes do valor */
+  P_VALUE,         /**< Lendo o valor, ate o '\r' */
+  P_HEADER_LF,     /**< Esperando o '\n' de um header */
+  P_END_LF,        /**< Esperando o '\n' da linha vazia */
+  P_DONE,
+  P_ERROR
+};
+
+
+/** Prepara 'p' para uma nova request, de no maximo 'limit' bytes. */
+void http_parser_init(struct http_parser* p, int limit)
+{
+  p->state = P_METHOD;
+  p->pos   = 0;
+  p->mark  = 0;
+  p->limit = limit;
+
+  p->method  = UNKNOWN_M;
+  p->version = UNKNOWN_V;
+  p->target.begin = 0;
+  p->target.size  = 0;
+
+  p->nheaders = 0;
+  p->end   = 0;
+  p->error = 0;
+}
+
+
+/** Desiste da request, que deve ser respondida com 'status'. */
+static int parser_fail(struct http_parser* p, int status)
+{
+  p->state = P_ERROR;
+  p->error = status;
+  return PARSER_ERROR;
+}
+
+
+/** Diz se 'c' pode fazer parte do nome de um header (RFC 7230, 'tchar'). */
+static int parser_is_token(unsigned char c)
+{
+  if (isalnum(c))
+    return 1;
+
+  return (c != '\0') && (strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+
+/** Continua a analise de 'buf', que agora tem 'size' bytes.
+ *
+ *  So os bytes a partir de onde a ultima chamada parou sao olhados.
+ *  'buf' deve ser sempre o mesmo buffer, so que com mais dados no fim.
+ *
+ *  @return PARSER_DONE quando o header terminou (#http_parser.end diz
+ *          onde), PARSER_AGAIN se faltam bytes e PARSER_ERROR se a
+ *          request e invalida ou passou de #http_parser.limit.
+ */
+int http_parser_execute(struct http_parser* p, const char* buf, int size)
+{
+  struct http_header* header;
+  int skip;
+
+  if (p->state == P_DONE)
+    return PARSER_DONE;
+  if (p->state == P_ERROR)
+    return PARSER_ERROR;
+
+  while (p->pos < size)
+  {
+    unsigned char c = buf[p->pos];
+
+    switch (p->state)
+    {
+    case P_METHOD:
+      if ((p->pos == p->mark) && ((c == '\r') || (c == '\n')))
+      {
+        p->mark++;
+        break;
+      }
+      if (c == ' ')
+      {
+        if (p->pos == p->mark)
+          return parser_fail(p, BAD_REQUEST_S);
+
+        p->method = http_what_method((char*)buf + p->mark, p->pos - p->mark);
+        p->target.begin = p->pos + 1;
+        p->state = P_TARGET;
+      }
+      else if ((c < 'A') || (c > 'Z') || ((p->pos - p->mark) >= PARSER_MAX_METHOD))
+        return parser_fail(p, BAD_REQUEST_S);
+      break;
+
+    case P_TARGET:
+      if ((p->pos == p->target.begin) && (c != '/'))
+        return parser_fail(p, BAD_REQUEST_S);
+
+      // Pula de uma vez tudo ate o espaco (ou algum controle)
+      skip = scan_ctl(buf + p->pos, size - p->pos, '!');
+      if (skip > 0)
+      {
+        p->pos += skip;
+        if ((p->pos - p->target.begin) > PARSER_MAX_TARGET)
+          return parser_fail(p, REQUEST_URI_TOO_LARGE_S);
+        continue;
+      }
+
+      if (c == ' ')
+      {
+        p->target.size = p->pos - p->target.begin;
+        if (p->target.size == 0)
+          return parser_fail(p, BAD_REQUEST_S);
+
+        p->mark  = p->pos + 1;
+        p->state = P_VERSION;
+      }
+      else
+        return parser_fail(p, BAD_REQUEST_S);
+      break;
+
+    case P_VERSION:
+      if (c == '\r')
+      {
+        p->version = http_what_version((char*)buf + p->mark, p->pos - p->mark);
+        if (p->version == UNKNOWN_V)
+          return parser_fail(p, BAD_REQUEST_S);
+
+        p->state = P_REQUEST_LF;
+      }
+      else if ((p->pos - p->mark) >= PARSER_VERSION_SIZE)
+        return parser_fail(p, BAD_REQUEST_S);
+      break;
+
+    case P_REQUEST_LF:
+    case P_HEADER_LF:
+      if (c != '\n')
+        return parser_fail(p, BAD_REQUEST_S);
+
+      p->state = P_HEADER_START;
+      break;
+
+    case P_HEADER_START:
+      if (c == '\r')
+      {
+        p->state = P_END_LF;
+        break;
+      }
+      // Espaco aqui seria continuacao do header anterior (obs-fold)
+      if ((!parser_is_token(c)) || (p->nheaders == PARSER_MAX_HEADERS))
+        return parser_fail(p, BAD_REQUEST_S);
+
+      p->headers[p->nheaders].name.begin = p->pos;
+      p->state = P_HEADER_NAME;
+      break;
+
+    case P_HEADER_NAME:
+      header = &(p->headers[p->nheaders]);
+      if (c == ':')
+      {
+        header->name.size   = p->pos - header->name.begin;
+        header->value.begin = p->pos + 1;
+        header->value.size  = 0;
+        p->state = P_VALUE_START;
+      }
+      else if (!parser_is_token(c))
+        return parser_fail(p, BAD_REQUEST_S);
+      break;
+
+    case P_VALUE_START:
+      header = &(p->headers[p->nheaders]);
+      if ((c == ' ') || (c == '\t'))
+      {
+        header->value.begin = p->pos + 1;
+        break;
+      }
+      p->state = P_VALUE;
+      /* fall through */
+
+    case P_VALUE:
+      // Pula de uma vez tudo ate o CR (ou algum controle)
+      skip = scan_ctl(buf + p->pos, size - p->pos, ' ');
+      if (skip > 0)
+      {
+        p->pos += skip;
+        continue;
+      }
+
+      header = &(p->headers[p->nheaders]);
+      if (c == '\r')
+      {
+        // Tira os espacos do fim do valor
+        header->value.size = p->pos - header->value.begin;
+        while ((header->value.size > 0) &&
+               ((buf[header->value.begin + header->value.size - 1] == ' ') ||
+                (buf[header->value.begin + header->value.size - 1] == '\t')))
+          header->value.size--;
+
+        p->nheaders++;
+        p->state = P_HEADER_LF;
+      }
+      else if (c != '\t')
+        return parser_fail(p, BAD_REQUEST_S);
+      break;
+
+    case P_END_LF:
+      if (c != '\n')
+        return parser_fail(p, BAD_REQUEST_S);
+
+      p->end   = p->pos + 1;
+      p->pos   = p->end;
+      p->state = P_DONE;
+      return PARSER_DONE;
+    }
+    p->pos++;
+  }
+
+  if (p->pos >= p->limit)
+    return parser_fail(p, BAD_REQUEST_S);
+
+  return PARSER_AGAIN;
+}
+
+
+/** Procura o header 'name' (sem diferenciar maiusculas) na request
+ *  ja analisada por 'p', dentro de 'buf'.
+ *
+ *  @return O pedaco de 'buf' com o valor, ou NULL se nao existir.
+ */
+struct http_span* http_parser_header(struct http_parser* p, const char* buf, const char* name)
+{
+  int size = strlen(name);
+  int i;
+
+  for (i = 0; i < p->nheaders; i++)
+  {
+    struct http_header* header = &(p->headers[i]);
+
+    if ((header->name.size == size) &&
+        (strncasecmp(buf + header->name.begin, name, size) == 0))
+      return &(header->value);
+  }
+  return NULL;
+}
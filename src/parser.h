@@ -0,0 +1,69 @@
+/**
+ * @file parser.h
+ *
+ * Definicao do parser incremental de requests HTTP.
+ *
+ * O parser e uma maquina de estados que guarda onde parou: a cada recv()
+ * ele olha so os bytes novos, nunca o buffer inteiro de novo. Nada e
+ * copiado - metodo, alvo, versao e cada header viram pedacos (#http_span)
+ * do proprio buffer de recebimento.
+ *
+ * Entrada mal-formada ou grande demais e recusada assim que aparece, com
+ * o status HTTP que deve ser respondido (400, 414 ou 501) em
+ * #http_parser.error.
+ */
+
+#ifndef PARSER_H_DEFINED
+#define PARSER_H_DEFINED
+
+
+/** Quantos headers guardamos por request */
+#define PARSER_MAX_HEADERS  32
+
+/** Maior alvo ("/caminho/do/arquivo") aceito antes do 414 */
+#define PARSER_MAX_TARGET   255
+
+/** Retornos de http_parser_execute() */
+#define PARSER_AGAIN   0   /**< Faltam bytes */
+#define PARSER_DONE    1   /**< O header terminou */
+#define PARSER_ERROR  -1   /**< Request invalida - veja #http_parser.error */
+
+
+/** Um pedaco do buffer de recebimento: 'size' bytes a partir de 'begin'. */
+struct http_span
+{
+  int begin;
+  int size;
+};
+
+struct http_header
+{
+  struct http_span name;
+  struct http_span value;  /**< Sem os espacos em volta */
+};
+
+struct http_parser
+{
+  int state;    /**< Onde o parser parou - veja parser.c */
+  int pos;      /**< Proximo byte a ser olhado */
+  int mark;     /**< Onde comeca o pedaco sendo lido (metodo ou versao) */
+  int limit;    /**< Tamanho maximo do header inteiro, em bytes */
+
+  int method;   /**< Um dos #http_methods */
+  int version;  /**< Uma das #http_versions */
+  struct http_span target;
+
+  struct http_header headers[PARSER_MAX_HEADERS];
+  int nheaders;
+
+  int end;      /**< Onde o header termina (depois do "\r\n\r\n") - o resto e a proxima request */
+  int error;    /**< Status HTTP para responder quando der PARSER_ERROR */
+};
+
+
+void http_parser_init(struct http_parser* p, int limit);
+int  http_parser_execute(struct http_parser* p, const char* buf, int size);
+struct http_span* http_parser_header(struct http_parser* p, const char* buf, const char* name);
+
+
+#endif /* PARSER_H_DEFINED */
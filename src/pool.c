@@ -0,0 +1,118 @@
+/**
+ * @file pool.c
+ *
+ * Implementacao do pool de objetos de tamanho fixo.
+ */
+
+#include <stdlib.h>     /* aligned_alloc() free()                    */
+#include <string.h>     /* memset()                                  */
+
+#include "pool.h"
+
+
+/** Cria um slab com 'count' objetos e coloca todos na lista de livres.
+ *
+ *  O slab inteiro e zerado aqui - assim o kernel ja entrega as paginas
+ *  agora, e nao no accept() de algum cliente.
+ *
+ *  @return 0 em sucesso, -1 se faltar memoria.
+ */
+static int pool_grow(struct pool* p, int count)
+{
+  struct pool_slab* slab;
+  size_t total = POOL_ALIGN + (p->size * count);
+  char*  obj;
+  int    i;
+
+  slab = aligned_alloc(POOL_ALIGN, total);
+  if (slab == NULL)
+    return -1;
+
+  memset(slab, 0, total);
+  slab->next = p->slabs;
+  p->slabs   = slab;
+
+  // Do ultimo para o primeiro, para pool_get() devolver em ordem
+  obj = (char*)slab + POOL_ALIGN + (p->size * (count - 1));
+  for (i = 0; i < count; i++)
+  {
+    *(void**)obj = p->free;
+    p->free = obj;
+    obj -= p->size;
+  }
+
+  p->capacity += count;
+  return 0;
+}
+
+
+/** Inicializa 'p' para objetos de 'size' bytes, com 'count' deles ja
+ *  alocados (o maximo de clientes, por exemplo).
+ *
+ *  @return 0 em sucesso, -1 se faltar memoria.
+ */
+int pool_init(struct pool* p, size_t size, int count)
+{
+  if (size < sizeof(void*))
+    size = sizeof(void*);
+
+  p->size     = (size + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1);
+  p->grow     = (count / 4 > POOL_GROW) ? (count / 4) : POOL_GROW;
+  p->free     = NULL;
+  p->slabs    = NULL;
+  p->capacity = 0;
+  p->used     = 0;
+
+  if (count <= 0)
+    return 0;
+
+  return pool_grow(p, count);
+}
+
+
+/** Pega um objeto livre de 'p'. Se nao houver, 'p' cresce mais um slab
+ *  em vez de falhar.
+ *
+ *  @note O conteudo do objeto e o que o ultimo dono deixou.
+ *  @return O objeto, ou NULL se faltar memoria.
+ */
+void* pool_get(struct pool* p)
+{
+  void* obj;
+
+  if ((p->free == NULL) && (pool_grow(p, p->grow) == -1))
+    return NULL;
+
+  obj = p->free;
+  p->free = *(void**)obj;
+  p->used++;
+  return obj;
+}
+
+
+/** Devolve 'obj', pego com pool_get(), para 'p'. */
+void pool_put(struct pool* p, void* obj)
+{
+  if (obj == NULL)
+    return;
+
+  *(void**)obj = p->free;
+  p->free = obj;
+  p->used--;
+}
+
+
+/** Libera todos os slabs de 'p' - inclusive os objetos ainda em uso. */
+void pool_exit(struct pool* p)
+{
+  while (p->slabs != NULL)
+  {
+    struct pool_slab* next = p->slabs->next;
+
+    free(p->slabs);
+    p->slabs = next;
+  }
+  p->free     = NULL;
+  p->capacity = 0;
+  p->used     = 0;
+}
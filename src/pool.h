@@ -0,0 +1,55 @@
+/**
+ * @file pool.h
+ *
+ * Definicao do pool de objetos de tamanho fixo (slab allocator).
+ *
+ * Cada conexao precisa de um c_handler, e com muitas conexoes curtas
+ * malloc() + free() por cliente viram contencao no alocador e page
+ * faults no caminho do accept(). O pool pede memoria em 'slabs' de
+ * varios objetos de uma vez, ja tocados (sem page faults depois), e
+ * guarda os objetos devolvidos numa lista de livres: pegar e devolver
+ * custa O(1).
+ *
+ * Cada objeto comeca numa linha de cache propria (#POOL_ALIGN), entao
+ * dois clientes nunca dividem uma linha.
+ *
+ * @note Nao tem trava - cada worker usa o seu.
+ */
+
+#ifndef POOL_H_DEFINED
+#define POOL_H_DEFINED
+
+#include <stddef.h>     /* size_t                                    */
+
+
+/** Alinhamento de cada objeto - o tamanho de uma linha de cache */
+#define POOL_ALIGN  64
+
+/** Quantos objetos vem em cada slab depois do primeiro, no minimo */
+#define POOL_GROW   16
+
+
+/** Comeco de cada slab - os objetos vem logo depois */
+struct pool_slab
+{
+  struct pool_slab* next;
+};
+
+struct pool
+{
+  size_t size;             /**< Tamanho de cada objeto, arredondado para #POOL_ALIGN */
+  int    grow;             /**< Quantos objetos vem nos proximos slabs */
+  void*  free;             /**< Objetos livres - o comeco de cada um aponta o proximo */
+  struct pool_slab* slabs; /**< Todos os slabs, para pool_exit() */
+  int    capacity;         /**< Quantos objetos cabem em todos os slabs */
+  int    used;             /**< Quantos estao com alguem agora */
+};
+
+
+int   pool_init(struct pool* p, size_t size, int count);
+void* pool_get(struct pool* p);
+void  pool_put(struct pool* p, void* obj);
+void  pool_exit(struct pool* p);
+
+
+#endif /* POOL_H_DEFINED */
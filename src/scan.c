@@ -0,0 +1,145 @@
+/**
+ * @file scan.c
+ *
+ * Implementacao das buscas de delimitadores.
+ *
+ * As versoes vetoriais sao compiladas com __attribute__((target)), entao
+ * o binario continua rodando em qualquer x86-64 - a AVX2 so e chamada se
+ * a CPU tiver. Fora de x86 sobra so a versao byte a byte.
+ */
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>  /* _mm_*() _mm256_*()                    */
+  #define SCAN_X86  1
+#endif
+
+
+/** Assinatura comum a todas as versoes de scan_ctl(). */
+typedef int (*scan_func)(const char* buf, int size, unsigned char lo);
+
+
+/** Diz se 'c' faz scan_ctl() parar. */
+static int scan_is_stop(unsigned char c, unsigned char lo)
+{
+  return (c < lo) || (c == 0x7f);
+}
+
+
+/** Versao byte a byte - funciona em qualquer CPU. */
+static int scan_ctl_scalar(const char* buf, int size, unsigned char lo)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    if (scan_is_stop(buf[i], lo))
+      return i;
+
+  return size;
+}
+
+
+#ifdef SCAN_X86
+
+/** Versao SSE2 - 16 bytes por vez.
+ *
+ *  Nao existe comparacao sem sinal de bytes, entao 'c < lo' vira
+ *  'min(c, lo - 1) == c'.
+ */
+__attribute__((target("sse2")))
+static int scan_ctl_sse2(const char* buf, int size, unsigned char lo)
+{
+  const __m128i below = _mm_set1_epi8((char)(lo - 1));
+  const __m128i del   = _mm_set1_epi8(0x7f);
+  int i = 0;
+
+  for (; (i + 16) <= size; i += 16)
+  {
+    __m128i v    = _mm_loadu_si128((const __m128i*)(buf + i));
+    __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, below), v),
+                                _mm_cmpeq_epi8(v, del));
+    int mask = _mm_movemask_epi8(stop);
+
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + scan_ctl_scalar(buf + i, size - i, lo);
+}
+
+
+/** Versao AVX2 - 32 bytes por vez, mesma ideia da SSE2. */
+__attribute__((target("avx2")))
+static int scan_ctl_avx2(const char* buf, int size, unsigned char lo)
+{
+  const __m256i below = _mm256_set1_epi8((char)(lo - 1));
+  const __m256i del   = _mm256_set1_epi8(0x7f);
+  int i = 0;
+
+  for (; (i + 32) <= size; i += 32)
+  {
+    __m256i v    = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, below), v),
+                                   _mm256_cmpeq_epi8(v, del));
+    unsigned int mask = _mm256_movemask_epi8(stop);
+
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + scan_ctl_sse2(buf + i, size - i, lo);
+}
+
+#endif /* SCAN_X86 */
+
+
+/** A versao escolhida por scan_init() - byte a byte ate la */
+static scan_func scan_impl = scan_ctl_scalar;
+static const char* scan_impl_name = "scalar";
+
+
+/** Escolhe a versao mais rapida que a CPU suporta.
+ *
+ *  @note Chamar antes de criar os workers.
+ */
+void scan_init(void)
+{
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    scan_impl = scan_ctl_avx2;
+    scan_impl_name = "avx2";
+    return;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    scan_impl = scan_ctl_sse2;
+    scan_impl_name = "sse2";
+    return;
+  }
+#endif
+  scan_impl = scan_ctl_scalar;
+  scan_impl_name = "scalar";
+}
+
+
+/** Nome da versao escolhida por scan_init(), para o log. */
+const char* scan_name(void)
+{
+  return scan_impl_name;
+}
+
+
+/** Procura em 'buf' o primeiro byte menor que 'lo' ou DEL (0x7f).
+ *
+ *  Com 'lo' = ' ' isso acha CR, LF e qualquer outro controle; com
+ *  'lo' = '!' acha tambem o espaco.
+ *
+ *  @return A posicao do byte, ou 'size' se nenhum dos 'size' bytes
+ *          de 'buf' for um deles.
+ */
+int scan_ctl(const char* buf, int size, unsigned char lo)
+{
+  return scan_impl(buf, size, lo);
+}
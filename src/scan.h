@@ -0,0 +1,23 @@
+/**
+ * @file scan.h
+ *
+ * Definicao das buscas de delimitadores usadas pelo parser.
+ *
+ * O parser passa a maior parte do tempo pulando bytes 'comuns' - os do
+ * alvo e os do valor de cada header (cookies enormes, por exemplo) - ate
+ * achar um CR, LF, espaco ou outro caractere de controle. Essa busca tem
+ * versoes SSE2 e AVX2, que olham 16 ou 32 bytes de uma vez, e uma versao
+ * byte a byte para qualquer outra CPU. scan_init() escolhe a melhor que
+ * a CPU suporta.
+ */
+
+#ifndef SCAN_H_DEFINED
+#define SCAN_H_DEFINED
+
+
+void        scan_init(void);
+const char* scan_name(void);
+int         scan_ctl(const char* buf, int size, unsigned char lo);
+
+
+#endif /* SCAN_H_DEFINED */
@@ -29,10 +29,14 @@
  *  @note O servidor vai possuir porta reusavel para outras conexoes,
  *        seu socket vai ser nao-bloqueante e vai funcionar na
  *        porta especificada.
+ *        Se 'shared' for 1, o socket usa SO_REUSEPORT - varios listeners
+ *        (um por worker) podem ficar na mesma porta e o kernel distribui
+ *        as conexoes entre eles.
+ *        Ate 'backlog' conexoes ficam na fila esperando accept().
  *
  *  @return Um socket pronto para conexao em sucesso, -1 em caso de erro.
  */
-int server_start (int port_number)
+int server_start (int port_number, int shared, int backlog)
 {
   int listener;
   int retval;
@@ -55,6 +59,18 @@ int server_start (int port_number)
 
   LOG_WRITE("Reusable Port Set");
 
+  if (shared)
+  {
+    retval = set_shared_port(listener);
+    if (retval == -1)
+    {
+      perror("Error at setsockopt()");
+      return -1;
+    }
+
+    LOG_WRITE("Shared Port Set");
+  }
+
   retval = bind_inet_address (listener, port_number);
   if (retval == -1)
   {
@@ -62,9 +78,14 @@ int server_start (int port_number)
     return -1;
   }
 
-  printf("Address binded to port %d\n", port_number);
+  LOG_WRITE("Address binded to port %d", port_number);
 
-  listen(listener, 10);
+  retval = listen(listener, backlog);
+  if (retval == -1)
+  {
+    perror("Error at listen()");
+    return -1;
+  }
 
   LOG_WRITE("Ready to accept connections");
 
@@ -108,6 +129,19 @@ int set_reusable_port (int sckt)
 
 
 
+/** Permite que varios sockets facam bind() na mesma porta (SO_REUSEPORT).
+ *
+ *  O kernel espalha as novas conexoes entre todos eles.
+ */
+int set_shared_port (int sckt)
+{
+  int yes = 1;
+
+  return (setsockopt (sckt, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof (yes)));
+}
+
+
+
 /** Inicia e efetua o bind() no endereco de um servidor para internet
  *  (segundo o protocolo TCP/IP).
  *
@@ -188,3 +222,31 @@ int socket_set_nonblocking (int sck)
   return 0;
 }
 
+
+/** Sets the socket specified back to blocking mode.
+ *
+ *  @return 0 on success, -1 on error (perror() is called).
+ */
+int socket_set_blocking (int sck)
+{
+  int flags;
+
+
+  flags = fcntl (sck, F_GETFL, NULL);
+  if (flags == -1)
+  {
+    perror ("Error at fcntl() on socket_set_blocking");
+    return flags;
+  }
+
+  flags &= ~O_NONBLOCK;
+
+  flags = fcntl (sck, F_SETFL, flags);
+  if (flags == -1)
+  {
+    perror ("Error at fcntl() on socket_set_blocking");
+    return flags;
+  }
+
+  return 0;
+}
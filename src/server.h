@@ -10,12 +10,14 @@
 #define SERVER_H_DEFINED
 
 
-int server_start (int port_number);
+int server_start (int port_number, int shared, int backlog);
 int new_inet_socket ();
 int set_reusable_port (int sckt);
+int set_shared_port (int sckt);
 int bind_inet_address (int sckt, int port);
 int get_ip_addr (char* buffer, size_t bsize, char* host_name);
 int socket_set_nonblocking (int sck);
+int socket_set_blocking (int sck);
 
 
 #endif /* SERVER_H_DEFINED */
@@ -0,0 +1,762 @@
+/**
+ * @file states.c
+ *
+ * Implementacao dos estados do c_handler que nao dependem de I/O.
+ */
+
+#include <stdio.h>
+#include <string.h>     /* strncpy()                                 */
+#include <errno.h>      /* errno EINVAL                              */
+#include <unistd.h>     /* close()                                   */
+#include <fcntl.h>      /* open()                                    */
+#include <sys/stat.h>   /* fstat() S_ISREG()                         */
+#include <netinet/in.h> /* struct sockaddr_in                        */
+#include <stdlib.h>     /* malloc() free()                           */
+#include <limits.h>     /* INT_MAX                                   */
+
+#include "states.h"
+#include "http.h"
+#include "macros.h"
+#include "timer.h"
+#include "metrics.h"
+
+
+/** Diz se 'h' pediu o alvo reservado para as metricas (--status).
+ *
+ *  @return 1 se sim, 0 se nao.
+ */
+static int state_is_status(struct c_handler* h, struct server_config* cfg)
+{
+  struct http_span* target = &(h->buf->parser.target);
+
+  return (cfg->status_path != NULL) && (target->size == cfg->status_path_size) &&
+         (memcmp(h->buf->request + target->begin, cfg->status_path, cfg->status_path_size) == 0);
+}
+
+
+/** Responde 'h' com as metricas de todos os workers (metrics.h), geradas
+ *  agora em #h->cold->generated. Nao passa pelo sistema de arquivos, e nao
+ *  muda nada - quem pede so le.
+ *
+ *  @return 0 em sucesso, -1 se falta memoria (ou as metricas nao couberam).
+ */
+static int state_send_status(struct c_handler* h, struct server_config* cfg)
+{
+  int size;
+
+  // Quem pede as metricas aparece nelas ja enviando a resposta
+  c_handler_set_state(h, FILE_SENDING);
+  h->cold->next_state = FINISHED;
+
+  h->cold->generated = malloc(METRICS_RENDER_SIZE);
+  if (h->cold->generated == NULL)
+    return -1;
+
+  size = metrics_render(cfg->metrics, cfg->workers, h->cold->generated, METRICS_RENDER_SIZE);
+  if (size == -1)
+  {
+    free(h->cold->generated);
+    h->cold->generated = NULL;
+    return -1;
+  }
+
+  h->cold->filestatus = OK_S;
+  h->cold->filesize   = size;
+  h->cold->filestatusmsg_size = http_get_status_msg(OK_S, h->buf->filestatusmsg, BUFFER_SIZE);
+  h->cold->filetype_size = snprintf(h->buf->filetype, BUFFER_SIZE, "text/plain; version=0.0.4");
+  h->cold->answer_header_size = http_build_header(h);
+
+  open_memory(h);
+  add_part(h, h->buf->answer_header, h->cold->answer_header_size);
+  add_part(h, h->cold->generated, size);
+  metrics_response(OK_S);
+
+  LOG_DEBUG("Enviando metricas...");
+  return 0;
+}
+
+
+/** Depois que chegaram mais bytes da request, decide se ja da pra
+ *  analisar o pedido ou se temos que continuar recebendo.
+ *
+ *  O #h->buf->parser so olha os bytes que chegaram desde a ultima vez.
+ *  Requests invalidas ou grandes demais vao direto para ERROR_HANDLE,
+ *  sem esperar o resto.
+ *
+ *  @return 1 se o header terminou de chegar (e o estado mudou),
+ *          0 se ainda faltam dados.
+ */
+int state_request_check(struct c_handler* h)
+{
+  // O relogio da fase PHASE_HEADER comeca no primeiro byte (keep-alive)
+  if (h->cold->t_request == 0)
+    h->cold->t_request = timer_now();
+
+  switch (http_parser_execute(&(h->buf->parser), h->buf->request, h->cold->request_size))
+  {
+  case PARSER_AGAIN:
+    return 0;
+
+  case PARSER_ERROR:
+    LOG_DEBUG("Request invalida!");
+    h->cold->filestatus = h->buf->parser.error;
+    c_handler_set_state(h, ERROR_HANDLE);
+    return 1;
+  }
+
+  // tomar diferentes acoes baseado no metodo
+  // (continuar recebendo dados ou nao)
+  switch (h->buf->parser.method)
+  {
+  case GET_M:
+    c_handler_set_state(h, REQUEST_RECEIVED);
+    break;
+  case PUT_M:
+    c_handler_set_state(h, BODY_RECEIVING);
+    break;
+  default:
+    h->cold->filestatus = NOT_IMPLEMENTED_S;
+    c_handler_set_state(h, ERROR_HANDLE);
+    break;
+  }
+  return 1;
+}
+
+
+/** Abre #h->buf->filepath para ser enviado com sendfile() ou pelo
+ *  io_uring, caso seja um arquivo regular. Qualquer outra coisa continua
+ *  indo por fopen() - e o io_uring recusa.
+ *
+ *  @return 0 em sucesso (mesmo que o arquivo nao seja regular),
+ *          -1 em caso de erro (errno e setado).
+ */
+static int state_open_regular_file(struct c_handler* h)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(h->buf->filepath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  if ((fstat(fd, &st) == -1) || (!S_ISREG(st.st_mode)))
+  {
+    close(fd);
+    return 0;
+  }
+
+  open_file_fd(h, fd, h->cold->filesize);
+  return 0;
+}
+
+
+/** Procura #h->buf->filepath no cache de arquivos. Se estiver la, 'h' ja
+ *  sai com o caminho real, o MIME-type e o fd do arquivo - sem nenhuma
+ *  chamada ao sistema de arquivos.
+ *
+ *  @return 1 se achou, 0 caso contrario.
+ */
+static int state_cache_lookup(struct c_handler* h, struct server_config* cfg)
+{
+  struct file_entry* e;
+
+  if (cfg->filecache == NULL)
+    return 0;
+
+  e = filecache_get(cfg->filecache, h->buf->filepath);
+  if (e == NULL)
+  {
+    METRICS_ADD(cache_misses, 1);
+    return 0;
+  }
+  METRICS_ADD(cache_hits, 1);
+
+  h->cold->fentry = e;
+  strncpy(h->buf->filepath, e->path, BUFFER_SIZE);
+  h->cold->filepathsize = strlen(h->buf->filepath);
+  strncpy(h->buf->filetype, e->type, BUFFER_SIZE);
+  h->cold->filetype_size = e->type_size;
+  return 1;
+}
+
+
+/** Le o arquivo 'fd' (com os metadados 'st') inteiro para a memoria,
+ *  logo depois do header da resposta de 'h' - sem a linha Connection,
+ *  que depende de cada request.
+ *
+ *  Se o arquivo mudar de tamanho ou de mtime enquanto e lido, desiste.
+ *
+ *  @return A resposta (alocada com malloc()), ou NULL.
+ */
+static char* state_cache_response(struct c_handler* h, int fd, struct stat* st, int* head, int* size)
+{
+  char  buff[BUFFER_SIZE];
+  char  statusmsg[BUFFER_SIZE];
+  char* response;
+  struct stat after;
+  int   done = 0;
+
+  http_get_status_msg(OK_S, statusmsg, BUFFER_SIZE);
+  *head = http_build_head(buff, BUFFER_SIZE, OK_S, statusmsg, h->buf->filetype, st->st_size);
+  if (*head == -1)
+    return NULL;
+
+  *size = *head + st->st_size;
+  response = malloc(*size);
+  if (response == NULL)
+    return NULL;
+
+  memcpy(response, buff, *head);
+  while (done < st->st_size)
+  {
+    ssize_t retval = pread(fd, response + *head + done, st->st_size - done, done);
+    if (retval <= 0)
+      break;
+
+    done += retval;
+  }
+
+  if ((done != st->st_size) || (fstat(fd, &after) == -1) ||
+      (after.st_size != st->st_size) || (after.st_mtime != st->st_mtime))
+  {
+    free(response);
+    return NULL;
+  }
+  return response;
+}
+
+
+/** Guarda no cache o arquivo que 'h' acabou de checar, pedido como
+ *  'key'. So arquivos regulares vao para o cache; os de ate
+ *  #cfg->response_cache bytes vao com a resposta pronta.
+ */
+static void state_cache_store(struct c_handler* h, struct server_config* cfg, char* key)
+{
+  struct stat st;
+  char* response = NULL;
+  int   head = 0;
+  int   size = 0;
+  int   fd;
+
+  if ((cfg->filecache == NULL) || (!filecache_can_store(key)))
+    return;
+
+  fd = open(h->buf->filepath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  if ((fstat(fd, &st) == -1) || (!S_ISREG(st.st_mode)))
+  {
+    close(fd);
+    return;
+  }
+
+  if ((cfg->response_cache > 0) && (st.st_size <= cfg->response_cache))
+    response = state_cache_response(h, fd, &st, &head, &size);
+
+  h->cold->fentry = filecache_put(cfg->filecache, key, h->buf->filepath, h->buf->filetype, fd, &st,
+                            response, head, size);
+}
+
+
+/** Descobre a classe de trafego de 'h' e a avisa de que ha mais um
+ *  cliente enviando, caso exista um limite agregado.
+ */
+static void state_classify(struct c_handler* h, struct server_config* cfg)
+{
+  struct sockaddr_in addr;
+  const char* path = h->buf->filepath;
+
+  if ((cfg->limiter == NULL) || (h->tclass != NULL))
+    return;
+
+  // Classes casam pelo caminho relativo ao diretorio raiz
+  if (strncmp(path, cfg->rootdir, cfg->rootdirsize) == 0)
+    path += cfg->rootdirsize;
+
+  if (h->cold->peer_addr == 0)
+    h->tclass = limiter_classify(cfg->limiter, path, NULL);
+  else
+  {
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = h->cold->peer_addr;
+    h->tclass = limiter_classify(cfg->limiter, path, &addr);
+  }
+
+  limiter_join(cfg->limiter, h->tclass, timer_now_ms());
+}
+
+
+/** Envia a resposta pronta de #h->cold->fentry, pulando HEADER_PREPARE e
+ *  FILE_PREPARE: nada de snprintf() nem fopen().
+ */
+static void state_send_response(struct c_handler* h, struct server_config* cfg)
+{
+  struct file_entry* e = h->cold->fentry;
+
+  h->cold->filesize = e->size;
+  state_classify(h, cfg);
+
+  open_response(h, e->response, e->response_head, e->response_size,
+                http_connection_line(h->cold->keep_alive));
+  metrics_response(OK_S);
+
+  c_handler_set_state(h, FILE_SENDING);
+  h->cold->next_state = FINISHED;
+  LOG_DEBUG("Enviando resposta do cache...");
+}
+
+
+/** Depois de responder, decide se a conexao de 'h' continua aberta.
+ *
+ *  Precisa de keep-alive ligado (#cfg->keepalive_timeout), de um
+ *  cliente que queira (http_wants_keepalive()) e de nao ter passado de
+ *  #cfg->max_requests nessa conexao.
+ */
+static int state_keep_alive(struct c_handler* h, struct server_config* cfg)
+{
+  if (cfg->keepalive_timeout <= 0)
+    return 0;
+
+  if ((cfg->max_requests > 0) && ((h->cold->requests + 1) >= cfg->max_requests))
+    return 0;
+
+  return http_wants_keepalive(h);
+}
+
+
+/** A resposta de 'h' terminou e a conexao continua aberta: volta para
+ *  HEADER_RECEIVING no mesmo socket, com o mesmo c_handler, e da a ele
+ *  #cfg->keepalive_timeout segundos para mandar a proxima request.
+ */
+static void state_next_request(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg)
+{
+  LOG_DEBUG("Mantendo a conexao aberta (keep-alive)");
+
+  state_release(h, cfg);
+  c_handler_reset(h);
+  h->cold->requests++;
+  h->cold->t_request = 0;
+
+  h->last_active = w->now;
+  wheel_add(w, &(h->deadline), w->now + ((uint64_t)cfg->keepalive_timeout * 1000));
+
+  // A proxima request pode ter chegado enquanto enviavamos - com
+  // edge-triggered o epoll nao avisaria de novo
+  h->can_read = 1;
+
+  // Ou ja estava inteira no buffer, junto com a anterior (pipelining):
+  // nenhum recv() novo vai acontecer por causa dela
+  if (h->cold->request_size > 0)
+    state_request_check(h);
+}
+
+
+/** Executa um passo da maquina de estados de 'h', caso o estado atual
+ *  nao dependa de I/O.
+ *
+ *  @return 0 se o estado foi tratado aqui, -1 se ele pertence ao motor
+ *          de I/O (HEADER_RECEIVING, FILE_SENDING e FINISHED).
+ */
+int state_process(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg)
+{
+  char key[BUFFER_SIZE];
+  int retval;
+
+  switch (h->state)
+  {
+  case BODY_RECEIVING:
+    //put - vou implementar depois
+
+    break;
+
+  case REQUEST_RECEIVED:
+    LOG_DEBUG("Mensagem recebida!");
+    c_handler_set_state(h, REQUEST_ANALYZE);
+    break;
+
+  case REQUEST_ANALYZE:
+    LOG_DEBUG("Analisando pedido...");
+    if (parse_request(h, cfg->rootdir, cfg->rootdirsize) == -1)
+    {
+      h->cold->filestatus = REQUEST_URI_TOO_LARGE_S;
+      c_handler_set_state(h, ERROR_HANDLE);
+      break;
+    }
+    switch (h->buf->parser.method)
+    {
+    case GET_M:
+      h->cold->keep_alive = state_keep_alive(h, cfg);
+      c_handler_set_state(h, GET_CHECK_FILE);
+      break;
+    case PUT_M:
+      c_handler_set_state(h, PUT_CHECK_FILE);
+      break;
+    case UNKNOWN_M:
+      // mandar mensagem de erro (wtf)
+      break;
+    default:
+      // mandar mensagem de erro (metodo nao suportado)
+      break;
+    }
+    break;
+
+  case GET_CHECK_FILE:
+    retval = state_is_status(h, cfg);
+    if (retval != 0)
+    {
+      if (state_send_status(h, cfg) == -1)
+      {
+        LOG_PERROR("Erro em state_send_status()");
+        h->cold->filestatus = SERVER_ERROR_S;
+        c_handler_set_state(h, ERROR_HANDLE);
+      }
+      break;
+    }
+
+    // Arquivo quente: o cache ja tem tudo o que os passos abaixo descobrem
+    if (state_cache_lookup(h, cfg))
+    {
+      h->cold->filestatus = OK_S;
+      c_handler_set_state(h, HEADER_PREPARE);
+      if (h->cold->fentry->response != NULL)
+        state_send_response(h, cfg);
+      break;
+    }
+    strncpy(key, h->buf->filepath, BUFFER_SIZE);
+
+    //checar arquivo h->buf->filepath
+    retval = resolve_symlinks(h->buf->filepath, h->cold->filepathsize);
+    if (http_status_is_error(retval))
+    {
+      h->cold->filestatus = retval;
+      c_handler_set_state(h, ERROR_HANDLE);
+      break;
+    }
+
+    retval = check_path(h->buf->filepath, cfg->rootdir, cfg->rootdirsize);
+    if (http_status_is_error(retval))
+    {
+      h->cold->filestatus = retval;
+      c_handler_set_state(h, ERROR_HANDLE);
+      break;
+    }
+
+    if (check_file_is_dir(h->buf->filepath))
+    {
+      retval = append_index_html(h->buf->filepath, h->cold->filepathsize);
+      if (retval == -1)
+      {
+        // buffer overflow, nao da pra anexar...
+      }
+    }
+
+    retval = check_file(h->buf->filepath);
+    if (http_status_is_error(retval))
+    {
+      h->cold->filestatus = retval;
+      c_handler_set_state(h, ERROR_HANDLE);
+      break;
+    }
+
+    // se chegou ate aqui, significa que nao tem erros! \o/
+    h->cold->filestatus = OK_S;
+    h->cold->filetype_size = http_get_file_type(h->buf->filepath, h->cold->filepathsize, h->buf->filetype, BUFFER_SIZE);
+    state_cache_store(h, cfg, key);
+    c_handler_set_state(h, HEADER_PREPARE);
+    if ((h->cold->fentry != NULL) && (h->cold->fentry->response != NULL))
+      state_send_response(h, cfg);
+    break;
+
+  case ERROR_HANDLE:
+
+    strncpy(h->buf->filetype, "text/html", BUFFER_SIZE);
+    c_handler_set_state(h, HEADER_PREPARE);
+    break;
+
+  case HEADER_PREPARE:
+    h->cold->filestatusmsg_size = http_get_status_msg(h->cold->filestatus, h->buf->filestatusmsg, BUFFER_SIZE);
+
+    if (http_status_is_error(h->cold->filestatus))
+    {
+      h->cold->error_html_size = build_error_html(h->buf->error_html, BUFFER_SIZE, h->cold->filestatus, h->buf->filestatusmsg);
+      h->cold->filesize = h->cold->error_html_size;
+    }
+    else if (h->cold->fentry != NULL)
+    {
+      h->cold->filesize = h->cold->fentry->size;
+    }
+    else
+    {
+      h->cold->filesize = get_file_size(h->buf->filepath);
+    }
+
+    h->cold->answer_header_size = http_build_header(h);
+
+    state_classify(h, cfg);
+
+    // O header nao e enviado sozinho: vai junto com o comeco do corpo
+    c_handler_set_state(h, FILE_PREPARE);
+    break;
+
+  case FILE_PREPARE:
+
+    h->cold->filep = NULL;
+    if (http_status_is_error(h->cold->filestatus))
+    {
+      open_memory(h);
+    }
+    else
+    {
+      const char* map = NULL;
+
+      // Com --mmap, um mapeamento so para todos os clientes do arquivo
+      if ((h->cold->fentry != NULL) && (cfg->mmap))
+        map = filecache_map(cfg->filecache, h->cold->fentry);
+
+      if (map != NULL)
+        open_file_map(h, map, h->cold->filesize);
+
+      // sendfile() e o read() do io_uring usam offset proprio - o fd
+      // do cache serve para todos os clientes ao mesmo tempo
+      else if ((h->cold->fentry != NULL) && ((cfg->sendfile) || (cfg->engine == ENGINE_URING)))
+        open_file_fd(h, h->cold->fentry->fd, h->cold->filesize);
+
+      // Sem sendfile(), o mesmo fd com pread() - cada um no seu offset
+      else if (h->cold->fentry != NULL)
+        open_file_pread(h, h->cold->fentry->fd, h->cold->filesize);
+
+      else if (((cfg->sendfile) || (cfg->engine == ENGINE_URING)) && (state_open_regular_file(h) == -1))
+      {
+        // Nada foi enviado ainda - da tempo de trocar a resposta por um erro
+        LOG_PERROR("Erro em state_process()->FILE_PREPARE->open()");
+        h->cold->filestatus = SERVER_ERROR_S;
+        c_handler_set_state(h, ERROR_HANDLE);
+        break;
+      }
+
+      // Fora do cache (ou arquivo nao-regular): fopen() como sempre. O
+      // io_uring so le de arquivos regulares, pelo fd
+      if ((h->cold->output_fd == -1) && (h->cold->output_map == NULL))
+      {
+        if (cfg->engine == ENGINE_URING)
+          errno = EINVAL;
+        else
+          h->cold->filep = fopen(h->buf->filepath, "r");
+
+        if (h->cold->filep == NULL)
+        {
+          LOG_PERROR("Erro em state_process()->FILE_PREPARE->fopen()");
+          h->cold->filestatus = SERVER_ERROR_S;
+          c_handler_set_state(h, ERROR_HANDLE);
+          break;
+        }
+      }
+    }
+
+    if (h->cold->filep != NULL)
+      open_file(h, h->cold->filep, h->cold->filesize);
+
+    // Header e corpo saem juntos, na mesma chamada ao sistema
+    add_part(h, h->buf->answer_header, h->cold->answer_header_size);
+    if (http_status_is_error(h->cold->filestatus))
+      add_part(h, h->buf->error_html, h->cold->error_html_size);
+    metrics_response(h->cold->filestatus);
+
+    c_handler_set_state(h, FILE_SENDING);
+    h->cold->next_state = FINISHED;
+    LOG_DEBUG("Enviando Arquivo...");
+    break;
+
+  case PUT_CHECK_FILE:
+    //put - implementar depois
+    break;
+
+  case FILE_SENT:
+    LOG_DEBUG("Enviado!");
+    close_file(h);
+    if ((h->cold->next_state == FINISHED) && (h->cold->keep_alive))
+      state_next_request(h, w, cfg);
+    else
+      c_handler_set_state(h, h->cold->next_state);
+    break;
+
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+
+/** Marca o prazo de 'h' na roda 'w', logo depois do accept().
+ *
+ *  Enquanto a request nao chega inteira vale o #cfg->request_timeout;
+ *  depois disso, o #cfg->idle_timeout.
+ */
+void state_deadline_start(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg)
+{
+  int timeout = (cfg->request_timeout > 0) ? cfg->request_timeout : cfg->idle_timeout;
+
+  h->last_active = w->now;
+
+  if (timeout > 0)
+    wheel_add(w, &(h->deadline), w->now + ((uint64_t)timeout * 1000));
+}
+
+
+/** O timer #h->deadline expirou. Decide se 'h' deve ser fechado ou se
+ *  ainda teve progresso a tempo - nesse caso o prazo e remarcado.
+ *
+ *  Em vez de remarcar o timer a cada recv()/send(), o motor de I/O so
+ *  atualiza #h->last_active; aqui descobrimos quanto falta de verdade.
+ *
+ *  @return 1 se 'h' estourou o prazo, 0 caso contrario.
+ */
+int state_deadline_expired(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg)
+{
+  int      timeout = cfg->idle_timeout;
+  uint64_t idle_ms;
+
+  if (h->state == HEADER_RECEIVING)
+  {
+    // Conexao persistente esperando a proxima request ha tempo demais
+    if ((h->cold->requests > 0) && (h->cold->request_size == 0))
+    {
+      LOG_DEBUG("Conexao persistente ociosa - fechando");
+      return 1;
+    }
+
+    if (cfg->request_timeout > 0)
+    {
+      if (h->cold->requests == 0)
+      {
+        LOG_DEBUG("Cliente demorou demais para mandar a request");
+        return 1;
+      }
+      // As proximas requests comecam a chegar depois do keep-alive:
+      // contamos a partir do ultimo pedaco recebido
+      timeout = cfg->request_timeout;
+    }
+  }
+
+  if (timeout <= 0)
+    return 0;
+
+  // Parado pelo controle de banda e culpa nossa, nao do cliente
+  if (h->waiting == 1)
+    h->last_active = w->now;
+
+  idle_ms = (uint64_t)timeout * 1000;
+  if ((w->now - h->last_active) >= idle_ms)
+  {
+    LOG_DEBUG("Cliente ficou parado tempo demais");
+    return 1;
+  }
+
+  wheel_add(w, &(h->deadline), h->last_active + idle_ms);
+  return 0;
+}
+
+
+/** Quantos bytes 'h' pode mandar agora, segundo #h->bucket e o limite
+ *  agregado da sua classe (#cfg->limiter).
+ *
+ *  So liberamos o envio quando os dois tem pelo menos uma fatia (ou o
+ *  que falta do arquivo, se for menos). Caso contrario 'h' para de
+ *  enviar e a roda 'w' o acorda quando a fatia estiver la - assim os
+ *  envios saem espalhados, a cada 1/BUCKET_HZ de segundo.
+ *
+ *  @note Depois de enviar, chamar state_sent() com o que foi enviado.
+ *  @return O numero de bytes que podem ser enviados, ou 0 se 'h' foi
+ *          colocado para esperar.
+ */
+int state_send_budget(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg)
+{
+  uint64_t want = bucket_slice(&(h->bucket));
+  uint64_t available = INT_MAX;
+  uint64_t wait_ms = 0;
+
+  if ((h->cold->output_sizeleft > 0) && (want > (uint64_t)h->cold->output_sizeleft))
+    want = h->cold->output_sizeleft;
+
+  // Com SO_MAX_PACING_RATE quem segura o cliente e o kernel
+  if (!h->paced)
+  {
+    bucket_refill(&(h->bucket), w->now);
+
+    available = bucket_available(&(h->bucket));
+    if (available < want)
+    {
+      wait_ms   = bucket_wait_ms(&(h->bucket), want);
+      available = 0;
+    }
+  }
+
+  // O cliente pode mandar - falta saber se a classe dele pode
+  if ((available > 0) && (h->tclass != NULL))
+  {
+    uint64_t class_available = limiter_request(cfg->limiter, h->tclass, want, w->now, &wait_ms);
+
+    if (class_available < available)
+      available = class_available;
+  }
+
+  if (available > 0)
+    return (available > INT_MAX) ? INT_MAX : (int)available;
+
+  LOG_DEBUG("Pausar o envio de arquivo para cliente %d", h->client);
+
+  wheel_add(w, &(h->wake), w->now + wait_ms);
+  h->waiting = 1;
+  h->cold->t_wait  = timer_now();
+  METRICS_ADD(waiting, 1);
+  METRICS_ADD(throttled, 1);
+  return 0;
+}
+
+
+/** O controle de banda liberou 'h' - o timer #h->wake venceu. */
+void state_woken(struct c_handler* h)
+{
+  h->waiting = 0;
+  h->cold->throttled_ns += timer_now() - h->cold->t_wait;
+  METRICS_ADD(waiting, -1);
+}
+
+
+/** 'h' acabou de enviar 'bytes' - gasta as fichas dele e as da classe. */
+void state_sent(struct c_handler* h, struct server_config* cfg, int bytes)
+{
+  METRICS_ADD(bytes_sent, bytes);
+
+  if (h->cold->t_first == 0)
+  {
+    h->cold->t_first = timer_now();
+    metrics_phase(PHASE_FIRST_BYTE, h->cold->t_first - h->cold->t_headers);
+  }
+
+  if (!h->paced)
+    bucket_consume(&(h->bucket), bytes);
+
+  if (h->tclass != NULL)
+    limiter_consume(cfg->limiter, h->tclass, bytes);
+}
+
+
+/** 'h' nao vai mais enviar nada: libera a sua parte do limite agregado
+ *  para as outras classes e devolve o arquivo ao cache.
+ */
+void state_release(struct c_handler* h, struct server_config* cfg)
+{
+  if (h->cold->fentry != NULL)
+  {
+    filecache_release(cfg->filecache, h->cold->fentry);
+    h->cold->fentry = NULL;
+  }
+
+  if (h->tclass == NULL)
+    return;
+
+  limiter_leave(cfg->limiter, h->tclass, timer_now_ms());
+  h->tclass = NULL;
+}
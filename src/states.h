@@ -0,0 +1,30 @@
+/**
+ * @file states.h
+ *
+ * Definicao dos estados do c_handler que nao dependem de I/O.
+ *
+ * Receber a request (HEADER_RECEIVING) e enviar o arquivo (FILE_SENDING)
+ * dependem de como o loop principal fala com o kernel - epoll ou
+ * io_uring. Todo o resto (analisar o pedido, checar o arquivo, montar o
+ * header...) e igual para qualquer motor e fica aqui.
+ */
+
+#ifndef STATES_H_DEFINED
+#define STATES_H_DEFINED
+
+#include "client.h"
+#include "config.h"
+
+
+int state_request_check(struct c_handler* h);
+int state_process(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg);
+
+void state_deadline_start(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg);
+int  state_deadline_expired(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg);
+int  state_send_budget(struct c_handler* h, struct timer_wheel* w, struct server_config* cfg);
+void state_woken(struct c_handler* h);
+void state_sent(struct c_handler* h, struct server_config* cfg, int bytes);
+void state_release(struct c_handler* h, struct server_config* cfg);
+
+
+#endif /* STATES_H_DEFINED */
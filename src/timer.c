@@ -1,57 +1,69 @@
 /** @file timer.c
  *
- *  Definition of the timer functions.
+ *  Definition of the clock and timer functions.
  */
 
-#include <stdio.h>
-#include <sys/time.h>
+#include <time.h>
 #include "timer.h"
 
 
-/** Uses clock_gettime() to mark the number of seconds and nanoseconds
- *  between the Epoch and now.
+/** The last time timer_update() was called by this thread, in ns -
+ *  0 until the first call. */
+static __thread int64_t timer_cached = 0;
+
+
+/** Reads CLOCK_MONOTONIC: nanoseconds since some unspecified point,
+ *  unaffected by changes to the system clock.
+ *
+ *  It's a vDSO call (no syscall), but still a few dozen ns - in the
+ *  event loops, prefer timer_now().
  */
-static int get_time (struct timeval* tv)
+int64_t timer_monotonic_ns (void)
 {
-  return gettimeofday(tv, NULL);
-}
+  struct timespec ts;
 
-float get_seconds (struct timeval* tv)
-{
-  int sec = tv->tv_sec;
-  float usec = tv->tv_usec / 1e6;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
 
-  return (sec + usec);
+  return ((int64_t)ts.tv_sec * TIMER_NS_PER_SEC) + ts.tv_nsec;
 }
 
-/** Returns the delta between the start and end of the timer.
+/** Same clock as timer_monotonic_ns(), in milliseconds.
  *
- *  @note If timer_start() and timer_stop() doesn't get called
- *        before this, the results are unpredictable.
+ *  That's the time base of the timer wheel (see wheel.h).
  */
-float timer_delta (struct timert* t)
+uint64_t timer_monotonic_ms (void)
 {
-  timersub (&(t->end), &(t->start), &(t->delta));
-
-  return get_seconds (&(t->delta));
+  return timer_ns_to_ms (timer_monotonic_ns ());
 }
 
-/** Records the current time as a start point.
+/** Reads the clock and caches it for this thread's timer_now().
+ *
+ *  Call it once per event loop iteration, right after waking up.
  *
- *  Remember to call timer_stop() to record the diff.
+ *  @return The new cached now, in ns.
  */
-int timer_start (struct timert* t)
+int64_t timer_update (void)
 {
-  return get_time (&(t->start));
+  timer_cached = timer_monotonic_ns ();
+
+  return timer_cached;
 }
 
-/** Records the current time as a stop point.
- *
- *  Remember to call timer_delta() to retrieve the timer diff.
+/** Returns the time cached by the last timer_update() of this thread, in
+ *  ns. If it was never called, reads the clock right now.
  */
-int timer_stop (struct timert* t)
+int64_t timer_now (void)
 {
-  return get_time (&(t->end));
-}
+  if (timer_cached == 0)
+    return timer_update ();
 
+  return timer_cached;
+}
 
+/** timer_now() in milliseconds - the unit of the timer wheel and of the
+ *  token buckets.
+ */
+uint64_t timer_now_ms (void)
+{
+  return timer_ns_to_ms (timer_now ());
+}
@@ -1,48 +1,39 @@
 /** @file timer.h
- *  Declaration of the timer structure and functions.
+ *  Declaration of the clock and timer functions.
  *
- *  Start the timer by calling timer_start() and set its delay
- *  by giving it to timer_set_delay().
- *  The main use of this module is to compare the timer (through timer_delta())
- *  with the delay (returned by timer_get_delay()). Remember to call
- *  timer_stop() often!
+ *  Every time in the server comes from CLOCK_MONOTONIC, as 64-bit
+ *  integer nanoseconds - it never jumps when NTP (or the admin) steps
+ *  the wall clock, and there's no float rounding on small deltas.
  *
- *  gettimeofday() is Unix, GNU/Linux and Mac OS X system-specific.
- *  The only portable function is time.h's clock(), but it isn't very precise.
- *  <a href="http://www.songho.ca/misc/timer/timer.html"> Here's the source </a>.
+ *  The event loops read the clock once per iteration with timer_update().
+ *  Everything else in that iteration (timeouts, throttling, the timer
+ *  wheel) uses the cached value from timer_now() / timer_now_ms(), which
+ *  costs nothing. The cache is per thread, so each worker has its own.
  */
 
 #ifndef TIMER_H_DEFINED
 #define TIMER_H_DEFINED
 
-#include <sys/time.h>
+#include <stdint.h>
 
 
-/* For more info, check 'man clock_gettime'
- *
- * The 'struct timeval' is defined like this:
- *
- *  struct timeval {
- *      time_t tv_sec;      <- seconds
- *      long   tv_nsec;     <- nanoseconds
- *  };
- *
- */
+#define TIMER_NS_PER_MS   1000000LL
+#define TIMER_NS_PER_SEC  1000000000LL
 
 
-/** The timer structure */
-struct timert
-{
-  struct timeval start; /**< The timer start point */
-  struct timeval end;   /**< The timer stop point */
-  struct timeval delta; /**< The difference between #start and #end */
-};
+int64_t  timer_monotonic_ns (void);
+uint64_t timer_monotonic_ms (void);
+
+int64_t  timer_update (void);
+int64_t  timer_now (void);
+uint64_t timer_now_ms (void);
 
 
-float timer_delta (struct timert* t);
-int   timer_start (struct timert* t);
-int   timer_stop (struct timert* t);
+/** 'ns' in whole milliseconds (rounded down). */
+static inline int64_t timer_ns_to_ms (int64_t ns)
+{
+  return ns / TIMER_NS_PER_MS;
+}
 
 
 #endif
-
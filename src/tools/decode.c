@@ -0,0 +1,182 @@
+/**
+ * @file decode.c
+ *
+ * Decodificador do access log binario (veja accesslog.h): le os
+ * segmentos escritos com --access-log e mostra um registro por linha,
+ * em texto ou em CSV.
+ *
+ * Pode ler um segmento que o servidor ainda esta escrevendo - so os
+ * registros contados em #accesslog_header.count aparecem.
+ *
+ * Uso: make decoder && ./bin/servw-decode [-c] segmento...
+ */
+
+#include <stdio.h>
+#include <string.h>     /* memcmp() strcmp()                         */
+#include <time.h>       /* gmtime_r() strftime()                     */
+#include <arpa/inet.h>  /* inet_ntop()                               */
+
+#include "../accesslog.h"
+#include "../http.h"
+
+
+/** O nome de cada um dos #http_methods */
+static const char* decode_methods[] =
+{
+  [GET_M]     = "GET",
+  [HEAD_M]    = "HEAD",
+  [POST_M]    = "POST",
+  [PUT_M]     = "PUT",
+  [OPTIONS_M] = "OPTIONS",
+  [DELETE_M]  = "DELETE",
+  [TRACE_M]   = "TRACE",
+  [CONNECT_M] = "CONNECT"
+};
+
+
+/** Mostra como usar o programa. */
+static void usage(void)
+{
+  printf("Usage: servw-decode [-c] segment...\n"
+         "\n"
+         "Prints the responses recorded in access log segments (servw --access-log),\n"
+         "one per line.\n"
+         "\n"
+         "  -c  CSV output, with a header line\n"
+         "  -h  Show this message\n");
+}
+
+
+/** O nome do metodo 'method', ou "-" se desconhecido. */
+static const char* decode_method(int method)
+{
+  if ((method < 0) || (method > CONNECT_M))
+    return "-";
+  return decode_methods[method];
+}
+
+
+/** Escreve 'ns' (desde 1970) em 'buf' como 2011-12-31T23:59:59.123456Z. */
+static void decode_time(uint64_t ns, char* buf, size_t size)
+{
+  time_t secs = ns / 1000000000ULL;
+  struct tm tm;
+  int n;
+
+  gmtime_r(&secs, &tm);
+  n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(buf + n, size - n, ".%06uZ", (unsigned)((ns % 1000000000ULL) / 1000));
+}
+
+
+/** Mostra 'r' como uma linha de texto. */
+static void decode_text(struct accesslog_record* r, const char* when, const char* addr)
+{
+  printf("%s:%u [%s] \"%s %.*s%s\" %u %llu %ums throttled=%ums%s\n",
+         addr, r->port, when, decode_method(r->method),
+         r->path_size, r->path, (r->flags & ACCESSLOG_PATH_CUT) ? "..." : "",
+         r->status, (unsigned long long)r->bytes, r->duration, r->throttled,
+         (r->flags & ACCESSLOG_ABORTED) ? " aborted" : "");
+}
+
+
+/** Mostra 'r' como uma linha de CSV - aspas no alvo viram aspas duplas. */
+static void decode_csv(struct accesslog_record* r, const char* when, const char* addr)
+{
+  int i;
+
+  printf("%s,%s,%u,%s,\"", when, addr, r->port, decode_method(r->method));
+  for (i = 0; i < r->path_size; i++)
+  {
+    if (r->path[i] == '"')
+      putchar('"');
+    putchar(r->path[i]);
+  }
+  printf("\",%u,%llu,%u,%u,%d,%d\n",
+         r->status, (unsigned long long)r->bytes, r->duration, r->throttled,
+         (r->flags & ACCESSLOG_ABORTED) ? 1 : 0,
+         (r->flags & ACCESSLOG_PATH_CUT) ? 1 : 0);
+}
+
+
+/** Mostra todos os registros do segmento 'name'.
+ *
+ *  @return 0 em sucesso, -1 se o arquivo nao pode ser lido ou nao e
+ *          um segmento.
+ */
+static int decode_segment(const char* name, int csv)
+{
+  struct accesslog_header header;
+  struct accesslog_record r;
+  char when[64];
+  char addr[INET_ADDRSTRLEN];
+  uint64_t i;
+  FILE* f;
+
+  f = fopen(name, "rb");
+  if (f == NULL)
+  {
+    perror(name);
+    return -1;
+  }
+
+  if ((fread(&header, sizeof(header), 1, f) != 1) ||
+      (memcmp(header.magic, ACCESSLOG_MAGIC, sizeof(header.magic)) != 0) ||
+      (header.version != ACCESSLOG_VERSION) ||
+      (header.record_size != ACCESSLOG_RECORD_SIZE))
+  {
+    fprintf(stderr, "%s: not an access log segment (version %d)\n", name, ACCESSLOG_VERSION);
+    fclose(f);
+    return -1;
+  }
+
+  for (i = 0; i < header.count; i++)
+  {
+    if (fread(&r, sizeof(r), 1, f) != 1)
+      break;
+
+    decode_time(r.time, when, sizeof(when));
+    if (r.addr == 0)
+      strcpy(addr, "-");
+    else
+      inet_ntop(AF_INET, &(r.addr), addr, sizeof(addr));
+
+    if (csv)
+      decode_csv(&r, when, addr);
+    else
+      decode_text(&r, when, addr);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+  int csv = 0;
+  int failed = 0;
+  int first = 1;
+  int i;
+
+  if ((argc > 1) && (strcmp(argv[1], "-c") == 0))
+  {
+    csv = 1;
+    first = 2;
+  }
+
+  if ((first >= argc) || (strcmp(argv[first], "-h") == 0))
+  {
+    usage();
+    return 1;
+  }
+
+  if (csv)
+    printf("time,addr,port,method,path,status,bytes,duration_ms,throttled_ms,aborted,path_cut\n");
+
+  for (i = first; i < argc; i++)
+    if (decode_segment(argv[i], csv) == -1)
+      failed = 1;
+
+  return failed;
+}
@@ -0,0 +1,881 @@
+/**
+ * @file uring.c
+ *
+ * Implementacao do motor de I/O baseado em io_uring.
+ *
+ * Cada c_handler tem no maximo uma 'cadeia' de operacoes no kernel por
+ * vez: um recv() enquanto recebe a request, um read() encadeado
+ * (IOSQE_IO_LINK) com um send() enquanto envia o arquivo. Enquanto
+ * espera o controle de banda liberar mais bytes nao ha nada no kernel:
+ * quem acorda o handler e a roda de timers (wheel.h), que tambem da o
+ * timeout de cada io_uring_enter().
+ * Todas as SQEs preparadas numa volta do loop vao para o kernel numa
+ * unica chamada de io_uring_enter().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>     /* malloc() free()                           */
+#include <string.h>     /* memset()                                  */
+#include <errno.h>      /* errno                                     */
+#include <stdint.h>     /* uint64_t uintptr_t                        */
+#include <assert.h>     /* assert()                                  */
+#include <unistd.h>     /* close() syscall()                         */
+#include <sys/mman.h>   /* mmap() munmap()                           */
+#include <sys/syscall.h>/* __NR_io_uring_setup __NR_io_uring_enter   */
+#include <sys/socket.h> /* MSG_NOSIGNAL shutdown() struct msghdr     */
+#include <sys/uio.h>    /* struct iovec                              */
+#include <netinet/in.h> /* struct sockaddr_in                        */
+#include <signal.h>     /* _NSIG                                     */
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "client.h"
+#include "server.h"
+#include "states.h"
+#include "macros.h"
+#include "timer.h"
+#include "metrics.h"
+
+
+/** Tipos de operacao que mandamos ao kernel. Possuem prefixo 'URING_OP_'.
+ *
+ *  Ficam nos bits mais baixos do user_data de cada SQE - o resto e o
+ *  endereco do c_handler, que o malloc() sempre alinha.
+ */
+enum uring_ops
+{
+  URING_OP_ACCEPT, URING_OP_RECV, URING_OP_READ, URING_OP_SEND
+};
+
+#define URING_OP_MASK  7
+
+/** Os aneis de submissao e de completion, mapeados do kernel. */
+struct uring
+{
+  int fd;                     /**< Retornado por io_uring_setup() */
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void   *sq_ptr;
+  size_t  sq_size;
+  void   *cq_ptr;
+  size_t  cq_size;
+  size_t  sqes_size;
+
+  unsigned sqe_tail;          /**< SQEs preparadas, ainda nao publicadas ao kernel */
+  unsigned to_submit;         /**< Quantas SQEs a proxima io_uring_enter() vai levar */
+};
+
+/** Onde um accept() no kernel deixa o endereco do cliente. O ponteiro
+ *  vai no user_data, entao os 3 bits de baixo tem que estar livres.
+ */
+struct uring_accept
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int       busy;             /**< Ha um accept() no kernel usando esse */
+} __attribute__((aligned(8)));
+
+/** O que o c_handler precisa guardar so quando servido pelo io_uring. */
+struct uring_io
+{
+  char buff[URING_BUFFER_SIZE]; /**< Pedaco do arquivo sendo enviado */
+  const char* data;             /**< De onde o send() tira o pedaco: #buff ou o mmap() do arquivo */
+  const char* map;              /**< Com --mmap: o resto do pedaco, depois de #head bytes de #data */
+  int  head;                    /**< Quanto do pedaco vem de #data quando ha #map */
+  int  len;                     /**< Tamanho do pedaco inteiro */
+  int  read;                    /**< Quanto do pedaco vem do read() encadeado */
+  int  sent;                    /**< Quanto do pedaco ja foi enviado */
+  int  inflight;                /**< Quantas operacoes do handler estao no kernel */
+  struct iovec  iov[2];         /**< O sendmsg() de #data e #map */
+  struct msghdr msg;
+};
+
+
+static int ring_setup(struct uring* r, unsigned entries)
+{
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(p));
+
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd == -1)
+    return -1;
+
+  // Sem IORING_ENTER_EXT_ARG (kernel < 5.11) nao da pra esperar com timeout
+  if (!(p.features & IORING_FEAT_EXT_ARG))
+  {
+    errno = ENOSYS;
+    goto error;
+  }
+
+  r->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size   = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (r->cq_size > r->sq_size)
+      r->sq_size = r->cq_size;
+    r->cq_size = r->sq_size;
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+  {
+    r->sq_ptr = NULL;
+    goto error;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else
+  {
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED)
+    {
+      r->cq_ptr = NULL;
+      goto error;
+    }
+  }
+
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto error;
+
+  r->sq_head    = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+  r->sq_tail    = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+  r->sq_mask    = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_entries = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_entries);
+  r->sq_array   = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+
+  r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes    = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+
+  r->sqe_tail = *(r->sq_tail);
+  return 0;
+
+error:
+  // Desfaz so o que chegou a ser mapeado (r comecou zerada)
+  if ((r->cq_ptr != NULL) && (r->cq_ptr != r->sq_ptr))
+    munmap(r->cq_ptr, r->cq_size);
+  if (r->sq_ptr != NULL)
+    munmap(r->sq_ptr, r->sq_size);
+  close(r->fd);
+  return -1;
+}
+
+
+/** Quantas SQEs ainda cabem no anel de submissao. */
+static unsigned ring_space(struct uring* r)
+{
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  return *(r->sq_entries) - (r->sqe_tail - head);
+}
+
+
+/** Publica as SQEs preparadas e, se 'wait_nr' > 0, dorme ate que haja
+ *  pelo menos 'wait_nr' completions - ou ate passarem 'timeout_ms'
+ *  milissegundos (-1 espera para sempre).
+ *
+ *  @return 0 em sucesso, -1 em caso de erro (errno e setado).
+ */
+static int ring_submit(struct uring* r, unsigned wait_nr, int timeout_ms)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = 0;
+  int retval;
+
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+  memset(&arg, 0, sizeof(arg));
+  if (wait_nr > 0)
+  {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0)
+    {
+      ts.tv_sec  = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+      arg.sigmask_sz = _NSIG / 8;
+      arg.ts         = (uintptr_t)&ts;
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+  }
+
+  retval = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr, flags,
+                   (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                   (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+  if (retval == -1)
+  {
+    if ((errno == EINTR) || (errno == ETIME))
+      return 0;
+    return -1;
+  }
+
+  r->to_submit -= retval;
+  return 0;
+}
+
+
+/** Pega a proxima SQE livre, ja zerada. Se o anel estiver cheio,
+ *  submete o que ja foi preparado para abrir espaco.
+ *
+ *  @return A SQE, ou NULL caso o kernel nao tenha liberado espaco.
+ */
+static struct io_uring_sqe* ring_get_sqe(struct uring* r)
+{
+  struct io_uring_sqe* sqe;
+  unsigned index;
+
+  if (ring_space(r) == 0)
+  {
+    ring_submit(r, 0, -1);
+    if (ring_space(r) == 0)
+      return NULL;
+  }
+
+  index = r->sqe_tail & *(r->sq_mask);
+  r->sq_array[index] = index;
+
+  sqe = &(r->sqes[index]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+  r->sqe_tail++;
+  r->to_submit++;
+  return sqe;
+}
+
+
+/** @return A proxima completion, ou NULL se nao houver nenhuma. */
+static struct io_uring_cqe* ring_peek(struct uring* r)
+{
+  unsigned head = *(r->cq_head);
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return &(r->cqes[head & *(r->cq_mask)]);
+}
+
+
+/** Devolve ao kernel a completion retornada por ring_peek(). */
+static void ring_seen(struct uring* r)
+{
+  __atomic_store_n(r->cq_head, *(r->cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+
+static void ring_exit(struct uring* r)
+{
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_size);
+  munmap(r->sq_ptr, r->sq_size);
+  close(r->fd);
+}
+
+
+static uint64_t uring_data(struct c_handler* h, int op)
+{
+  return ((uint64_t)(uintptr_t)h) | op;
+}
+
+
+/** Deixa um accept() no kernel, que guarda o endereco do cliente em 'a'. */
+static int uring_queue_accept(struct uring* r, int listener, struct uring_accept* a)
+{
+  struct io_uring_sqe* sqe = ring_get_sqe(r);
+
+  if (sqe == NULL)
+  {
+    LOG_ERROR("Erro em uring_queue_accept() - anel cheio");
+    return -1;
+  }
+
+  a->addrlen = sizeof(a->addr);
+  a->busy    = 1;
+
+  sqe->opcode    = IORING_OP_ACCEPT;
+  sqe->fd        = listener;
+  sqe->addr      = (uintptr_t)&(a->addr);
+  sqe->addr2     = (uintptr_t)&(a->addrlen);
+  sqe->user_data = ((uint64_t)(uintptr_t)a) | URING_OP_ACCEPT;
+  return 0;
+}
+
+
+/** Deixa ate URING_ACCEPT_BATCH accept() esperando no kernel, sem
+ *  passar do que ainda cabe em 'l'.
+ *
+ *  Uma rajada de conexoes volta num lote so de completions; e cheio,
+ *  nenhum accept() fica pendente - as conexoes esperam no backlog ate
+ *  algum cliente sair.
+ *
+ *  @param accepts   Os URING_ACCEPT_BATCH enderecos, um por accept().
+ *  @param accepting Quantos accept() ja estao no kernel - atualizado.
+ */
+static void uring_fill_accepts(struct uring* r, struct c_handler_list* l, int listener,
+                               struct uring_accept* accepts, int* accepting)
+{
+  int i = 0;
+
+  while ((*accepting < URING_ACCEPT_BATCH) && ((l->current + *accepting) < l->max))
+  {
+    while (accepts[i].busy)
+      i++;
+
+    if (uring_queue_accept(r, listener, &(accepts[i])) == -1)
+      return;
+
+    (*accepting)++;
+  }
+}
+
+
+/** Pede ao kernel o proximo pedaco da request, direto em #h->buf->request.
+ *
+ *  @return 0 em sucesso, -1 se a request nao cabe mais no buffer ou
+ *          se o anel estiver cheio.
+ */
+static int uring_queue_recv(struct uring* r, struct c_handler* h)
+{
+  struct uring_io* io = h->engine;
+  struct io_uring_sqe* sqe;
+  int size = (BUFFER_SIZE * 3) - 1 - h->cold->request_size;
+
+  if (size <= 0)
+    return -1;
+
+  sqe = ring_get_sqe(r);
+  if (sqe == NULL)
+    return -1;
+
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = h->client;
+  sqe->addr      = (uintptr_t)(h->buf->request + h->cold->request_size);
+  sqe->len       = size;
+  sqe->user_data = uring_data(h, URING_OP_RECV);
+  io->inflight++;
+  return 0;
+}
+
+
+/** Envia o que falta do pedaco atual: de #io->data, ou de #io->data e
+ *  #io->map num sendmsg() so.
+ *
+ *  @return 0 em sucesso, -1 se o anel estiver cheio.
+ */
+static int uring_queue_send(struct uring* r, struct c_handler* h)
+{
+  struct uring_io* io = h->engine;
+  struct io_uring_sqe* sqe = ring_get_sqe(r);
+  int skip;
+  int n = 0;
+
+  if (sqe == NULL)
+    return -1;
+
+  sqe->fd        = h->client;
+  sqe->msg_flags = MSG_NOSIGNAL;
+
+  if (io->map == NULL)
+  {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr   = (uintptr_t)(io->data + io->sent);
+    sqe->len    = io->len - io->sent;
+  }
+  else
+  {
+    if (io->sent < io->head)
+    {
+      io->iov[n].iov_base = (void*)(io->data + io->sent);
+      io->iov[n].iov_len  = io->head - io->sent;
+      n++;
+    }
+
+    skip = (io->sent > io->head) ? (io->sent - io->head) : 0;
+    io->iov[n].iov_base = (void*)(io->map + skip);
+    io->iov[n].iov_len  = io->len - io->head - skip;
+    n++;
+
+    memset(&(io->msg), 0, sizeof(io->msg));
+    io->msg.msg_iov    = io->iov;
+    io->msg.msg_iovlen = n;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr   = (uintptr_t)&(io->msg);
+    sqe->len    = 1;
+  }
+
+  sqe->user_data = uring_data(h, URING_OP_SEND);
+  io->inflight++;
+  return 0;
+}
+
+
+/** Prepara o proximo pedaco da resposta de 'h', respeitando #h->bucket.
+ *
+ *  Arquivos de verdade sao lidos por um read() encadeado com o send(),
+ *  entao os dois vao juntos na mesma submissao. O que falta do header
+ *  (e a pagina de erro, ou a resposta pronta do cache) ja esta em
+ *  memoria: e copiado para a frente de #io->buff e o read() preenche o
+ *  resto - header e comeco do arquivo saem no mesmo send(). Com --mmap
+ *  nem o read() existe: o send() sai direto do mapeamento, e o header
+ *  vai na frente num sendmsg(). Nada do mapeamento e copiado - se o
+ *  arquivo encolher, o kernel responde EFAULT em vez de um SIGBUS aqui.
+ *
+ *  Se o balde nao tem fichas para uma fatia, agenda a volta de 'h' na
+ *  roda 'w' em vez do read()/send().
+ *
+ *  @return 0 se alguma operacao foi submetida (ou 'h' esta esperando),
+ *          1 se o arquivo ja foi todo enviado e -1 em caso de erro.
+ */
+static int uring_queue_chunk(struct uring* r, struct server_config* cfg,
+                             struct timer_wheel* w, struct c_handler* h)
+{
+  struct uring_io* io = h->engine;
+  struct io_uring_sqe* sqe;
+  int   size;
+  int   copied;
+
+  if (h->cold->output_sizesent >= h->cold->output_size)
+  {
+    c_handler_set_state(h, FILE_SENT);
+    return 1;
+  }
+
+  // Sem fichas no balde, a roda de timers acorda o cliente depois
+  size = state_send_budget(h, w, cfg);
+  if (size == 0)
+    return 0;
+
+  if (size > h->cold->output_sizeleft)
+    size = h->cold->output_sizeleft;
+  if (size > URING_BUFFER_SIZE)
+    size = URING_BUFFER_SIZE;
+
+  // As fichas sao gastas ja na submissao, para nao pedir mais do que
+  // o balde tem enquanto o send() estiver no kernel
+  state_sent(h, cfg, size);
+
+  io->len  = size;
+  io->sent = 0;
+  io->data = io->buff;
+  io->map  = NULL;
+
+  // Pedacos em memoria: so eles, ou a frente do pedaco do arquivo
+  copied = copy_parts_chunk(h, io->buff, size);
+  if (copied == size)
+    return uring_queue_send(r, h);
+
+  // Arquivo mapeado (--mmap): o send() le direto do mapeamento - no
+  // pedaco que leva o header, os dois vao juntos num sendmsg()
+  if (h->cold->output_map != NULL)
+  {
+    if (copied == 0)
+      io->data = map_chunk(h, size);
+    else
+    {
+      io->head = copied;
+      io->map  = map_chunk(h, size - copied);
+    }
+
+    return uring_queue_send(r, h);
+  }
+
+  // O resto e o arquivo, sempre por fd (open_file_fd()) - nunca FILE*
+  assert(h->cold->output_fd != -1);
+
+  // read() e send() tem que ir na mesma submissao para o link valer
+  if (ring_space(r) < 2)
+    ring_submit(r, 0, -1);
+  if (ring_space(r) < 2)
+    return -1;
+
+  io->read = size - copied;
+
+  sqe = ring_get_sqe(r);
+  sqe->opcode    = IORING_OP_READ;
+  sqe->fd        = h->cold->output_fd;
+  sqe->addr      = (uintptr_t)(io->buff + copied);
+  sqe->len       = io->read;
+  sqe->off       = h->cold->output_sizesent + copied - h->cold->parts_size;
+  sqe->flags     = IOSQE_IO_LINK;
+  sqe->user_data = uring_data(h, URING_OP_READ);
+  io->inflight++;
+
+  return uring_queue_send(r, h);
+}
+
+
+/** Libera tudo o que pertence a 'h'. So pode ser chamada quando nao
+ *  houver mais nenhuma operacao de 'h' no kernel.
+ */
+static void uring_finish(struct server_config* cfg, struct c_handler_list* l, struct c_handler* h)
+{
+  close_file(h);
+  state_release(h, cfg);
+  close(h->client);
+
+  wheel_del(&(l->wheel), &(h->wake));
+  wheel_del(&(l->wheel), &(h->deadline));
+  c_handler_remove(h, l);
+
+  free(h->engine);
+  h->engine = NULL;
+  c_handler_exit(h, l);
+
+  LOG_DEBUG("Cliente desconectou");
+}
+
+
+/** Faz a maquina de estados de 'h' andar ate precisar esperar por
+ *  alguma operacao no kernel.
+ */
+static void uring_advance(struct uring* r, struct server_config* cfg,
+                          struct c_handler_list* l, struct c_handler* h)
+{
+  struct uring_io* io = h->engine;
+  int retval;
+
+  while (1)
+  {
+    switch (h->state)
+    {
+    case HEADER_RECEIVING:
+      // O recv() fica no kernel apontando para #h->buf->request, entao
+      // aqui os buffers ficam com o cliente mesmo entre requests
+      retval = c_handler_get_buffers(h, l);
+      if (retval == 0)
+        retval = uring_queue_recv(r, h);
+      if (retval == -1)
+      {
+        LOG_DEBUG("Erro de conexao com cliente!");
+        c_handler_set_state(h, FINISHED);
+        break;
+      }
+      return;
+
+    case FILE_SENDING:
+      retval = uring_queue_chunk(r, cfg, &(l->wheel), h);
+      if (retval == -1)
+      {
+        LOG_WARN("Erro na leitura do arquivo!");
+        c_handler_set_state(h, FINISHED);
+        break;
+      }
+      if (retval == 1)
+        break;
+      return;
+
+    case BODY_RECEIVING:
+    case PUT_CHECK_FILE:
+      // PUT ainda nao foi implementado - sem nenhuma operacao no
+      // kernel o cliente ficaria preso para sempre
+      c_handler_set_state(h, FINISHED);
+      break;
+
+    case FINISHED:
+      if (io->inflight == 0)
+        uring_finish(cfg, l, h);
+      return;
+
+    default:
+      state_process(h, &(l->wheel), cfg);
+      break;
+    }
+  }
+}
+
+
+/** Um novo cliente chegou, vindo de 'a' (ou o accept() falhou). */
+static void uring_accept_done(struct uring* r, struct server_config* cfg,
+                              struct c_handler_list* l, struct uring_accept* a, int res)
+{
+  struct c_handler* handler = NULL;
+  int retval;
+
+  a->busy = 0;
+
+  if (res < 0)
+  {
+    if ((res != -EAGAIN) && (res != -EINTR))
+    {
+      errno = -res;
+      LOG_PERROR("Erro em accept()");
+    }
+    return;
+  }
+
+  retval = c_handler_init(&handler, l, res, &(a->addr), cfg->bandwidth, cfg->burst, cfg->kernel_pacing);
+  if (retval == -1)
+  {
+    LOG_PERROR("Erro em c_handler_init()");
+    close(res);
+    return;
+  }
+
+  retval = c_handler_add(handler, l);
+  if (retval == -1)
+  {
+    LOG_ERROR("Erro em c_handler_add()");
+    close(res);
+    c_handler_exit(handler, l);
+    return;
+  }
+
+  handler->engine = malloc(sizeof(struct uring_io));
+  if (handler->engine == NULL)
+  {
+    LOG_PERROR("Erro em uring_accept_done() - malloc()");
+    c_handler_remove(handler, l);
+    close(res);
+    c_handler_exit(handler, l);
+    return;
+  }
+  memset(handler->engine, 0, sizeof(struct uring_io));
+
+  state_deadline_start(handler, &(l->wheel), cfg);
+
+  LOG_DEBUG("*** Nova conexao de cliente aceita! ***");
+  METRICS_ADD(accepts, 1);
+
+  uring_advance(r, cfg, l, handler);
+}
+
+
+/** Trata o resultado 'res' da operacao descrita por 'user_data'. */
+static void uring_complete(struct uring* r, struct server_config* cfg,
+                           struct c_handler_list* l, uint64_t user_data, int res)
+{
+  struct c_handler* h = (struct c_handler*)(uintptr_t)(user_data & ~((uint64_t)URING_OP_MASK));
+  struct uring_io* io;
+  int op = user_data & URING_OP_MASK;
+
+  if (op == URING_OP_ACCEPT)
+  {
+    uring_accept_done(r, cfg, l, (struct uring_accept*)h, res);
+    return;
+  }
+
+  io = h->engine;
+  io->inflight--;
+
+  // Ja decidimos fechar - so esperamos o kernel devolver tudo
+  if (h->state == FINISHED)
+  {
+    uring_advance(r, cfg, l, h);
+    return;
+  }
+
+  switch (op)
+  {
+  case URING_OP_RECV:
+    if (res < 0)
+    {
+      LOG_DEBUG("Erro de conexao com cliente!");
+      c_handler_set_state(h, FINISHED);
+      break;
+    }
+    if (res == 0)
+    {
+      LOG_DEBUG("Cliente desconectou");
+      c_handler_set_state(h, FINISHED);
+      break;
+    }
+    h->last_active   = l->wheel.now;
+    h->cold->request_size += res;
+    h->buf->request[h->cold->request_size] = '\0';
+    state_request_check(h);
+    break;
+
+  case URING_OP_READ:
+    if (res != io->read)
+    {
+      LOG_WARN("Erro na leitura do arquivo!");
+      c_handler_set_state(h, FINISHED);
+    }
+    // O send() encadeado chega em seguida
+    return;
+
+  case URING_OP_SEND:
+    if (res < 0)
+    {
+      if (res != -ECANCELED)
+        LOG_DEBUG("Erro de conexao!");
+      c_handler_set_state(h, FINISHED);
+      break;
+    }
+
+    h->last_active = l->wheel.now;
+
+    io->sent += res;
+    if (io->sent < io->len)
+    {
+      if (uring_queue_send(r, h) == -1)
+        c_handler_set_state(h, FINISHED);
+      break;
+    }
+
+    h->cold->output_sizesent += io->len;
+    h->cold->output_sizeleft -= io->len;
+    break;
+  }
+
+  // Um send() parcial ja deixou outra operacao no kernel
+  if ((h->state != FINISHED) && (io->inflight > 0))
+    return;
+
+  uring_advance(r, cfg, l, h);
+}
+
+
+/** O que uring_expire() precisa para fazer um handler andar. */
+struct uring_expire_arg
+{
+  struct uring*          ring;
+  struct server_config*  cfg;
+  struct c_handler_list* list;
+};
+
+
+/** Chamada pela roda de timers para cada timer de um handler que expira.
+ *
+ *  Se o controle de banda liberou o cliente (#wake), o proximo pedaco
+ *  vai para o kernel. Se ele estourou o prazo (#deadline), o socket e
+ *  derrubado com shutdown() - o que estiver no kernel volta com erro e
+ *  o handler e liberado quando a ultima completion chegar.
+ */
+static void uring_expire(struct wheel_timer* t, void* arg)
+{
+  struct uring_expire_arg* ea = arg;
+  struct c_handler* h = t->data;
+  struct uring_io* io = h->engine;
+
+  METRICS_ADD(timers, 1);
+
+  if (t == &(h->wake))
+  {
+    LOG_DEBUG("Continuar a enviar arquivo para cliente %d", h->client);
+    state_woken(h);
+  }
+  else
+  {
+    if (!state_deadline_expired(h, &(ea->list->wheel), ea->cfg))
+      return;
+
+    c_handler_set_state(h, FINISHED);
+    if (io->inflight > 0)
+      shutdown(h->client, SHUT_RDWR);
+  }
+
+  uring_advance(ea->ring, ea->cfg, ea->list, h);
+}
+
+
+/** O loop principal usando io_uring como motor de I/O.
+ *
+ *  Aceita clientes em 'listener' e os serve de acordo com 'cfg'.
+ *  So retorna caso o kernel nao suporte (ou nao permita) io_uring -
+ *  nesse caso quem chamou deve usar event_run().
+ *
+ *  @return -1 caso nao consiga inicializar o io_uring.
+ */
+int uring_run(struct server_config* cfg, int listener)
+{
+  struct uring ring;
+  struct io_uring_cqe* cqe;
+  struct c_handler_list handler_list;
+  struct uring_expire_arg expire_arg;
+  struct uring_accept accepts[URING_ACCEPT_BATCH];
+  unsigned entries = URING_MIN_ENTRIES;
+  uint64_t user_data;
+  int accepting = 0;
+  int res;
+
+  // Cada cliente tem no maximo read() + send() no kernel, mais os accept()
+  while ((entries < 4096) && (entries < (unsigned)(cfg->max_clients * 2 + URING_ACCEPT_BATCH)))
+    entries <<= 1;
+
+  if (ring_setup(&ring, entries) == -1)
+  {
+    perror("Erro em io_uring_setup()");
+    return -1;
+  }
+
+  if (c_handler_list_init(&handler_list, cfg->max_clients) == -1)
+  {
+    perror("Erro em c_handler_list_init()");
+    ring_exit(&ring);
+    return -1;
+  }
+
+  // Quem espera agora e o kernel - o listener nao precisa ser nao-bloqueante.
+  // Fica por ultimo: se algo antes falhar, o epoll recebe o listener como
+  // estava
+  if (socket_set_blocking(listener) == -1)
+  {
+    ring_exit(&ring);
+    return -1;
+  }
+
+  expire_arg.ring = &ring;
+  expire_arg.cfg  = cfg;
+  expire_arg.list = &handler_list;
+
+  memset(accepts, 0, sizeof(accepts));
+
+  uring_fill_accepts(&ring, &handler_list, listener, accepts, &accepting);
+
+  LOG_WRITE("Inicializacao completa! (io_uring)");
+
+  /* Main Loop */
+  while (1)
+  {
+    // Dormimos ate alguma completion ou ate o proximo timer da roda
+    if (ring_submit(&ring, 1, wheel_next_timeout(&(handler_list.wheel))) == -1)
+      perror("Erro em io_uring_enter()");
+    METRICS_ADD(iterations, 1);
+
+    /* Le o relogio (uma vez so nessa volta) e acorda quem tem timer vencido */
+    wheel_advance(&(handler_list.wheel), timer_ns_to_ms(timer_update()), uring_expire, &expire_arg);
+
+    while ((cqe = ring_peek(&ring)) != NULL)
+    {
+      user_data = cqe->user_data;
+      res       = cqe->res;
+      ring_seen(&ring);
+      METRICS_ADD(events, 1);
+
+      if ((user_data & URING_OP_MASK) == URING_OP_ACCEPT)
+        accepting--;
+
+      uring_complete(&ring, cfg, &handler_list, user_data, res);
+    }
+
+    // Repoe os accept() que voltaram, se ainda couber alguem
+    uring_fill_accepts(&ring, &handler_list, listener, accepts, &accepting);
+  }
+
+  ring_exit(&ring);
+  return 0;
+}
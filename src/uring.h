@@ -0,0 +1,36 @@
+/**
+ * @file uring.h
+ *
+ * Definicao do motor de I/O baseado em io_uring.
+ *
+ * Em vez de esperar o kernel dizer que um socket esta pronto e entao
+ * chamar recv()/fread()/send() um por um, o io_uring recebe os pedidos
+ * de accept, recv, leitura do arquivo e send em lote (SQEs) e devolve
+ * os resultados (CQEs). A maquina de estados do c_handler anda a cada
+ * completion.
+ *
+ * Usamos as syscalls diretamente (io_uring_setup() e io_uring_enter()),
+ * sem depender da liburing.
+ */
+
+#ifndef URING_H_DEFINED
+#define URING_H_DEFINED
+
+#include "config.h"
+
+
+/** Quanto de arquivo pedimos por leitura/envio - bem maior que BUFFER_SIZE,
+ *  ja que aqui cada pedaco custa uma SQE e nao uma syscall. */
+#define URING_BUFFER_SIZE  16384
+
+/** Minimo de entradas na fila de submissao */
+#define URING_MIN_ENTRIES  64
+
+/** Quantos accept() deixamos esperando no kernel ao mesmo tempo */
+#define URING_ACCEPT_BATCH  16
+
+
+int uring_run(struct server_config* cfg, int listener);
+
+
+#endif /* URING_H_DEFINED */
@@ -0,0 +1,233 @@
+/**
+ * @file wheel.c
+ *
+ * Implementacao da roda de timers hierarquica.
+ */
+
+#include <stddef.h>     /* NULL                                      */
+
+#include "wheel.h"
+
+
+/** Inicializa a roda 'w', comecando no instante 'now' (em ms). */
+void wheel_init(struct timer_wheel* w, uint64_t now)
+{
+  int i, j;
+
+  w->now   = now;
+  w->count = 0;
+
+  for (i = 0; i < WHEEL_LEVELS; i++)
+  {
+    w->level_count[i] = 0;
+    for (j = 0; j < WHEEL_SIZE; j++)
+    {
+      w->slots[i][j].next = &(w->slots[i][j]);
+      w->slots[i][j].prev = &(w->slots[i][j]);
+    }
+  }
+}
+
+
+/** Prepara o timer 't' (nao agendado) que, ao expirar, acorda 'data'. */
+void wheel_timer_init(struct wheel_timer* t, void* data)
+{
+  t->next    = NULL;
+  t->prev    = NULL;
+  t->expires = 0;
+  t->level   = 0;
+  t->data    = data;
+}
+
+
+/** Diz se o timer 't' esta agendado. */
+int wheel_pending(struct wheel_timer* t)
+{
+  return (t->prev != NULL);
+}
+
+
+/** Em qual nivel fica um timer que expira daqui a 'delta' ms. */
+static int wheel_level(uint64_t delta)
+{
+  int level = 0;
+
+  while ((level < (WHEEL_LEVELS - 1)) && (delta >= (1ULL << (WHEEL_BITS * (level + 1)))))
+    level++;
+
+  return level;
+}
+
+
+/** Coloca 't' na posicao certa, sem mexer em #timer_wheel.count. */
+static void wheel_insert(struct timer_wheel* w, struct wheel_timer* t)
+{
+  struct wheel_timer* head;
+  int level = wheel_level(t->expires - w->now);
+  int index = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+  head = &(w->slots[level][index]);
+
+  t->level = level;
+  t->next  = head;
+  t->prev  = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+
+  w->level_count[level]++;
+}
+
+
+/** Tira 't' da sua lista, sem mexer em #timer_wheel.count. */
+static void wheel_unlink(struct timer_wheel* w, struct wheel_timer* t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+
+  w->level_count[t->level]--;
+}
+
+
+/** Agenda 't' para expirar em 'expires' (ms, mesma base de #timer_wheel.now).
+ *
+ *  Se 't' ja estava agendado, ele e reagendado. Prazos no passado
+ *  expiram no proximo tick; prazos alem de WHEEL_MAX_DELAY sao
+ *  encurtados.
+ */
+void wheel_add(struct timer_wheel* w, struct wheel_timer* t, uint64_t expires)
+{
+  if (wheel_pending(t))
+    wheel_del(w, t);
+
+  if (expires <= w->now)
+    expires = w->now + 1;
+
+  if ((expires - w->now) > WHEEL_MAX_DELAY)
+    expires = w->now + WHEEL_MAX_DELAY;
+
+  t->expires = expires;
+  wheel_insert(w, t);
+  w->count++;
+}
+
+
+/** Cancela 't'. Nao faz nada se ele nao estiver agendado. */
+void wheel_del(struct timer_wheel* w, struct wheel_timer* t)
+{
+  if (!wheel_pending(t))
+    return;
+
+  wheel_unlink(w, t);
+  w->count--;
+}
+
+
+/** Derrama a posicao 'index' do nivel 'level' nos niveis de baixo. */
+static void wheel_cascade(struct timer_wheel* w, int level, int index)
+{
+  struct wheel_timer* head = &(w->slots[level][index]);
+
+  while (head->next != head)
+  {
+    struct wheel_timer* t = head->next;
+
+    wheel_unlink(w, t);
+    wheel_insert(w, t);
+  }
+}
+
+
+/** Anda a roda ate 'now' (em ms), chamando 'expire' para cada timer
+ *  vencido.
+ *
+ *  O timer ja esta fora da roda quando 'expire' e chamada, entao ela
+ *  pode reagenda-lo ou cancelar/agendar qualquer outro timer.
+ */
+void wheel_advance(struct timer_wheel* w, uint64_t now, wheel_callback expire, void* arg)
+{
+  while (w->now < now)
+  {
+    struct wheel_timer* head;
+    int level;
+
+    if (w->count == 0)
+    {
+      w->now = now;
+      break;
+    }
+
+    // Nada no primeiro nivel: pula direto para o fim da volta,
+    // onde o proximo nivel vai ser derramado.
+    if (w->level_count[0] == 0)
+    {
+      uint64_t turn = w->now | WHEEL_MASK;
+
+      if (turn >= now)
+      {
+        w->now = now;
+        break;
+      }
+      w->now = turn;
+    }
+
+    w->now++;
+
+    for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+      int index = (w->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK;
+      if (index != 0)
+        break;
+
+      wheel_cascade(w, level, (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    }
+
+    head = &(w->slots[0][w->now & WHEEL_MASK]);
+    while (head->next != head)
+    {
+      struct wheel_timer* t = head->next;
+
+      wheel_del(w, t);
+      expire(t, arg);
+    }
+  }
+}
+
+
+/** Quantos ms faltam para o proximo timer da roda expirar.
+ *
+ *  Pode acordar antes da hora (quando um nivel de cima precisa ser
+ *  derramado), nunca depois.
+ *
+ *  @return Os ms ate o proximo evento, ou -1 se nao ha timers.
+ */
+int wheel_next_timeout(struct timer_wheel* w)
+{
+  uint64_t next = 0;
+  int i;
+
+  if (w->count == 0)
+    return -1;
+
+  // Algum nivel de cima tem timers: no maximo ate o fim desta volta.
+  if (w->count != w->level_count[0])
+    next = (w->now | WHEEL_MASK) + 1;
+
+  for (i = 1; i <= WHEEL_SIZE; i++)
+  {
+    uint64_t tick = w->now + i;
+    struct wheel_timer* head = &(w->slots[0][tick & WHEEL_MASK]);
+
+    if ((next != 0) && (tick >= next))
+      break;
+
+    if (head->next != head)
+    {
+      next = tick;
+      break;
+    }
+  }
+
+  return (int)(next - w->now);
+}
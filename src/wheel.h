@@ -0,0 +1,64 @@
+/**
+ * @file wheel.h
+ *
+ * Definicao da roda de timers hierarquica (timer wheel).
+ *
+ * Todo evento com hora marcada passa por aqui: a volta de um cliente
+ * parado pelo controle de banda, o prazo para a request chegar e o
+ * limite de tempo sem atividade.
+ *
+ * A roda tem WHEEL_LEVELS niveis de WHEEL_SIZE posicoes. No primeiro,
+ * cada posicao vale 1ms; em cada nivel seguinte, uma posicao vale uma
+ * volta inteira do nivel anterior. Quando o primeiro nivel completa uma
+ * volta, a posicao correspondente do nivel de cima e 'derramada' para
+ * baixo. Assim agendar, cancelar e expirar um timer custa O(1),
+ * nao importa quantos clientes existam.
+ */
+
+#ifndef WHEEL_H_DEFINED
+#define WHEEL_H_DEFINED
+
+#include <stdint.h>
+
+
+#define WHEEL_BITS    6
+#define WHEEL_SIZE    (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS  4
+
+/** Maior distancia (em ms) que a roda consegue representar - ~4.6 horas */
+#define WHEEL_MAX_DELAY  ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+
+/** Um timer. Deve ficar dentro de quem ele acorda (o c_handler). */
+struct wheel_timer
+{
+  struct wheel_timer *next;  /**< Proximo timer na mesma posicao da roda */
+  struct wheel_timer *prev;  /**< Anterior - NULL quando nao esta agendado */
+  uint64_t expires;          /**< Quando expira, em ms (mesma base de #timer_wheel.now) */
+  int level;                 /**< Em qual nivel da roda ele esta */
+  void* data;                /**< Quem esse timer acorda */
+};
+
+struct timer_wheel
+{
+  uint64_t now;                    /**< O 'agora' da roda, em ms - atualizado por wheel_advance() */
+  int count;                       /**< Quantos timers estao agendados */
+  int level_count[WHEEL_LEVELS];   /**< Quantos timers estao em cada nivel */
+  struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SIZE]; /**< Cabecas (sentinelas) das listas */
+};
+
+/** Funcao chamada para cada timer que expira. */
+typedef void (*wheel_callback)(struct wheel_timer* t, void* arg);
+
+
+void wheel_init(struct timer_wheel* w, uint64_t now);
+void wheel_timer_init(struct wheel_timer* t, void* data);
+int  wheel_pending(struct wheel_timer* t);
+void wheel_add(struct timer_wheel* w, struct wheel_timer* t, uint64_t expires);
+void wheel_del(struct timer_wheel* w, struct wheel_timer* t);
+void wheel_advance(struct timer_wheel* w, uint64_t now, wheel_callback expire, void* arg);
+int  wheel_next_timeout(struct timer_wheel* w);
+
+
+#endif /* WHEEL_H_DEFINED */
@@ -0,0 +1,182 @@
+/**
+ * @file worker.c
+ *
+ * Implementacao dos workers - um loop principal por thread.
+ */
+
+#define _GNU_SOURCE     /* pthread_setaffinity_np() CPU_SET()        */
+
+#include <stdio.h>
+#include <stdlib.h>     /* malloc() free()                           */
+#include <string.h>     /* memset()                                  */
+#include <errno.h>      /* errno                                     */
+#include <unistd.h>     /* close() sysconf()                         */
+#include <pthread.h>    /* pthread_create() pthread_join()           */
+#include <sched.h>      /* cpu_set_t                                 */
+
+#include "worker.h"
+#include "server.h"
+#include "event.h"
+#include "uring.h"
+#include "macros.h"
+#include "metrics.h"
+
+
+/** Prende a thread atual na CPU 'cpu'.
+ *
+ *  @return 0 em sucesso, -1 em caso de erro (errno e setado).
+ */
+static int worker_pin(int cpu)
+{
+  cpu_set_t set;
+  int retval;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  retval = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (retval != 0)
+  {
+    errno = retval;
+    return -1;
+  }
+  return 0;
+}
+
+
+/** O corpo de cada worker: roda o motor de I/O escolhido sobre o
+ *  listener do worker.
+ *
+ *  So retorna em caso de erro.
+ */
+static void* worker_loop(void* arg)
+{
+  struct worker* w = arg;
+
+  metrics_attach(&(w->cfg->metrics[w->id]));
+  if (w->cfg->access_log != NULL)
+    accesslog_attach(&(w->access_log));
+
+  if (w->cpu != -1)
+  {
+    if (worker_pin(w->cpu) == -1)
+      perror("Erro em pthread_setaffinity_np()");
+  }
+
+  if (w->cfg->engine == ENGINE_URING)
+  {
+    uring_run(w->cfg, w->listener);
+
+    // Kernel sem io_uring (ou bloqueado): voltar para o epoll
+    LOG_WARN("io_uring indisponivel, usando epoll");
+  }
+
+  // O accept4() em lote do epoll bloquearia o worker para sempre num
+  // listener bloqueante
+  if (socket_set_nonblocking(w->listener) == 0)
+    event_run(w->cfg, w->listener);
+
+  if (w->cfg->access_log != NULL)
+    accesslog_close(&(w->access_log));
+  close(w->listener);
+  return NULL;
+}
+
+
+/** Cria os listeners e inicia os cfg->workers loops principais.
+ *
+ *  Os listeners (e os access logs) sao criados aqui, antes das threads,
+ *  para que um erro de bind() apareca logo na inicializacao.
+ *  Com um worker so, o loop roda na propria thread que chamou, sem
+ *  SO_REUSEPORT - exatamente como o servidor sempre funcionou.
+ *
+ *  @return -1 em caso de erro. So retorna depois que todos os workers
+ *          terminarem (o que so acontece em erro).
+ */
+int workers_run(struct server_config* cfg)
+{
+  struct worker* workers;
+  long ncpus = 1;
+  int  shared = (cfg->workers > 1);
+  int  started = 0;
+  int  retval;
+  int  i;
+
+  workers = malloc(cfg->workers * sizeof(struct worker));
+  if (workers == NULL)
+  {
+    perror("Erro em workers_run() - malloc()");
+    return -1;
+  }
+  memset(workers, 0, cfg->workers * sizeof(struct worker));
+
+  if (cfg->pin_cpus)
+  {
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+      ncpus = 1;
+  }
+
+  for (i = 0; i < cfg->workers; i++)
+  {
+    workers[i].id  = i;
+    workers[i].cpu = (cfg->pin_cpus) ? (int)(i % ncpus) : -1;
+    workers[i].cfg = cfg;
+
+    // server_start -  muito importante!
+    workers[i].listener = server_start(cfg->port, shared, cfg->backlog);
+    if (workers[i].listener == -1)
+      goto error;
+
+    if ((cfg->access_log != NULL) &&
+        (accesslog_open(&(workers[i].access_log), cfg->access_log, i,
+                        cfg->access_log_size, cfg->access_log_keep) == -1))
+    {
+      perror("Erro em accesslog_open()");
+      close(workers[i].listener);
+      goto error;
+    }
+  }
+
+  if (cfg->workers == 1)
+  {
+    worker_loop(&(workers[0]));
+    free(workers);
+    return -1;
+  }
+
+  for (i = 0; i < cfg->workers; i++)
+  {
+    retval = pthread_create(&(workers[i].thread), NULL, worker_loop, &(workers[i]));
+    if (retval != 0)
+    {
+      errno = retval;
+      perror("Erro em pthread_create()");
+      if (cfg->access_log != NULL)
+        accesslog_close(&(workers[i].access_log));
+      close(workers[i].listener);
+      continue;
+    }
+    started++;
+  }
+  LOG_WRITE("%d workers iniciados", started);
+
+  for (i = 0; i < cfg->workers; i++)
+  {
+    if (workers[i].thread != 0)
+      pthread_join(workers[i].thread, NULL);
+  }
+
+  free(workers);
+  return -1;
+
+error:
+  while (--i >= 0)
+  {
+    if (cfg->access_log != NULL)
+      accesslog_close(&(workers[i].access_log));
+    close(workers[i].listener);
+  }
+  free(workers);
+  return -1;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file worker.h
+ *
+ * Definicao dos workers - um loop principal por thread.
+ *
+ * Com --workers N, cada thread tem o seu proprio listener (todos na
+ * mesma porta, com SO_REUSEPORT), a sua propria lista de c_handlers e o
+ * seu proprio controle de timeouts. O kernel distribui as conexoes entre
+ * os listeners e as threads nunca disputam nada no caminho quente.
+ */
+
+#ifndef WORKER_H_DEFINED
+#define WORKER_H_DEFINED
+
+#include <pthread.h>
+#include "config.h"
+#include "accesslog.h"
+
+
+struct worker
+{
+  pthread_t thread;            /**< A thread que roda o loop deste worker */
+  int id;                      /**< Indice do worker, de 0 a cfg->workers - 1 */
+  int cpu;                     /**< CPU onde a thread fica presa, -1 para nenhuma */
+  int listener;                /**< Listener proprio do worker */
+  struct server_config* cfg;   /**< Configuracao (so leitura, compartilhada) */
+  struct access_log access_log; /**< Segmentos do access log deste worker (--access-log) */
+};
+
+
+int workers_run(struct server_config* cfg);
+
+
+#endif /* WORKER_H_DEFINED */